@@ -0,0 +1,208 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <iostream>
+
+#include "checkpoints.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* sidecar layout (all little-endian): "XCCP", version (16 bits, = 0),
+   reserved (16 bits), then one record per checkpoint:
+
+   frame number (32 bits), length of that frame in the IVF file (32 bits),
+   uncompressed state length (32 bits), compressed state length (32 bits),
+   followed by the zlib-compressed output of Decoder::serialize() */
+
+static constexpr size_t header_len = 8;
+static constexpr size_t record_header_len = 16;
+
+static void append_le32( vector<uint8_t> & out, const uint32_t val )
+{
+  const uint32_t swizzled = htole32( val );
+  const uint8_t * bytes = reinterpret_cast<const uint8_t *>( &swizzled );
+  out.insert( out.end(), bytes, bytes + sizeof( swizzled ) );
+}
+
+CheckpointWriter::CheckpointWriter( const string & ivf_filename )
+  : fd_( SystemCall( Checkpoints::filename( ivf_filename ),
+                     open( Checkpoints::filename( ivf_filename ).c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH ) ) )
+{
+  const uint8_t header[ header_len ] = { 'X', 'C', 'C', 'P', 0, 0, 0, 0 };
+  fd_.write( Chunk( header, header_len ) );
+}
+
+void CheckpointWriter::add( const uint32_t frame_no, const uint32_t frame_length,
+                            const Decoder & decoder )
+{
+  EncoderStateSerializer state;
+  decoder.serialize( state, true );
+
+  vector<uint8_t> record;
+  record.resize( record_header_len + compressBound( state.data().size() ) );
+
+  uLongf compressed_length = record.size() - record_header_len;
+  if ( compress2( record.data() + record_header_len, &compressed_length,
+                  state.data().data(), state.data().size(), Z_BEST_SPEED ) != Z_OK ) {
+    throw internal_error( "checkpoint", "compression failed" );
+  }
+
+  record.resize( record_header_len + compressed_length );
+
+  vector<uint8_t> record_header;
+  append_le32( record_header, frame_no );
+  append_le32( record_header, frame_length );
+  append_le32( record_header, state.data().size() );
+  append_le32( record_header, compressed_length );
+  copy( record_header.begin(), record_header.end(), record.begin() );
+
+  fd_.write( Chunk( record ) );
+}
+
+Checkpoints::Checkpoints( const string & ivf_filename )
+{
+  const string sidecar = filename( ivf_filename );
+
+  if ( access( sidecar.c_str(), R_OK ) != 0 ) {
+    return;
+  }
+
+  /* a bad sidecar only costs the speedup, so it's treated as absent */
+  try {
+    file_.reset( new File( sidecar ) );
+  } catch ( const exception & e ) {
+    cerr << sidecar << ": ignoring checkpoints (" << e.what() << ")" << endl;
+    return;
+  }
+
+  const Chunk contents = file_->chunk();
+
+  if ( contents.size() < header_len or contents( 0, 4 ).to_string() != "XCCP"
+       or contents( 4, 2 ).le16() != 0 ) {
+    cerr << sidecar << ": ignoring checkpoints (not a checkpoint file)" << endl;
+    file_.reset();
+    return;
+  }
+
+  /* a record cut short (by a writer that didn't finish) is ignored */
+  uint64_t position = header_len;
+  while ( position + record_header_len <= contents.size() ) {
+    const Chunk record_header = contents( position, record_header_len );
+    const uint32_t compressed_length = record_header( 12, 4 ).le32();
+
+    if ( position + record_header_len + compressed_length > contents.size() ) {
+      break;
+    }
+
+    entries_.push_back( { uint32_t( record_header( 0, 4 ).le32() ),
+                          uint32_t( record_header( 4, 4 ).le32() ),
+                          uint32_t( record_header( 8, 4 ).le32() ),
+                          contents( position + record_header_len, compressed_length ) } );
+
+    position += record_header_len + compressed_length;
+  }
+}
+
+Optional<Checkpoints::Entry> Checkpoints::closest( const uint32_t frame_no, const IVF & file ) const
+{
+  Optional<Entry> ret;
+
+  for ( const Entry & entry : entries_ ) {
+    if ( entry.frame_no > frame_no or entry.frame_no > file.frame_count()
+         or ( ret.initialized() and entry.frame_no < ret.get().frame_no ) ) {
+      continue;
+    }
+
+    /* a checkpoint from a different encoding of the file is skipped */
+    const uint32_t frame_length = entry.frame_no < file.frame_count()
+                                  ? file.frame_info( entry.frame_no ).length
+                                  : 0;
+
+    if ( entry.frame_length == frame_length ) {
+      ret.reset( entry );
+    }
+  }
+
+  return ret;
+}
+
+/* the most Decoder::serialize() can produce for these dimensions: all three
+   references, uncompressed, plus (much less than) a megabyte for the
+   probability tables and the rest of the state */
+static size_t max_state_length( const uint16_t width, const uint16_t height )
+{
+  const size_t raster_width = 16 * VP8Raster::macroblock_dimension( width );
+  const size_t raster_height = 16 * VP8Raster::macroblock_dimension( height );
+
+  return 3 * ( 5 + raster_width * raster_height * 3 / 2 ) + ( 1 << 20 );
+}
+
+Optional<Decoder> Checkpoints::load( const Entry & entry, const uint16_t width,
+                                     const uint16_t height )
+{
+  /* the length comes from the sidecar, so it's checked before anything
+     that size is allocated */
+  if ( entry.state_length > max_state_length( width, height ) ) {
+    cerr << "ignoring corrupt checkpoint for frame " << entry.frame_no
+         << " (implausible state length)" << endl;
+    return {};
+  }
+
+  try {
+    vector<uint8_t> state( entry.state_length );
+
+    uLongf state_length = state.size();
+    if ( uncompress( state.data(), &state_length,
+                     entry.compressed_state.buffer(), entry.compressed_state.size() ) != Z_OK
+         or state_length != state.size() ) {
+      cerr << "ignoring corrupt checkpoint for frame " << entry.frame_no << endl;
+      return {};
+    }
+
+    EncoderStateDeserializer idata( move( state ) );
+    Decoder decoder = Decoder::deserialize( idata );
+
+    if ( decoder.get_width() != width or decoder.get_height() != height ) {
+      cerr << "ignoring checkpoint for frame " << entry.frame_no
+           << ": its dimensions do not match the file" << endl;
+      return {};
+    }
+
+    return { move( decoder ) };
+  } catch ( const exception & e ) {
+    cerr << "ignoring corrupt checkpoint for frame " << entry.frame_no
+         << " (" << e.what() << ")" << endl;
+    return {};
+  }
+}
@@ -0,0 +1,92 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef CHECKPOINTS_HH
+#define CHECKPOINTS_HH
+
+/* Periodic full decoder states (including all three references) kept in a
+   sidecar next to an IVF file, so that decoding can start at a checkpoint
+   instead of replaying the stream from its beginning. */
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "decoder.hh"
+#include "ivf.hh"
+#include "file.hh"
+#include "file_descriptor.hh"
+#include "optional.hh"
+
+class CheckpointWriter
+{
+private:
+  FileDescriptor fd_;
+
+public:
+  CheckpointWriter( const std::string & ivf_filename );
+
+  /* records the decoder's state before it decodes frame_no, which is
+     frame_length bytes long in the IVF file */
+  void add( const uint32_t frame_no, const uint32_t frame_length, const Decoder & decoder );
+};
+
+class Checkpoints
+{
+public:
+  struct Entry
+  {
+    uint32_t frame_no;
+    uint32_t frame_length;
+    uint32_t state_length;
+    Chunk compressed_state;
+  };
+
+private:
+  std::unique_ptr<File> file_ {};
+  std::vector<Entry> entries_ {};
+
+public:
+  /* no checkpoints if the file has no sidecar */
+  Checkpoints( const std::string & ivf_filename );
+
+  static std::string filename( const std::string & ivf_filename ) { return IVF::checkpoints_filename( ivf_filename ); }
+
+  bool empty() const { return entries_.empty(); }
+  const std::vector<Entry> & entries() const { return entries_; }
+
+  /* the latest checkpoint at or before frame_no that matches the file */
+  Optional<Entry> closest( const uint32_t frame_no, const IVF & file ) const;
+
+  /* the decoder stored at a checkpoint, or nothing (after saying why) if
+     it is corrupt or doesn't fit a width x height file */
+  static Optional<Decoder> load( const Entry & entry, const uint16_t width,
+                                 const uint16_t height );
+};
+
+#endif /* CHECKPOINTS_HH */
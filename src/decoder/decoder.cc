@@ -30,8 +30,10 @@
 #include "uncompressed_chunk.hh"
 #include "frame.hh"
 #include "decoder_state.hh"
+#include "lz.hh"
 
 #include <sstream>
+#include <cstring>
 #include <boost/functional/hash.hpp>
 
 using namespace std;
@@ -51,7 +53,7 @@ Decoder::Decoder(EncoderStateDeserializer &idata)
   assert(idata.remaining() == 0);
 }
 
-size_t Decoder::serialize(EncoderStateSerializer &odata) const {
+size_t Decoder::serialize(EncoderStateSerializer &odata, const bool all_references) const {
   odata.reserve(5);
   odata.put(EncoderSerDesTag::DECODER);
 
@@ -60,7 +62,7 @@ size_t Decoder::serialize(EncoderStateSerializer &odata) const {
 
   // serialize
   len += state_.serialize(odata);
-  len += references_.serialize(odata);
+  len += references_.serialize(odata, all_references);
 
   // update length
   odata.put(len, placeholder);
@@ -80,6 +82,92 @@ Decoder Decoder::deserialize(EncoderStateDeserializer &idata) {
   return Decoder(idata);
 }
 
+size_t Decoder::serialize_delta(EncoderStateSerializer &odata, const Decoder &base) const {
+  if (get_width() != base.get_width() or get_height() != base.get_height()) {
+    throw runtime_error("decoder delta: base has different dimensions");
+  }
+
+  odata.put(EncoderSerDesTag::DECODER_DELTA);
+  size_t placeholder = odata.put((uint32_t) 0);
+  size_t start = odata.data().size();
+
+  odata.put((uint64_t) base.get_hash().hash());
+  odata.put((uint64_t) get_hash().hash());
+
+  // the decoder state is small and mostly like base's, so when the two line
+  // up byte for byte, the XOR of them is sent
+  EncoderStateSerializer state_data, base_state_data;
+  state_.serialize(state_data);
+  base.state_.serialize(base_state_data);
+
+  vector<uint8_t> state_bytes = state_data.data();
+  const bool xored = state_bytes.size() == base_state_data.data().size();
+  if (xored) {
+    for (size_t i = 0; i < state_bytes.size(); i++) {
+      state_bytes[i] ^= base_state_data.data()[i];
+    }
+  }
+
+  vector<uint8_t> compressed;
+  lz_compress(Chunk(state_bytes), compressed);
+
+  odata.put((uint32_t) state_bytes.size());
+  odata.put((uint8_t) xored);
+  odata.put((uint32_t) compressed.size());
+  odata.put_bytes(Chunk(compressed));
+
+  references_.serialize_delta(odata, base.references_);
+
+  uint32_t len = odata.data().size() - start;
+  odata.put(len, placeholder);
+
+  return len + 5;
+}
+
+Decoder Decoder::deserialize_delta(EncoderStateDeserializer &idata, const Decoder &base) {
+  if (idata.get_tag() != EncoderSerDesTag::DECODER_DELTA) {
+    throw runtime_error("decoder delta: wrong tag");
+  }
+
+  idata.get<uint32_t>();
+
+  uint64_t base_hash = idata.get<uint64_t>();
+  uint64_t target_hash = idata.get<uint64_t>();
+
+  if (base_hash != base.get_hash().hash()) {
+    throw runtime_error("decoder delta: made against a different base state");
+  }
+
+  vector<uint8_t> state_bytes(idata.get<uint32_t>());
+  const bool xored = idata.get<uint8_t>();
+  uint32_t compressed_len = idata.get<uint32_t>();
+  lz_decompress(idata.get_bytes(compressed_len), state_bytes.data(), state_bytes.size());
+
+  if (xored) {
+    EncoderStateSerializer base_state_data;
+    base.state_.serialize(base_state_data);
+
+    if (base_state_data.data().size() != state_bytes.size()) {
+      throw runtime_error("decoder delta: decoder state size mismatch");
+    }
+
+    for (size_t i = 0; i < state_bytes.size(); i++) {
+      state_bytes[i] ^= base_state_data.data()[i];
+    }
+  }
+
+  EncoderStateDeserializer state_data(move(state_bytes));
+  DecoderState state = DecoderState::deserialize(state_data);
+
+  Decoder ret(move(state), References::deserialize_delta(idata, base.references_));
+
+  if (ret.get_hash().hash() != target_hash) {
+    throw runtime_error("decoder delta: result does not match the encoded state");
+  }
+
+  return ret;
+}
+
 UncompressedChunk Decoder::decompress_frame( const Chunk & compressed_frame ) const
 {
   /* parse uncompressed data chunk */
@@ -172,9 +260,19 @@ References::References(EncoderStateDeserializer &idata, const uint16_t width, co
   : last( move( idata.get_ref( EncoderSerDesTag::REF_LAST, width, height ) ) )
   , golden( last )
   , alternative( last )
-{}
+{
+  // golden and alternative are only present if they were serialized,
+  // and otherwise stand in for the last reference
+  if (idata.remaining() > 0 and idata.peek_tag() == EncoderSerDesTag::REF_GOLD) {
+    golden = idata.get_ref(EncoderSerDesTag::REF_GOLD, width, height);
+  }
 
-size_t References::serialize(EncoderStateSerializer &odata) const {
+  if (idata.remaining() > 0 and idata.peek_tag() == EncoderSerDesTag::REF_ALT) {
+    alternative = idata.get_ref(EncoderSerDesTag::REF_ALT, width, height);
+  }
+}
+
+size_t References::serialize(EncoderStateSerializer &odata, const bool all_references) const {
   odata.reserve(9);
   odata.put(EncoderSerDesTag::REFERENCES);
 
@@ -186,10 +284,18 @@ size_t References::serialize(EncoderStateSerializer &odata) const {
 
   len += odata.put(last, EncoderSerDesTag::REF_LAST);
 
-  // We don't care about golden or alternative reference!
-  /*len += odata.put(golden, EncoderSerDesTag::REF_GOLD);
-
-  len += odata.put(alternative, EncoderSerDesTag::REF_ALT);*/
+  // ExCamera doesn't care about golden or alternative reference, but
+  // checkpoints need them. A reference that is the same raster as the last
+  // one is left out, and the deserializer fills it back in.
+  if (all_references) {
+    if (&golden.get() != &last.get()) {
+      len += odata.put(golden, EncoderSerDesTag::REF_GOLD);
+    }
+
+    if (&alternative.get() != &last.get()) {
+      len += odata.put(alternative, EncoderSerDesTag::REF_ALT);
+    }
+  }
 
   odata.put(len, placeholder);
 
@@ -211,6 +317,155 @@ References References::deserialize(EncoderStateDeserializer &idata) {
   return References(idata, width, height);
 }
 
+enum class ReferenceDelta : uint8_t { UNCHANGED, SAME_AS_LAST, BLOCKS };
+
+// luma and both chroma blocks of a macroblock, back to back
+static const size_t macroblock_bytes = 16 * 16 + 2 * 8 * 8;
+
+static void put_reference_delta(EncoderStateSerializer &odata, const VP8Raster &target,
+                                const VP8Raster &base) {
+  const unsigned mb_columns = target.width() / 16;
+  const unsigned mb_rows = target.height() / 16;
+
+  vector<uint8_t> bitmap((mb_columns * mb_rows + 7) / 8);
+  vector<uint8_t> xored;
+
+  for (unsigned mb_row = 0; mb_row < mb_rows; mb_row++) {
+    for (unsigned mb_column = 0; mb_column < mb_columns; mb_column++) {
+      array<const TwoD<uint8_t> *, 3> planes = {{&target.Y(), &target.U(), &target.V()}};
+      array<const TwoD<uint8_t> *, 3> base_planes = {{&base.Y(), &base.U(), &base.V()}};
+
+      bool changed = false;
+      for (unsigned p = 0; p < 3 and not changed; p++) {
+        const unsigned size = p == 0 ? 16 : 8;
+        for (unsigned row = 0; row < size and not changed; row++) {
+          changed = memcmp(&planes[p]->at(mb_column * size, mb_row * size + row),
+                           &base_planes[p]->at(mb_column * size, mb_row * size + row), size) != 0;
+        }
+      }
+
+      if (not changed) {
+        continue;
+      }
+
+      const unsigned index = mb_row * mb_columns + mb_column;
+      bitmap[index / 8] |= 1 << (index % 8);
+
+      for (unsigned p = 0; p < 3; p++) {
+        const unsigned size = p == 0 ? 16 : 8;
+        for (unsigned row = 0; row < size; row++) {
+          const uint8_t *pixels = &planes[p]->at(mb_column * size, mb_row * size + row);
+          const uint8_t *base_pixels = &base_planes[p]->at(mb_column * size, mb_row * size + row);
+          for (unsigned i = 0; i < size; i++) {
+            xored.push_back(pixels[i] ^ base_pixels[i]);
+          }
+        }
+      }
+    }
+  }
+
+  if (xored.empty()) {
+    odata.put((uint8_t) ReferenceDelta::UNCHANGED);
+    return;
+  }
+
+  vector<uint8_t> compressed;
+  lz_compress(Chunk(xored), compressed);
+
+  odata.put((uint8_t) ReferenceDelta::BLOCKS);
+  odata.put_bytes(Chunk(bitmap));
+  odata.put((uint32_t) compressed.size());
+  odata.put_bytes(Chunk(compressed));
+}
+
+static RasterHandle get_reference_delta(EncoderStateDeserializer &idata, const RasterHandle &base) {
+  MutableRasterHandle raster(base.get().display_width(), base.get().display_height());
+  VP8Raster &target = raster.get();
+
+  const unsigned mb_columns = target.width() / 16;
+  const unsigned mb_rows = target.height() / 16;
+
+  Chunk bitmap = idata.get_bytes((mb_columns * mb_rows + 7) / 8);
+
+  size_t changed = 0;
+  for (size_t i = 0; i < bitmap.size(); i++) {
+    changed += __builtin_popcount(bitmap(i, 1).octet());
+  }
+
+  vector<uint8_t> xored(changed * macroblock_bytes);
+  uint32_t compressed_len = idata.get<uint32_t>();
+  lz_decompress(idata.get_bytes(compressed_len), xored.data(), xored.size());
+
+  array<TwoD<uint8_t> *, 3> planes = {{&target.Y(), &target.U(), &target.V()}};
+  array<const TwoD<uint8_t> *, 3> base_planes = {{&base.get().Y(), &base.get().U(), &base.get().V()}};
+
+  for (unsigned p = 0; p < 3; p++) {
+    memcpy(&planes[p]->at(0, 0), &base_planes[p]->at(0, 0), planes[p]->width() * planes[p]->height());
+  }
+
+  const uint8_t *next = xored.data();
+
+  for (unsigned index = 0; index < mb_columns * mb_rows; index++) {
+    if (not (bitmap(index / 8, 1).octet() & (1 << (index % 8)))) {
+      continue;
+    }
+
+    const unsigned mb_column = index % mb_columns;
+    const unsigned mb_row = index / mb_columns;
+
+    for (unsigned p = 0; p < 3; p++) {
+      const unsigned size = p == 0 ? 16 : 8;
+      for (unsigned row = 0; row < size; row++) {
+        uint8_t *pixels = &planes[p]->at(mb_column * size, mb_row * size + row);
+        for (unsigned i = 0; i < size; i++) {
+          pixels[i] ^= *next++;
+        }
+      }
+    }
+  }
+
+  return RasterHandle(move(raster));
+}
+
+size_t References::serialize_delta(EncoderStateSerializer &odata, const References &base) const {
+  size_t start = odata.data().size();
+
+  auto put_one = [&](const RasterHandle &ref, const RasterHandle &base_ref, const bool may_alias_last) {
+    if (may_alias_last and &ref.get() == &last.get()) {
+      odata.put((uint8_t) ReferenceDelta::SAME_AS_LAST);
+    } else if (&ref.get() == &base_ref.get()) {
+      odata.put((uint8_t) ReferenceDelta::UNCHANGED);
+    } else {
+      put_reference_delta(odata, ref, base_ref);
+    }
+  };
+
+  put_one(last, base.last, false);
+  put_one(golden, base.golden, true);
+  put_one(alternative, base.alternative, true);
+
+  return odata.data().size() - start;
+}
+
+References References::deserialize_delta(EncoderStateDeserializer &idata, const References &base) {
+  References ret(base);
+
+  auto get_one = [&](RasterHandle &ref, const RasterHandle &base_ref) {
+    switch (static_cast<ReferenceDelta>(idata.get<uint8_t>())) {
+    case ReferenceDelta::UNCHANGED: ref = base_ref; break;
+    case ReferenceDelta::SAME_AS_LAST: ref = ret.last; break;
+    case ReferenceDelta::BLOCKS: ref = get_reference_delta(idata, base_ref); break;
+    default: throw runtime_error("decoder delta: invalid reference");
+    }
+  };
+
+  get_one(ret.last, base.last);
+  get_one(ret.golden, base.golden);
+  get_one(ret.alternative, base.alternative);
+
+  return ret;
+}
+
 bool References::operator==(const References &other) const {
   return last == other.last and
     golden == other.golden and
@@ -144,8 +144,14 @@ struct References
 
   bool operator!=( const References & other ) const { return not operator==( other ); }
 
-  size_t serialize(EncoderStateSerializer &odata) const;
+  /* only the last reference is serialized unless all_references is set */
+  size_t serialize(EncoderStateSerializer &odata, const bool all_references = false) const;
   static References deserialize(EncoderStateDeserializer &idata);
+
+  /* each reference as a bitmap of the macroblocks that differ from base,
+     followed by those macroblocks XORed with base's and compressed */
+  size_t serialize_delta(EncoderStateSerializer &odata, const References &base) const;
+  static References deserialize_delta(EncoderStateDeserializer &idata, const References &base);
 };
 
 using SegmentationMap = TwoD< uint8_t >;
@@ -291,10 +297,15 @@ public:
 
   bool minihash_match( const uint32_t other_minihash ) const;
 
-  size_t serialize(EncoderStateSerializer &odata) const;
+  size_t serialize(EncoderStateSerializer &odata, const bool all_references = false) const;
 
   static Decoder deserialize(EncoderStateDeserializer &idata);
 
+  /* the changes from base, which is identified by its hash; applying them
+     to any other state fails */
+  size_t serialize_delta(EncoderStateSerializer &odata, const Decoder &base) const;
+  static Decoder deserialize_delta(EncoderStateDeserializer &idata, const Decoder &base);
+
   void set_error_concealment( const bool val ) { error_concealment_ = val; }
   bool error_concealment() const { return error_concealment_; }
 };
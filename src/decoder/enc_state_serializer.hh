@@ -31,14 +31,16 @@
 #pragma once
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
-#include <iterator>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "file.hh"
 #include "file_descriptor.hh"
+#include "lz.hh"
 
 enum class EncoderSerDesTag : uint8_t
   { PROB_TABLE
@@ -53,15 +55,36 @@ enum class EncoderSerDesTag : uint8_t
   , REF_GOLD
   , REF_ALT
   , DECODER
+  , DECODER_DELTA
   };
 
+// a reference frame's length field has this bit set if its planes are compressed
+static constexpr uint32_t COMPRESSED_RASTER = 0x80000000;
+
 class EncoderStateSerializer {
   private:
     std::vector<uint8_t> data_ = {};
+    bool compress_rasters_ = false;
+
+    template<typename Plane> void put_plane(const Plane &plane) {
+      const uint8_t *begin = &plane.at(0, 0);
+      data_.insert(data_.end(), begin, begin + plane.width() * plane.height());
+    }
+
+    template<typename Plane> void put_compressed_plane(const Plane &plane) {
+      size_t len_posn = this->put((uint32_t) 0);
+      size_t start = data_.size();
+      lz_compress(Chunk(&plane.at(0, 0), plane.width() * plane.height()), data_);
+      this->put((uint32_t) (data_.size() - start), len_posn);
+    }
 
   public:
     EncoderStateSerializer() {}
 
+    // reference frames are compressed plane by plane (see lz.hh)
+    explicit EncoderStateSerializer(const bool compress_rasters)
+      : compress_rasters_(compress_rasters) {}
+
     void reserve(size_t n) {
       data_.reserve(data_.size() + n);
     }
@@ -89,25 +112,41 @@ class EncoderStateSerializer {
       return offset;
     }
 
+    size_t put_bytes(const Chunk &bytes) {
+      size_t posn = data_.size();
+      data_.insert(data_.end(), bytes.buffer(), bytes.buffer() + bytes.size());
+      return posn;
+    }
+
     size_t put(const VP8Raster &ref, EncoderSerDesTag t) {
       unsigned width = ref.width();
       unsigned height = ref.height();
       uint32_t len = width * height + 2 * (width / 2) * (height / 2);
-      this->reserve(5 + len);
-      this->put(t);
-      this->put(len);
-
-      ref.Y().forall([this](uint8_t &f){ this->put(f); });
-      ref.U().forall([this](uint8_t &f){ this->put(f); });
-      ref.V().forall([this](uint8_t &f){ this->put(f); });
+      size_t posn = this->put(t);
+
+      if (compress_rasters_) {
+        this->reserve(4 + 3 * 4 + len / 2);
+        this->put(len | COMPRESSED_RASTER);
+        put_compressed_plane(ref.Y());
+        put_compressed_plane(ref.U());
+        put_compressed_plane(ref.V());
+      } else {
+        this->reserve(4 + len);
+        this->put(len);
+        put_plane(ref.Y());
+        put_plane(ref.U());
+        put_plane(ref.V());
+      }
 
-      return len + 5;
+      return data_.size() - posn;
     }
 
     void write(const char *filename) {
-      std::ofstream output_file(filename);
-      std::ostream_iterator<uint8_t> output_iter(output_file);
-      std::copy(data_.begin(), data_.end(), output_iter);
+      std::ofstream output_file(filename, std::ios::binary);
+      output_file.write(reinterpret_cast<const char *>(data_.data()), data_.size());
+      if (not output_file) {
+        throw std::runtime_error(std::string("could not write ") + filename);
+      }
     }
 
     void write(const std::string &filename) {
@@ -117,33 +156,71 @@ class EncoderStateSerializer {
     void write(FILE *file) {
       std::fwrite(data_.data(), 1, data_.size(), file);
     }
+
+    const std::vector<uint8_t> & data(void) const { return data_; }
 };
 
-class EncoderStateDeserializer : File {
+class EncoderStateDeserializer {
   private:
+    // the serialized state is either mapped from a file or held in memory
+    std::unique_ptr<File> file_ = {};
+    std::vector<uint8_t> buffer_ = {};
+    Chunk data_;
     size_t ptr_;
 
+    Chunk operator()(const uint64_t &offset, const uint64_t &length) const {
+      return data_(offset, length);
+    }
+
+    // planes are copied straight out of the mapping (or buffer) in one go
+    template<typename Plane> void get_plane(Plane &plane) {
+      const size_t len = plane.width() * plane.height();
+      std::memcpy(&plane.at(0, 0), (*this)(ptr_, len).buffer(), len);
+      ptr_ += len;
+    }
+
+    template<typename Plane> void get_compressed_plane(Plane &plane) {
+      const uint32_t compressed_len = this->get<uint32_t>();
+      const size_t used = lz_decompress((*this)(ptr_, compressed_len),
+                                        &plane.at(0, 0), plane.width() * plane.height());
+      if (used != compressed_len) {
+        throw std::runtime_error("serialized reference has trailing data");
+      }
+      ptr_ += compressed_len;
+    }
+
   public:
     EncoderStateDeserializer(const char *filename)
-      : File(filename)
+      : file_(new File(filename))
+      , data_(file_->chunk())
       , ptr_(0) {}
 
     EncoderStateDeserializer(const std::string &filename)
-      : File(filename.c_str())
+      : file_(new File(filename.c_str()))
+      , data_(file_->chunk())
       , ptr_(0) {}
 
     EncoderStateDeserializer(FILE *file)
-      : File(std::move(FileDescriptor(file)))
+      : file_(new File(std::move(FileDescriptor(file))))
+      , data_(file_->chunk())
       , ptr_(0) {}
 
+    EncoderStateDeserializer(std::vector<uint8_t> &&data)
+      : buffer_(std::move(data))
+      , data_(buffer_)
+      , ptr_(0) {}
+
+    // moving keeps data_ valid: the mapping and the buffer's storage move along
+    EncoderStateDeserializer(EncoderStateDeserializer &&other) = default;
+
     template<typename T, typename F, typename ...Ps> static T build(F f, Ps ...ps) {
       EncoderStateDeserializer idata(f);
       return T::deserialize(idata, std::forward<Ps>(ps)...);
     }
 
     void reset(void) { ptr_ = 0; }
-    size_t remaining(void) const { return chunk().size() - ptr_; }
-    size_t size(void) const { return chunk().size(); }
+    size_t remaining(void) const { return data_.size() - ptr_; }
+    size_t size(void) const { return data_.size(); }
 
     EncoderSerDesTag peek_tag(void) {
       return static_cast<EncoderSerDesTag>((*this)(ptr_, 1).octet());
@@ -163,6 +240,12 @@ class EncoderStateDeserializer : File {
       return ret;
     }
 
+    Chunk get_bytes(const size_t len) {
+      Chunk ret = (*this)(ptr_, len);
+      ptr_ += len;
+      return ret;
+    }
+
     MutableRasterHandle get_ref(EncoderSerDesTag t, const uint16_t width, const uint16_t height) {
       MutableRasterHandle raster(width, height);
 
@@ -176,13 +259,19 @@ class EncoderStateDeserializer : File {
 
         uint32_t expect_len = rwidth * rheight + 2 * (rwidth / 2) * (rheight / 2);
         uint32_t get_len = this->get<uint32_t>();
-        assert(get_len == expect_len);
-        (void) get_len;     // only used in assert
-        (void) expect_len;  // only used in assert
-
-        raster.get().Y().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
-        raster.get().U().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
-        raster.get().V().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
+        if ((get_len & ~COMPRESSED_RASTER) != expect_len) {
+          throw std::runtime_error("serialized reference has the wrong size");
+        }
+
+        if (get_len & COMPRESSED_RASTER) {
+          get_compressed_plane(raster.get().Y());
+          get_compressed_plane(raster.get().U());
+          get_compressed_plane(raster.get().V());
+        } else {
+          get_plane(raster.get().Y());
+          get_plane(raster.get().U());
+          get_plane(raster.get().V());
+        }
       }
 
       return raster;
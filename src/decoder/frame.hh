@@ -32,6 +32,7 @@
 #include "2d.hh"
 #include "block.hh"
 #include "macroblock.hh"
+#include "serialized_frame.hh"
 
 struct References;
 struct Segmentation;
@@ -65,8 +66,11 @@ class Frame
   ProbabilityArray< num_segments > calculate_mb_segment_tree_probs( void ) const;
   SafeArray< Quantizer, num_segments > calculate_segment_quantizers( const Optional< Segmentation > & segmentation ) const;
 
-  std::vector< uint8_t > serialize_first_partition( const ProbabilityTables & probability_tables ) const;
-  std::vector< std::vector< uint8_t > > serialize_tokens( const ProbabilityTables & probability_tables ) const;
+  void serialize_first_partition( const ProbabilityTables & probability_tables,
+                                  std::vector< uint8_t > & output ) const;
+  void serialize_tokens( const ProbabilityTables & probability_tables,
+                         const unsigned int partition,
+                         std::vector< uint8_t > & output ) const;
 
  public:
   void relink_y2_blocks( void );
@@ -104,6 +108,15 @@ class Frame
 
   std::vector< uint8_t > serialize( const ProbabilityTables & probability_tables ) const;
 
+  /* same as above, but replaces the contents of `output`, reusing its storage */
+  void serialize( const ProbabilityTables & probability_tables,
+                  std::vector< uint8_t > & output ) const;
+
+  /* serializes without assembling the frame into one buffer; the pieces of
+     `output` are reused */
+  void serialize( const ProbabilityTables & probability_tables,
+                  SerializedFrame & output ) const;
+
   uint8_t dct_partition_count( void ) const { return 1 << header_.log2_number_of_dct_partitions; }
 
   bool show_frame( void ) const { return show_; }
@@ -89,7 +89,10 @@ FilePlayer::FilePlayer( const string & filename )
 FilePlayer::FilePlayer( const string & filename, IVF && file )
   : FramePlayer( file.width(), file.height() ),
     file_ ( move( file ) ),
-    filename_( filename )
+    filename_( filename ),
+    initial_frame_no_( 0 ),
+    initial_decoder_( decoder_ ),
+    checkpoints_( filename_ )
 {
   if ( file_.fourcc() != "VP80" ) {
     throw Unsupported( "not a VP8 file" );
@@ -103,12 +106,17 @@ FilePlayer::FilePlayer( const string & filename, IVF && file )
     }
     frame_no_++;
   }
+
+  initial_frame_no_ = frame_no_;
 }
 
 FilePlayer::FilePlayer(const string &filename, IVF &&file, EncoderStateDeserializer &idata)
   : FramePlayer(idata)
   , file_(move(file))
   , filename_(filename)
+  , initial_frame_no_(0)
+  , initial_decoder_(decoder_)
+  , checkpoints_(filename_)
 {
   if (file_.fourcc() != "VP80") {
     throw Unsupported( "not a VP8 file" );
@@ -143,6 +151,55 @@ RasterHandle FilePlayer::advance( void )
   throw Unsupported( "hidden frames at end of file" );
 }
 
+void FilePlayer::seek( const unsigned int frame_no )
+{
+  if ( frame_no > file_.frame_count() ) {
+    throw out_of_range( "seek past the end of the file" );
+  }
+
+  if ( frame_no < initial_frame_no_ ) {
+    throw Invalid( "seek before the first decodable frame" );
+  }
+
+  /* decoding can resume from the current position (if it's not past the
+     target), from a key frame, from a checkpoint, or from where the player
+     started */
+  const bool resume_here = frame_no_ <= frame_no;
+  const unsigned int earliest_start = resume_here ? frame_no_ : initial_frame_no_;
+
+  unsigned int start = earliest_start;
+  for ( unsigned int i = frame_no; i > earliest_start; i-- ) {
+    if ( i < file_.frame_count() and file_.frame_info( i ).key_frame ) {
+      start = i;
+      break;
+    }
+  }
+
+  const Optional<Checkpoints::Entry> checkpoint = checkpoints_.closest( frame_no, file_ );
+
+  /* a checkpoint that can't be used is as good as none */
+  Optional<Decoder> restored;
+  if ( checkpoint.initialized() and checkpoint.get().frame_no > start ) {
+    restored = Checkpoints::load( checkpoint.get(), width(), height() );
+  }
+
+  if ( restored.initialized() ) {
+    restored.get().set_error_concealment( decoder_.error_concealment() );
+    decoder_ = move( restored.get() );
+    start = checkpoint.get().frame_no;
+  }
+  else if ( start == earliest_start and not resume_here ) {
+    decoder_ = initial_decoder_;
+  }
+
+  /* a key frame resets the decoder, so the state we have doesn't matter */
+  frame_no_ = start;
+
+  while ( frame_no_ < frame_no ) {
+    decode( file_.frame( frame_no_++ ) );
+  }
+}
+
 bool FilePlayer::eof( void ) const
 {
   return frame_no_ == file_.frame_count();
@@ -35,6 +35,7 @@
 
 #include "ivf.hh"
 #include "decoder.hh"
+#include "checkpoints.hh"
 #include "enc_state_serializer.hh"
 
 class FramePlayer
@@ -78,6 +79,14 @@ private:
   IVF file_;
   unsigned int frame_no_ { 0 };
   std::string filename_;
+
+  /* where decoding started, to come back to when seeking backwards
+     past the last key frame */
+  unsigned int initial_frame_no_;
+  Decoder initial_decoder_;
+
+  Checkpoints checkpoints_;
+
   FilePlayer( const std::string & filename, IVF && file );
   FilePlayer( const std::string & filename, IVF && file, EncoderStateDeserializer & idata );
 
@@ -85,6 +94,10 @@ public:
   FilePlayer( const std::string & filename );
 
   RasterHandle advance();
+
+  /* makes frame_no the next frame to be decoded by advance() */
+  void seek( const unsigned int frame_no );
+
   bool eof() const;
   unsigned int cur_frame_no() const { return frame_no_ - 1; }
 
@@ -102,9 +102,14 @@ private:
   }
 
 public:
-  BoolEncoder() 
+  BoolEncoder() {}
+
+  /* writes into the storage of `buffer`, which is cleared first; a buffer
+     that held the previous frame's output will rarely need to grow */
+  explicit BoolEncoder( std::vector< uint8_t > && buffer )
+    : output_( std::move( buffer ) )
   {
-    output_.reserve( 1024 * 1024 ); //allocate a lot of space so we never have to realloc
+    output_.clear();
   }
 
   void put( const bool value, const Probability probability = 128 )
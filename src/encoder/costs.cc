@@ -2,6 +2,8 @@
 
 #include <algorithm>
 #include <cmath>
+#include <iterator>
+#include <limits>
 
 #include "costs.hh"
 
@@ -198,6 +200,16 @@ void Costs::fill_mode_costs()
     }
   }
 
+  min_bmode_cost = numeric_limits<uint16_t>::max();
+
+  for ( const auto & above_costs : bmode_costs ) {
+    for ( const auto & left_costs : above_costs ) {
+      for ( const uint16_t cost : left_costs ) {
+        min_bmode_cost = min( min_bmode_cost, cost );
+      }
+    }
+  }
+
   // fill mbmode_costs
   compute_cost( mbmode_costs.at( 0 ), kf_y_mode_probs, kf_y_mode_tree );
   compute_cost( mbmode_costs.at( 1 ), k_default_y_mode_probs, y_mode_tree );
@@ -207,13 +219,87 @@ void Costs::fill_mode_costs()
   compute_cost( intra_uv_mode_costs.at( 1 ), k_default_uv_mode_probs, uv_mode_tree );
 }
 
-/*
- * Fill the mode costs for macroblocks predicted with motion vectors
- * (NEARESTMV to SPLITMV).
- */
-void Costs::fill_mv_ref_costs( const ProbabilityArray<num_mv_refs> & mv_mode_probs )
+SafeArray<uint16_t, num_y_modes + num_mv_refs>
+Costs::inter_mbmode_costs( const ProbabilityArray<num_mv_refs> & mv_ref_probs ) const
+{
+  SafeArray<uint16_t, num_y_modes + num_mv_refs> costs = mbmode_costs.at( 1 );
+  compute_cost( costs, mv_ref_probs, mv_ref_tree );
+  return costs;
+}
+
+Costs::Costs( const ProbabilityTables & probability_tables )
+  : token_costs(), mbmode_costs(), mv_component_costs(), mv_sad_costs(),
+    bmode_costs(), min_bmode_cost(), intra_uv_mode_costs()
+{
+  fill_token_costs( probability_tables );
+  fill_mode_costs();
+  fill_mv_component_costs( probability_tables.motion_vector_probs );
+  fill_mv_sad_costs();
+}
+
+CostsCache & CostsCache::global()
+{
+  static CostsCache cache;
+  return cache;
+}
+
+shared_ptr<const Costs> CostsCache::find( const ProbabilityTables & probability_tables,
+                                          const size_t hash )
+{
+  auto range = index_.equal_range( hash );
+
+  for ( auto it = range.first; it != range.second; it++ ) {
+    if ( it->second->probability_tables == probability_tables ) {
+      /* move it to the front */
+      entries_.splice( entries_.begin(), entries_, it->second );
+      return it->second->costs;
+    }
+  }
+
+  return nullptr;
+}
+
+shared_ptr<const Costs> CostsCache::get( const ProbabilityTables & probability_tables )
 {
-  compute_cost( mbmode_costs.at( 1 ), mv_mode_probs, mv_ref_tree );
+  const size_t hash = probability_tables.hash();
+
+  {
+    unique_lock<mutex> lock { mutex_ };
+    shared_ptr<const Costs> costs = find( probability_tables, hash );
+    if ( costs ) {
+      return costs;
+    }
+  }
+
+  /* computing the tables takes a while, don't hold the lock meanwhile */
+  shared_ptr<const Costs> costs = make_shared<const Costs>( probability_tables );
+
+  unique_lock<mutex> lock { mutex_ };
+
+  /* another thread might have beaten us to it */
+  shared_ptr<const Costs> existing = find( probability_tables, hash );
+  if ( existing ) {
+    return existing;
+  }
+
+  entries_.push_front( { probability_tables, costs } );
+  index_.emplace( hash, entries_.begin() );
+
+  if ( entries_.size() > MAX_ENTRIES ) {
+    const auto last = prev( entries_.end() );
+    auto range = index_.equal_range( last->probability_tables.hash() );
+
+    for ( auto it = range.first; it != range.second; it++ ) {
+      if ( it->second == last ) {
+        index_.erase( it );
+        break;
+      }
+    }
+
+    entries_.erase( last );
+  }
+
+  return costs;
 }
 
 /*
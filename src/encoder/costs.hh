@@ -4,6 +4,10 @@
 #define TOKEN_COSTS_HH
 
 #include <array>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include "safe_array.hh"
 #include "decoder.hh"
@@ -21,11 +25,16 @@ private:
                                      const SafeArray<Probability, MV_PROB_CNT> & probs );
 
   template<unsigned int array_size, unsigned int prob_nodes, unsigned int token_count>
-  void compute_cost( SafeArray<uint16_t, array_size> & costs_nodes,
+  static void compute_cost( SafeArray<uint16_t, array_size> & costs_nodes,
                      const SafeArray<Probability, prob_nodes> & probabilities,
                      const SafeArray<TreeNode, token_count> & tree,
                      size_t tree_index = 0, uint16_t current_cost = 0 );
 
+  void fill_token_costs( const ProbabilityTables & probability_tables );
+  void fill_mode_costs();
+  void fill_mv_component_costs( const SafeArray<SafeArray<Probability, MV_PROB_CNT>, 2> & motion_vector_probs );
+  void fill_mv_sad_costs();
+
 public:
   SafeArray<SafeArray<SafeArray<SafeArray<uint16_t,
                                           MAX_ENTROPY_TOKENS>,
@@ -49,14 +58,20 @@ public:
                       num_intra_b_modes>,
             num_intra_b_modes> bmode_costs;
 
+  /* the cheapest entry of bmode_costs, a lower bound on the rate of any
+     subblock in a B_PRED macroblock */
+  uint16_t min_bmode_cost;
+
   SafeArray<SafeArray<uint16_t, num_uv_modes>, 2> intra_uv_mode_costs;
 
-  void fill_token_costs( const ProbabilityTables & probability_tables );
+  /* the tables only depend on the probabilities, so once computed they
+     are never modified and can be shared (see CostsCache) */
+  Costs( const ProbabilityTables & probability_tables );
 
-  void fill_mode_costs();
-  void fill_mv_ref_costs( const ProbabilityArray< num_mv_refs > & mv_ref_probs );
-  void fill_mv_component_costs( const SafeArray<SafeArray<Probability, MV_PROB_CNT>, 2> & motion_vector_probs );
-  void fill_mv_sad_costs();
+  /* mode costs of an inter macroblock, with the costs of the modes that use
+     motion vectors (NEARESTMV to SPLITMV) taken from mv_ref_probs */
+  SafeArray<uint16_t, num_y_modes + num_mv_refs>
+  inter_mbmode_costs( const ProbabilityArray<num_mv_refs> & mv_ref_probs ) const;
 
   uint32_t motion_vector_cost( const MotionVector & mv, size_t weight ) const;
   uint32_t sad_motion_vector_cost( const MotionVector & mv,
@@ -113,4 +128,37 @@ uint32_t Costs::block_cost( const Block & block ) const
   return cost;
 }
 
+/* A process-wide cache of Costs, keyed by the probability tables they were
+   computed from. Encoders that start from the same decoder state (forks,
+   quantizer probes, the other encode jobs of a frame) share one copy instead
+   of each recomputing the tables. Only the most recently used entries are
+   kept. */
+class CostsCache
+{
+private:
+  static constexpr size_t MAX_ENTRIES = 32;
+
+  struct Entry
+  {
+    ProbabilityTables probability_tables;
+    std::shared_ptr<const Costs> costs;
+  };
+
+  std::mutex mutex_ {};
+
+  /* most recently used entries first */
+  std::list<Entry> entries_ {};
+  std::unordered_multimap<size_t, std::list<Entry>::iterator> index_ {};
+
+  std::shared_ptr<const Costs> find( const ProbabilityTables & probability_tables,
+                                     const size_t hash );
+
+  CostsCache() {}
+
+public:
+  static CostsCache & global();
+
+  std::shared_ptr<const Costs> get( const ProbabilityTables & probability_tables );
+};
+
 #endif /* TOKEN_COSTS_HH */
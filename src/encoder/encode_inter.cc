@@ -154,18 +154,20 @@ static const array<int, 128> sad_per_bit16lut = {
 template<>
 void Encoder::update_decoder_state( const InterFrame & frame )
 {
+  DecoderState & decoder_state = mutable_state().decoder_state;
+
   if ( frame.header().refresh_entropy_probs ) {
-    decoder_state_.probability_tables.update( frame.header() );
+    decoder_state.probability_tables.update( frame.header() );
   }
 
   if ( frame.header().mode_lf_adjustments.initialized() ) {
-    if ( decoder_state_.filter_adjustments.initialized() ) {
-      decoder_state_.filter_adjustments.get().update( frame.header() );
+    if ( decoder_state.filter_adjustments.initialized() ) {
+      decoder_state.filter_adjustments.get().update( frame.header() );
     } else {
-      decoder_state_.filter_adjustments.initialize( frame.header() );
+      decoder_state.filter_adjustments.initialize( frame.header() );
     }
   } else {
-    decoder_state_.filter_adjustments.clear();
+    decoder_state.filter_adjustments.clear();
   }
 }
 
@@ -209,7 +211,7 @@ Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & o
 
       reference_mb.Y().inter_predict( this_mv, safe_reference, prediction );
       pred.distortion = sad( original_mb.Y, prediction );
-      pred.rate = costs_.sad_motion_vector_cost( pred.mv, MotionVector(), sad_per_bit16lut[ y_ac_qi ] );
+      pred.rate = costs().sad_motion_vector_cost( pred.mv, MotionVector(), sad_per_bit16lut[ y_ac_qi ] );
       pred.cost = rdcost( pred.rate, pred.distortion, 1, 1 );
 
       if ( pred.cost < best_pred.cost  ) {
@@ -228,6 +230,32 @@ Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & o
   return { origin, first_step };
 }
 
+MotionVector Encoder::motion_search( const VP8Raster::Macroblock & original_mb,
+                                     VP8Raster::Macroblock & temp_mb,
+                                     InterFrameMacroblock & frame_mb,
+                                     const VP8Raster & reference,
+                                     const SafeRaster & safe_reference,
+                                     const MotionVector & base_mv,
+                                     const size_t y_ac_qi ) const
+{
+  MotionVector mv;
+
+  for ( int step = 512; step > 1; ) {
+    MVSearchResult result = diamond_search( original_mb, temp_mb, frame_mb,
+                                            reference, safe_reference,
+                                            base_mv, mv, step, y_ac_qi );
+
+    if ( result.mv == mv ) {
+      break; // there's no need to continue the search
+    }
+
+    mv = result.mv;
+    step = result.first_step;
+  }
+
+  return mv;
+}
+
 void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                      VP8Raster::Macroblock & reconstructed_mb,
                                      VP8Raster::Macroblock & temp_mb,
@@ -235,21 +263,19 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                      const Quantizer & quantizer,
                                      MVComponentCounts & /* component_counts */,
                                      const size_t y_ac_qi,
-                                     const EncoderPass encoder_pass )
+                                     const EncoderPass encoder_pass,
+                                     const FrameAnalysis * analysis )
 {
   MBPredictionData best_pred;
 
-  best_pred = luma_mb_best_prediction_mode( original_mb, reconstructed_mb, temp_mb,
-                                            frame_mb, quantizer, encoder_pass, true );
-
   reference_frame frame_ref = LAST_FRAME;
 
   frame_mb.mutable_header().is_inter_mb = true;
   frame_mb.mutable_header().set_reference( frame_ref );
 
   MotionVector best_mv;
-  const VP8Raster & reference = references_.at( frame_ref );
-  const SafeRaster & safe_reference = safe_references_.get( frame_ref );
+  const VP8Raster & reference = references().at( frame_ref );
+  const SafeRaster & safe_reference = safe_references().get( frame_ref );
 
   const auto reference_mb = reference.macroblock( original_mb.Y.column(),
                                                   original_mb.Y.row() );
@@ -264,7 +290,7 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                                           mv_counts_to_probs.at( counts.at( 2 ) ).at( 2 ),
                                                           mv_counts_to_probs.at( counts.at( 3 ) ).at( 3 ) }};
 
-  costs_.fill_mv_ref_costs( mv_ref_probs );
+  const auto mode_costs = costs().inter_mbmode_costs( mv_ref_probs );
 
   constexpr array<mbmode, 4> inter_modes = { ZEROMV, NEARESTMV, NEARMV, NEWMV, /* SPLIMV */ };
 
@@ -284,20 +310,22 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
         }
       }
 
-      for ( int step = 512; step > 1; ) {
-        MVSearchResult result = diamond_search( original_mb, temp_mb, frame_mb,
-                                                reference, safe_reference,
-                                                best_ref, mv, step, y_ac_qi );
+      if ( analysis ) {
+        /* the search has already been done, relative to a zero motion vector */
+        const auto & mb_analysis = analysis->at( frame_mb.context().column,
+                                                 frame_mb.context().row );
 
-        if ( result.mv == mv ) {
-          break; // there's no need to continue the search
+        if ( not mb_analysis.mv.initialized() ) {
+          continue;
         }
 
-        mv = result.mv;
-        step = result.first_step;
+        mv = Scorer::clamp( mb_analysis.mv.get(), frame_mb.context() );
+      }
+      else {
+        mv = motion_search( original_mb, temp_mb, frame_mb, reference,
+                            safe_reference, best_ref, y_ac_qi );
+        mv += best_ref;
       }
-
-      mv += best_ref;
 
       if ( mv.empty() ) {
         continue;
@@ -328,10 +356,10 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
     reference_mb.macroblock().Y.inter_predict( mv, safe_reference, prediction );
 
     pred.distortion = variance( original_mb.Y, prediction );
-    pred.rate = costs_.mbmode_costs.at( 1 ).at( prediction_mode );
+    pred.rate = mode_costs.at( prediction_mode );
 
     if ( prediction_mode == NEWMV ) {
-      pred.rate += costs_.motion_vector_cost( mv - best_ref, 96 );
+      pred.rate += costs().motion_vector_cost( mv - best_ref, 96 );
     }
 
     /* chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb, frame_mb,
@@ -350,6 +378,12 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
     }
   }
 
+  /* the inter prediction goes first, so that B_PRED can be skipped when it
+     leaves little residual */
+  best_pred = luma_mb_best_prediction_mode( original_mb, reconstructed_mb, temp_mb,
+                                            frame_mb, quantizer, encoder_pass, true,
+                                            best_pred );
+
   if ( best_pred.prediction_mode <= B_PRED ) {
     frame_mb.mutable_header().is_inter_mb = false;
     frame_mb.mutable_header().set_reference( CURRENT_FRAME );
@@ -443,7 +477,7 @@ void Encoder::chroma_mb_inter_predict( const VP8Raster::Macroblock & original_mb
 {
   assert( frame_mb.inter_coded() );
 
-  const VP8Raster & reference = references_.at( frame_mb.header().reference() );
+  const VP8Raster & reference = references().at( frame_mb.header().reference() );
 
   auto reference_mb = reference.macroblock( original_mb.Y.column(),
                                             original_mb.Y.row() );
@@ -515,7 +549,7 @@ void Encoder::optimize_mv_probs( InterFrame & frame, const MVComponentCounts & c
 
       const uint32_t prob = Encoder::calc_prob( false_count, false_count + true_count );
 
-      if ( prob > 1 and prob != decoder_state_.probability_tables.motion_vector_probs.at( i ).at( j ) ) {
+      if ( prob > 1 and prob != decoder_state().probability_tables.motion_vector_probs.at( i ).at( j ) ) {
         frame.mutable_header().mv_prob_update.at( i ).at( j ) = MVProbUpdate( true, ( prob >> 1 ) << 1 );
       }
     }
@@ -578,11 +612,12 @@ template<>
 pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster & raster,
                                                                const QuantIndices & quant_indices,
                                                                const bool update_state,
-                                                               const bool compute_ssim )
+                                                               const bool compute_ssim,
+                                                               const FrameAnalysis * analysis )
 {
-  DecoderState decoder_state_copy = decoder_state_;
+  const shared_ptr<const State> original_state = state_;
 
-  InterFrame & frame = inter_frame_;
+  InterFrame & frame = workspace().inter_frame;
 
   frame.mutable_header().quant_indices = quant_indices;
   frame.mutable_header().refresh_entropy_probs = true;
@@ -593,17 +628,18 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
 
   update_rd_multipliers( quantizer );
 
-  costs_.fill_token_costs( ProbabilityTables() );
+  load_inter_costs( decoder_state().probability_tables );
 
   TokenBranchCounts token_branch_counts;
   MVComponentCounts component_counts;
 
-  costs_.fill_mv_component_costs( decoder_state_.probability_tables.motion_vector_probs );
-  costs_.fill_mv_sad_costs();
-
   raster.macroblocks_forall_ij(
     [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
     {
+      if ( mb_column == 0 ) {
+        check_cancelled();
+      }
+
       auto reconstructed_mb = reconstructed_raster_handle.get().macroblock( mb_column, mb_row );
       auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
       auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
@@ -611,7 +647,8 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
       // Process Y and Y2
       luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
                              quantizer, component_counts,
-                             frame.header().quant_indices.y_ac_qi, FIRST_PASS );
+                             frame.header().quant_indices.y_ac_qi, FIRST_PASS,
+                             analysis );
 
       if ( frame_mb.inter_coded() ) {
         chroma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
@@ -625,7 +662,7 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
       frame_mb.calculate_has_nonzero();
 
       if ( frame_mb.inter_coded() ) {
-        frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
+        frame_mb.reconstruct_inter( quantizer, references(), reconstructed_mb );
       }
       else {
         frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
@@ -645,7 +682,7 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
   RasterHandle immutable_raster( move( reconstructed_raster_handle ) );
 
   if ( not update_state ) {
-    decoder_state_ = decoder_state_copy;
+    state_ = original_state;
   }
 
   return { frame,
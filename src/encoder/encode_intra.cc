@@ -26,6 +26,8 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <typeinfo>
 
@@ -37,11 +39,13 @@ template<>
 void Encoder::update_decoder_state( const KeyFrame & frame )
 {
   // this is a keyframe! reset the decoder state
-  decoder_state_ = DecoderState( frame.header(), width(), height() );
-  references_ = References( width(), height() );
+  State & state = mutable_state();
+
+  state.decoder_state = DecoderState( frame.header(), width(), height() );
+  state.references = References( width(), height() );
 
   if ( frame.header().refresh_entropy_probs ) {
-    decoder_state_.probability_tables.coeff_prob_update( frame.header() );
+    state.decoder_state.probability_tables.coeff_prob_update( frame.header() );
   }
 }
 
@@ -78,6 +82,10 @@ void Encoder::luma_sb_apply_intra_prediction( const VP8Raster::Block4 & original
  * prediction values and no changes will be made in `frame_mb`. In this case,
  * there is another function that take cares of the reconstruction and filling
  * `frame_mb`.
+ *
+ * If `incumbent` is given (e.g. the best inter prediction), `reconstructed_mb`
+ * must already contain its prediction; it is kept unless an intra mode beats
+ * it.
  */
 template<class MacroblockType>
 Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster::Macroblock & original_mb,
@@ -86,74 +94,105 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
                                                                  MacroblockType & frame_mb,
                                                                  const Quantizer & quantizer,
                                                                  const EncoderPass encoder_pass,
-                                                                 const bool interframe ) const
+                                                                 const bool interframe,
+                                                                 const MBPredictionData & incumbent ) const
 {
-  MBPredictionData best_pred;
+  MBPredictionData best_pred = incumbent;
 
   TwoDSubRange<uint8_t, 16, 16> & prediction = temp_mb.Y.mutable_contents();
   auto predictors = reconstructed_mb.Y.predictors();
 
-  unsigned int total_modes = B_PRED;
+  /* same order and tie-breaking as trying B_PRED first, then TM_PRED down to
+   * DC_PRED, then the inter modes: the earlier one wins a tie */
+  for ( unsigned int prediction_mode = TM_PRED; prediction_mode < B_PRED; prediction_mode-- ) {
+    MBPredictionData pred;
+    pred.prediction_mode = ( mbmode )prediction_mode;
+
+    reconstructed_mb.Y.intra_predict( ( mbmode )prediction_mode, predictors, prediction );
+
+    /* Here we compute variance, instead of SSE, because in this case
+     * the average will be taken out from Y2 block into the Y2 block. */
+    pred.distortion = variance( original_mb.Y, prediction );
+
+    pred.rate = costs().mbmode_costs.at( interframe ? 1 : 0 ).at( prediction_mode );
+    pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
+                        DISTORTION_MULTIPLIER );
+
+    if ( pred.cost < best_pred.cost
+         or ( pred.cost == best_pred.cost and best_pred.prediction_mode > B_PRED ) ) {
+      reconstructed_mb.Y.mutable_contents().copy_from( prediction );
+      best_pred = pred;
+    }
+  }
 
   if ( encode_quality_ == REALTIME_QUALITY and typeid( frame_mb ) == typeid( InterFrameMacroblock ) ) {
     // When running the real time mode, we don't consider B_PRED for inter-frames
     // macroblocks.
-    total_modes = B_PRED - 1;
+    return best_pred;
   }
 
-  /* Because of the way that reconstructed_mb is used as a buffer to store the
-   * best prediction result, it is necessary to first examine the B_PRED and
-   * then the other prediction modes. */
-  for ( unsigned int prediction_mode = total_modes; prediction_mode < num_y_modes; prediction_mode-- ) {
-    MBPredictionData pred;
-    pred.prediction_mode = ( mbmode )prediction_mode;
+  /* B_PRED costs at least its mode cost plus the cheapest subblock mode for
+   * each subblock, even with no distortion at all. */
+  const uint32_t b_pred_min_rate = costs().mbmode_costs.at( interframe ? 1 : 0 ).at( B_PRED )
+                                   + 16 * costs().min_bmode_cost;
 
-    if ( prediction_mode == B_PRED ) {
-      pred.cost = 0;
-      pred.rate = costs_.mbmode_costs.at( interframe ? 1 : 0 ).at( B_PRED );
-      pred.distortion = 0;
+  if ( best_pred.cost < rdcost( b_pred_min_rate, 0, RATE_MULTIPLIER, DISTORTION_MULTIPLIER ) ) {
+    return best_pred;
+  }
 
-      reconstructed_mb.Y_sub_forall_ij(
-        [&] ( VP8Raster::Block4 & reconstructed_sb, unsigned int sb_column, unsigned int sb_row )
-        {
-          auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-          auto & temp_sb = temp_mb.Y_sub_at( sb_column, sb_row );
-          auto & frame_sb = frame_mb.Y().at( sb_column, sb_row );
+  /* When the residual is already this small (a per-pixel error below a
+   * quarter of the quantizer step), quantization wipes out most of it and
+   * there is little left for B_PRED to gain. This one can change the
+   * outcome, so it's only done when asked for. */
+  if ( skip_small_residual_b_pred_ and best_pred.distortion <= 16u * quantizer.y_ac * quantizer.y_ac ) {
+    return best_pred;
+  }
 
-          const auto above_mode = frame_sb.context().above.initialized()
-            ? frame_sb.context().above.get()->prediction_mode() : B_DC_PRED;
-          const auto left_mode = frame_sb.context().left.initialized()
-            ? frame_sb.context().left.get()->prediction_mode() : B_DC_PRED;
+  /* B_PRED reconstructs directly into `reconstructed_mb`, so hold on to the
+   * prediction that is there in case B_PRED loses. */
+  SafeArray<uint8_t, 16 * 16> best_prediction;
 
-          bmode sb_prediction_mode = luma_sb_intra_predict( original_sb,
-            reconstructed_sb, temp_sb, costs_.bmode_costs.at( above_mode ).at( left_mode ) );
+  for ( unsigned int row = 0; row < 16; row++ ) {
+    memcpy( &best_prediction.at( 16 * row ), &reconstructed_mb.Y.contents().at( 0, row ), 16 );
+  }
 
-          pred.rate += costs_.bmode_costs.at( above_mode ).at( left_mode ).at( sb_prediction_mode );
-          pred.distortion += sse( original_sb, reconstructed_sb.contents() );
+  MBPredictionData pred;
+  pred.prediction_mode = B_PRED;
+  pred.rate = costs().mbmode_costs.at( interframe ? 1 : 0 ).at( B_PRED );
+  pred.distortion = 0;
 
-          luma_sb_apply_intra_prediction( original_sb, reconstructed_sb, frame_sb,
-                                          quantizer, sb_prediction_mode, encoder_pass );
-        }
-      );
+  reconstructed_mb.Y_sub_forall_ij(
+    [&] ( VP8Raster::Block4 & reconstructed_sb, unsigned int sb_column, unsigned int sb_row )
+    {
+      auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
+      auto & temp_sb = temp_mb.Y_sub_at( sb_column, sb_row );
+      auto & frame_sb = frame_mb.Y().at( sb_column, sb_row );
 
-      pred.cost = rdcost( pred.rate, pred.distortion,
-                          RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
-    }
-    else {
-      reconstructed_mb.Y.intra_predict( ( mbmode )prediction_mode, predictors, prediction );
+      const auto above_mode = frame_sb.context().above.initialized()
+        ? frame_sb.context().above.get()->prediction_mode() : B_DC_PRED;
+      const auto left_mode = frame_sb.context().left.initialized()
+        ? frame_sb.context().left.get()->prediction_mode() : B_DC_PRED;
+
+      bmode sb_prediction_mode = luma_sb_intra_predict( original_sb,
+        reconstructed_sb, temp_sb, costs().bmode_costs.at( above_mode ).at( left_mode ) );
 
-      /* Here we compute variance, instead of SSE, because in this case
-       * the average will be taken out from Y2 block into the Y2 block. */
-      pred.distortion = variance( original_mb.Y, prediction );
+      pred.rate += costs().bmode_costs.at( above_mode ).at( left_mode ).at( sb_prediction_mode );
+      pred.distortion += sse( original_sb, reconstructed_sb.contents() );
 
-      pred.rate = costs_.mbmode_costs.at( interframe ? 1 : 0 ).at( prediction_mode );
-      pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
-                          DISTORTION_MULTIPLIER );
+      luma_sb_apply_intra_prediction( original_sb, reconstructed_sb, frame_sb,
+                                      quantizer, sb_prediction_mode, encoder_pass );
     }
+  );
 
-    if ( pred.cost < best_pred.cost ) {
-      reconstructed_mb.Y.mutable_contents().copy_from( prediction );
-      best_pred = pred;
+  pred.cost = rdcost( pred.rate, pred.distortion,
+                      RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+
+  if ( pred.cost <= best_pred.cost ) {
+    best_pred = pred;
+  }
+  else {
+    for ( unsigned int row = 0; row < 16; row++ ) {
+      memcpy( &reconstructed_mb.Y.mutable_contents().at( 0, row ), &best_prediction.at( 16 * row ), 16 );
     }
   }
 
@@ -268,7 +307,7 @@ Encoder::MBPredictionData Encoder::chroma_mb_best_prediction_mode( const VP8Rast
     pred.distortion = sse( original_mb.U, u_prediction )
                     + sse( original_mb.V, v_prediction );
 
-    pred.rate = costs_.intra_uv_mode_costs.at( interframe ).at( prediction_mode );
+    pred.rate = costs().intra_uv_mode_costs.at( interframe ).at( prediction_mode );
     pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
                         DISTORTION_MULTIPLIER );
 
@@ -354,6 +393,49 @@ void Encoder::chroma_mb_intra_predict( const VP8Raster::Macroblock & original_mb
                                     best_pred.prediction_mode, encoder_pass );
 }
 
+/*
+ * Picks the subblock modes worth trying (as a bitmask of bmodes) from the
+ * direction of the local gradient: a block with vertical edges (changing
+ * mostly from left to right) is best predicted from above, one with
+ * horizontal edges from the left, and a flat block by any of the simple
+ * modes. DC and TM are always tried. This is a guess that can miss the best
+ * mode, so it's only used with set_gradient_b_modes().
+ */
+static uint16_t candidate_b_modes( const VP8Raster::Block4 & original_sb )
+{
+  uint32_t horizontal_gradient = 0;
+  uint32_t vertical_gradient = 0;
+
+  for ( unsigned int row = 0; row < 4; row++ ) {
+    for ( unsigned int column = 0; column < 4; column++ ) {
+      if ( column > 0 ) {
+        horizontal_gradient += abs( original_sb.at( column, row ) - original_sb.at( column - 1, row ) );
+      }
+
+      if ( row > 0 ) {
+        vertical_gradient += abs( original_sb.at( column, row ) - original_sb.at( column, row - 1 ) );
+      }
+    }
+  }
+
+  auto mode_bit = [] ( const bmode mode ) { return 1u << mode; };
+
+  if ( horizontal_gradient + vertical_gradient < 16 ) {
+    return mode_bit( B_DC_PRED ) | mode_bit( B_TM_PRED )
+         | mode_bit( B_VE_PRED ) | mode_bit( B_HE_PRED );
+  }
+  else if ( horizontal_gradient > 2 * vertical_gradient ) {
+    return mode_bit( B_DC_PRED ) | mode_bit( B_TM_PRED )
+         | mode_bit( B_VE_PRED ) | mode_bit( B_VR_PRED ) | mode_bit( B_VL_PRED );
+  }
+  else if ( vertical_gradient > 2 * horizontal_gradient ) {
+    return mode_bit( B_DC_PRED ) | mode_bit( B_TM_PRED )
+         | mode_bit( B_HE_PRED ) | mode_bit( B_HD_PRED ) | mode_bit( B_HU_PRED );
+  }
+
+  return ( 1u << num_intra_b_modes ) - 1;
+}
+
 /* This function outputs the prediction values to 'reconstructed_sb'
  * and returns the prediction mode.
  */
@@ -368,7 +450,15 @@ bmode Encoder::luma_sb_intra_predict( const VP8Raster::Block4 & original_sb,
 
   auto predictors = reconstructed_sb.predictors();
 
+  const uint16_t candidates = gradient_b_modes_
+                               ? candidate_b_modes( original_sb )
+                               : ( 1u << num_intra_b_modes ) - 1;
+
   for ( unsigned int prediction_mode = 0; prediction_mode < num_intra_b_modes; prediction_mode++ ) {
+    if ( not ( ( candidates >> prediction_mode ) & 1 ) ) {
+      continue;
+    }
+
     reconstructed_sb.intra_predict( ( bmode )prediction_mode, predictors, prediction );
 
     uint32_t distortion = sse( original_sb, prediction );
@@ -389,12 +479,13 @@ template<>
 pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & raster,
                                                            const QuantIndices & quant_indices,
                                                            const bool update_state,
-                                                           const bool compute_ssim )
+                                                           const bool compute_ssim,
+                                                           const FrameAnalysis * )
 {
-  DecoderState decoder_state_copy = decoder_state_;
-  decoder_state_ = DecoderState( width(), height() );
+  const shared_ptr<const State> original_state = state_;
+  mutable_state().decoder_state = DecoderState( width(), height() );
 
-  KeyFrame & frame = key_frame_;
+  KeyFrame & frame = workspace().key_frame;
 
   frame.mutable_header().quant_indices = quant_indices;
   frame.mutable_header().refresh_entropy_probs = true;
@@ -404,6 +495,10 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
 
   update_rd_multipliers( quantizer );
 
+  /* a key frame starts from the default probabilities; don't use whatever
+     tables this thread's workspace was left with */
+  load_costs( decoder_state().probability_tables );
+
   TokenBranchCounts token_branch_counts;
 
   for ( size_t pass = FIRST_PASS;
@@ -411,13 +506,17 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
         pass++ ) {
 
     if ( pass == SECOND_PASS ) {
-      costs_.fill_token_costs( decoder_state_.probability_tables );
+      load_costs( decoder_state().probability_tables );
       token_branch_counts = TokenBranchCounts();
     }
 
     raster.macroblocks_forall_ij(
       [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
       {
+        if ( mb_column == 0 ) {
+          check_cancelled();
+        }
+
         auto reconstructed_mb = reconstructed_raster_handle.get().macroblock( mb_column, mb_row );
         auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
         auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
@@ -448,7 +547,7 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
   RasterHandle immutable_raster( move( reconstructed_raster_handle ) );
 
   if ( not update_state ) {
-    decoder_state_ = decoder_state_copy;
+    state_ = original_state;
   }
 
   return { frame,
@@ -44,6 +44,7 @@ using namespace std;
 #include "encode_intra.cc"
 #include "reencode.cc"
 #include "size_estimation.cc"
+#include "frame_analysis.cc"
 
 unsigned Encoder::calc_prob( unsigned false_count, unsigned total )
 {
@@ -68,111 +69,142 @@ void VP8Raster::Block<size>::inter_predict( const MotionVector & mv,
 }
 
 /* Encoder */
+Encoder::State::State( const DecoderState & decoder_state,
+                       const References & references )
+  : decoder_state( decoder_state ), references( references ),
+    safe_references( references )
+{}
+
+Encoder::Workspace::Workspace( const uint16_t width, const uint16_t height )
+  : width( width ), height( height ),
+    temp_raster_handle( width, height ),
+    key_frame( width, height ),
+    subsampled_key_frame( width / WIDTH_SAMPLE_DIMENSION_FACTOR,
+                          height / HEIGHT_SAMPLE_DIMENSION_FACTOR,
+                          subsampled_frame_pool<KeyFrame>() ),
+    inter_frame( width, height ),
+    subsampled_inter_frame( width / WIDTH_SAMPLE_DIMENSION_FACTOR,
+                            height / HEIGHT_SAMPLE_DIMENSION_FACTOR,
+                            subsampled_frame_pool<InterFrame>() ),
+    costs( CostsCache::global().get( ProbabilityTables() ) )
+{}
+
 Encoder::Encoder( const uint16_t s_width,
                   const uint16_t s_height,
                   const bool two_pass,
                   const EncoderQuality quality )
-  : decoder_state_( s_width, s_height ),
-    references_( width(), height() ),
-    safe_references_( references_ ), has_state_( false ), costs_(),
-    two_pass_encoder_( two_pass ), encode_quality_( quality )
-{
-  costs_.fill_mode_costs();
-}
+  : state_( make_shared<State>( DecoderState( s_width, s_height ),
+                                References( s_width, s_height ) ) ),
+    has_state_( false ), two_pass_encoder_( two_pass ),
+    encode_quality_( quality )
+{}
 
 Encoder::Encoder( const Decoder & decoder, const bool two_pass,
                   const EncoderQuality quality )
-  : decoder_state_( decoder.get_state() ), references_( decoder.get_references() ),
-    safe_references_( references_ ), has_state_( true ), costs_(),
-    two_pass_encoder_( two_pass ), encode_quality_( quality )
+  : state_( make_shared<State>( decoder.get_state(), decoder.get_references() ) ),
+    has_state_( true ), two_pass_encoder_( two_pass ),
+    encode_quality_( quality )
+{}
+
+Encoder::State & Encoder::mutable_state()
 {
-  costs_.fill_mode_costs();
+  /* copy-on-write: if any other Encoder is still looking at this state,
+     make a private copy before modifying it */
+  if ( state_.use_count() > 1 ) {
+    state_ = make_shared<State>( *state_ );
+  }
+
+  return const_cast<State &>( *state_ );
 }
 
-Encoder::Encoder( const Encoder & encoder )
-  : decoder_state_( encoder.decoder_state_ ),
-    references_( encoder.references_ ),
-    safe_references_( encoder.safe_references_ ),
-    has_state_( encoder.has_state_ ), costs_( encoder.costs_ ),
-    two_pass_encoder_( encoder.two_pass_encoder_ ),
-    encode_quality_( encoder.encode_quality_ ),
-    loop_filter_level_( encoder.loop_filter_level_ ),
-    last_y_ac_qi_( encoder.last_y_ac_qi_ ),
-    encode_stats_( encoder.encode_stats_ )
-{}
+Encoder::Workspace & Encoder::workspace() const
+{
+  thread_local unique_ptr<Workspace> workspace;
 
-Encoder::Encoder( Encoder && encoder )
-  : decoder_state_( move( encoder.decoder_state_ ) ),
-    references_( move( encoder.references_ ) ),
-    safe_references_( move( encoder.safe_references_ ) ),
-    has_state_( encoder.has_state_ ), costs_( move( encoder.costs_ ) ),
-    two_pass_encoder_( encoder.two_pass_encoder_ ),
-    encode_quality_( encoder.encode_quality_ ),
-    key_frame_( move( encoder.key_frame_ ) ),
-    subsampled_key_frame_( move( encoder.subsampled_key_frame_ ) ),
-    inter_frame_( move( encoder.inter_frame_ ) ),
-    subsampled_inter_frame_( move( encoder.subsampled_inter_frame_ ) ),
-    loop_filter_level_( move( encoder.loop_filter_level_ ) ),
-    last_y_ac_qi_( move( encoder.last_y_ac_qi_ ) ),
-    encode_stats_( move( encoder.encode_stats_ ) )
-{}
+  if ( not workspace or workspace->width != width()
+       or workspace->height != height() ) {
+    workspace.reset( new Workspace( width(), height() ) );
+  }
 
-Encoder & Encoder::operator=( Encoder && encoder )
+  return *workspace;
+}
+
+void Encoder::load_costs( const ProbabilityTables & probability_tables ) const
 {
-  decoder_state_ = move( encoder.decoder_state_ );
-  references_ = move( encoder.references_ );
-  safe_references_ = move( encoder.safe_references_ );
-  has_state_ = encoder.has_state_;
-  costs_ = move( encoder.costs_ );
-  two_pass_encoder_ = encoder.two_pass_encoder_;
-  encode_quality_ = encoder.encode_quality_;
-  key_frame_ = move( encoder.key_frame_ );
-  subsampled_key_frame_ = move( encoder.subsampled_key_frame_ );
-  inter_frame_ = move( encoder.inter_frame_ );
-  subsampled_inter_frame_ = move( encoder.subsampled_inter_frame_ );
-  loop_filter_level_ = move( encoder.loop_filter_level_ );
-  last_y_ac_qi_ = move( encoder.last_y_ac_qi_ );
-  encode_stats_ = move( encoder.encode_stats_ );
-
-  return *this;
+  workspace().costs = CostsCache::global().get( probability_tables );
+}
+
+void Encoder::load_inter_costs( const ProbabilityTables & probability_tables ) const
+{
+  ProbabilityTables cost_tables;
+  cost_tables.motion_vector_probs = probability_tables.motion_vector_probs;
+  load_costs( cost_tables );
 }
 
 uint32_t Encoder::minihash() const
 {
-  return static_cast<uint32_t>( DecoderHash( decoder_state_.hash(), references_.last.hash(),
-                                references_.golden.hash(), references_.alternative.hash() ).hash() );
+  return static_cast<uint32_t>( DecoderHash( decoder_state().hash(), references().last.hash(),
+                                references().golden.hash(), references().alternative.hash() ).hash() );
 }
 
 template<class FrameType>
-vector<uint8_t> Encoder::write_frame( const FrameType & frame,
+SerializedFrame Encoder::write_frame( const FrameType & frame,
                                       const ProbabilityTables & prob_tables )
 {
   // update the state
   update_decoder_state( frame );
 
   // update the references
+  State & state = mutable_state();
+
   MutableRasterHandle raster { width(), height() };
-  frame.decode( decoder_state_.segmentation, references_, raster );
-  frame.loopfilter( decoder_state_.segmentation, decoder_state_.filter_adjustments, raster );
+  frame.decode( state.decoder_state.segmentation, state.references, raster );
+  frame.loopfilter( state.decoder_state.segmentation, state.decoder_state.filter_adjustments, raster );
   RasterHandle immutable_raster( move( raster ) );
-  frame.copy_to( immutable_raster, references_ );
 
-  safe_references_.last = move( SafeReferences::load( references_.last ) );
-  safe_references_.golden = move( SafeReferences::load( references_.golden ) );
-  safe_references_.alternative = move( SafeReferences::load( references_.alternative ) );
+  const References previous_references = state.references;
+  const SafeReferences previous_safe_references = state.safe_references;
+
+  frame.copy_to( immutable_raster, state.references );
+
+  /* copy_to() only moves handles around, so a reference that is the same
+     raster as before shares the safe copy made of it then: states that keep
+     their golden and altref frames don't each carry copies of them. (this
+     compares the rasters themselves, not their hashes, which would mean
+     hashing every new frame.) */
+  auto same = []( const RasterHandle & a, const RasterHandle & b ) { return &a.get() == &b.get(); };
+
+  auto safe_copy = [&]( const RasterHandle & reference ) -> SafeRasterHandle
+    {
+      if ( same( reference, previous_references.last ) ) { return previous_safe_references.last; }
+      if ( same( reference, previous_references.golden ) ) { return previous_safe_references.golden; }
+      if ( same( reference, previous_references.alternative ) ) { return previous_safe_references.alternative; }
+      return SafeReferences::load( reference );
+    };
+
+  const References & refs = state.references;
+  SafeReferences & safe = state.safe_references;
+
+  safe.last = safe_copy( refs.last );
+  safe.golden = same( refs.golden, refs.last ) ? safe.last : safe_copy( refs.golden );
+  safe.alternative = same( refs.alternative, refs.last ) ? safe.last
+                     : same( refs.alternative, refs.golden ) ? safe.golden
+                     : safe_copy( refs.alternative );
 
   if ( encode_quality_ == REALTIME_QUALITY ) {
     loop_filter_level_.reset( frame.header().loop_filter_level );
     last_y_ac_qi_.reset( frame.header().quant_indices.y_ac_qi );
   }
 
-  return frame.serialize( prob_tables );
+  SerializedFrame output;
+  frame.serialize( prob_tables, output );
+  return output;
 }
 
 template<class FrameType>
-vector<uint8_t> Encoder::write_frame( const FrameType & frame )
+SerializedFrame Encoder::write_frame( const FrameType & frame )
 {
-  return write_frame( frame, decoder_state_.probability_tables );
+  return write_frame( frame, decoder_state().probability_tables );
 }
 
 void Encoder::update_rd_multipliers( const Quantizer & quantizer )
@@ -274,6 +306,8 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
   const uint8_t LEVELS = 2;
   SafeArray<SafeArray<TrellisNode, LEVELS>, 17> trellis;
 
+  const auto & token_costs = costs().token_costs.at( frame_sb.type() );
+
   // setting up the sentinel node for the trellis
   for ( size_t i = 0; i < LEVELS; i++ ) {
     TrellisNode & sentinel_node = trellis.at( coded_length ).at( i );
@@ -335,10 +369,9 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
           size_t current_context = prev_token_class.at( current_node.token );
 
           // cost of the next token based on the *current* context
-          rates[ next ] += costs_.token_costs.at( frame_sb.type() )
-                                             .at( next_band )
-                                             .at( current_context )
-                                             .at( next_node.token );
+          rates[ next ] += token_costs.at( next_band )
+                                      .at( current_context )
+                                      .at( next_node.token );
         }
 
         rd_costs[ next ] = rdcost( rates[ next ], distortions[ next ],
@@ -373,10 +406,9 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
 
   for ( size_t i = 0; i < LEVELS; i++ ) {
     TrellisNode & node = trellis.at( first_index ).at( i );
-    node.rate += costs_.token_costs.at( frame_sb.type() )
-                                   .at( coefficient_to_band.at( first_index ) )
-                                   .at( token_context )
-                                   .at( node.token );
+    node.rate += token_costs.at( coefficient_to_band.at( first_index ) )
+                            .at( token_context )
+                            .at( node.token );
 
     node.cost = rdcost( node.rate, node.distortion, RATE_MULTIPLIER,
                         DISTORTION_MULTIPLIER );
@@ -429,7 +461,7 @@ void Encoder::optimize_probability_tables( FrameType & frame, const TokenBranchC
 
           assert( prob <= 255 );
 
-          if ( prob > 0 and prob != decoder_state_.probability_tables.coeff_probs.at( i ).at( j ).at( k ).at( l ) ) {
+          if ( prob > 0 and prob != decoder_state().probability_tables.coeff_probs.at( i ).at( j ).at( k ).at( l ) ) {
             frame.mutable_header().token_prob_update.at( i ).at( j ).at( k ).at( l ) = TokenProbUpdate( true, prob );
           }
         }
@@ -486,14 +518,16 @@ void Encoder::apply_best_loopfilter_settings( const VP8Raster & original,
     max_lf_level = min( 63u, loop_filter_level_.get() + 1u );
   }
 
+  DecoderState & decoder_state = mutable_state().decoder_state;
+
   for ( uint8_t lf_level = min_lf_level; lf_level <= max_lf_level; lf_level++ ) {
     temp_raster().copy_from( reconstructed );
 
     frame.mutable_header().loop_filter_level = lf_level;
 
-    decoder_state_.filter_adjustments.reset( frame.header() );
+    decoder_state.filter_adjustments.reset( frame.header() );
 
-    frame.loopfilter( decoder_state_.segmentation, decoder_state_.filter_adjustments, temp_raster() );
+    frame.loopfilter( decoder_state.segmentation, decoder_state.filter_adjustments, temp_raster() );
 
     /* XXX This is taking too much time and is very inefficient. */
     double ssim = temp_raster().quality( original );
@@ -508,9 +542,9 @@ void Encoder::apply_best_loopfilter_settings( const VP8Raster & original,
   }
 
   frame.mutable_header().loop_filter_level = best_lf_level;
-  decoder_state_.filter_adjustments.reset( frame.header() );
+  decoder_state.filter_adjustments.reset( frame.header() );
 
-  frame.loopfilter( decoder_state_.segmentation, decoder_state_.filter_adjustments, reconstructed );
+  frame.loopfilter( decoder_state.segmentation, decoder_state.filter_adjustments, reconstructed );
 
   encode_stats_.ssim.reset( best_ssim );
 }
@@ -556,7 +590,23 @@ FrameType & Encoder::encode_with_quantizer_search( const VP8Raster & raster,
   return encode_raster<FrameType>( raster, quant_indices, false ).first;
 }
 
-vector<uint8_t> Encoder::encode_with_quantizer( const VP8Raster & raster, const uint8_t y_ac_qi )
+SerializedFrame Encoder::encode_with_quantizer( const VP8Raster & raster, const uint8_t y_ac_qi )
+{
+  return encode_with_quantizer( raster, y_ac_qi, nullptr );
+}
+
+SerializedFrame Encoder::encode_with_quantizer( const VP8Raster & raster, const uint8_t y_ac_qi,
+                                                const FrameAnalysis & analysis )
+{
+  if ( has_state_ and analysis.reference_hash() != references().last.hash() ) {
+    throw runtime_error( "frame analysis was done against a different reference" );
+  }
+
+  return encode_with_quantizer( raster, y_ac_qi, &analysis );
+}
+
+SerializedFrame Encoder::encode_with_quantizer( const VP8Raster & raster, const uint8_t y_ac_qi,
+                                                const FrameAnalysis * analysis )
 {
   if ( width() != raster.display_width() or height() != raster.display_height() ) {
     throw runtime_error( "scaling is not supported" );
@@ -570,11 +620,11 @@ vector<uint8_t> Encoder::encode_with_quantizer( const VP8Raster & raster, const
     return write_frame( encode_raster<KeyFrame>( raster, quant_indices ).first );
   }
   else {
-    return write_frame( encode_raster<InterFrame>( raster, quant_indices ).first );
+    return write_frame( encode_raster<InterFrame>( raster, quant_indices, false, false, analysis ).first );
   }
 }
 
-vector<uint8_t> Encoder::encode_with_minimum_ssim( const VP8Raster & raster, const double minimum_ssim )
+SerializedFrame Encoder::encode_with_minimum_ssim( const VP8Raster & raster, const double minimum_ssim )
 {
   if ( width() != raster.display_width() or height() != raster.display_height() ) {
     throw runtime_error( "scaling is not supported" );
@@ -589,7 +639,7 @@ vector<uint8_t> Encoder::encode_with_minimum_ssim( const VP8Raster & raster, con
   }
 }
 
-vector<uint8_t> Encoder::encode_with_target_size( const VP8Raster & raster, const size_t target_size ) {
+SerializedFrame Encoder::encode_with_target_size( const VP8Raster & raster, const size_t target_size ) {
   if ( width() != raster.display_width() or height() != raster.display_height() ) {
     throw runtime_error( "scaling is not supported" );
   }
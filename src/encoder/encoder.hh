@@ -33,6 +33,9 @@
 #include <string>
 #include <tuple>
 #include <limits>
+#include <memory>
+#include <atomic>
+#include <stdexcept>
 
 #include "decoder.hh"
 #include "frame.hh"
@@ -44,9 +47,19 @@
 #include "file_descriptor.hh"
 #include "block.hh"
 #include "frame_pool.hh"
+#include "frame_analysis.hh"
 
 const uint8_t DEFAULT_QUANTIZER = 64;
 
+/* thrown by an Encoder whose cancel flag was raised (see set_cancel_flag()) */
+class EncodeCancelled : public std::runtime_error
+{
+public:
+  EncodeCancelled()
+    : runtime_error( "encode cancelled" )
+  {}
+};
+
 enum EncoderPass
 {
   FIRST_PASS,
@@ -118,31 +131,76 @@ private:
                               MV_PROB_CNT>,
                     2> MVComponentCounts;
 
-  DecoderState decoder_state_;
-  uint16_t width() const { return decoder_state_.width; }
-  uint16_t height() const { return decoder_state_.height; }
-  MutableRasterHandle temp_raster_handle_ { width(), height() };
-  References references_;
-  SafeReferences safe_references_;
+  /* The decoder state and the references that this encoder is targeting.
+     Copies of an Encoder share the same State, which is cloned only when one
+     of them needs to modify it (see mutable_state()). */
+  struct State
+  {
+    DecoderState decoder_state;
+    References references;
+    SafeReferences safe_references;
 
-  bool has_state_;
+    State( const DecoderState & decoder_state, const References & references );
+  };
+
+  /* Scratch space used while encoding a frame. Nothing in here outlives a
+     single call to the public encode functions, so it is kept per-thread
+     instead of per-Encoder (see workspace()). */
+  struct Workspace
+  {
+    uint16_t width, height;
+
+    MutableRasterHandle temp_raster_handle;
+
+    KeyFrameHandle key_frame;
+    KeyFrameHandle subsampled_key_frame;
+    InterFrameHandle inter_frame;
+    InterFrameHandle subsampled_inter_frame;
+
+    /* shared with every other encoder using the same probabilities,
+       see load_costs() */
+    std::shared_ptr<const Costs> costs;
+
+    /* output of the size estimation, which only needs its length */
+    std::vector<uint8_t> serialized_frame {};
+
+    Workspace( const uint16_t width, const uint16_t height );
+  };
+
+  std::shared_ptr<const State> state_;
+
+  uint16_t width() const { return state_->decoder_state.width; }
+  uint16_t height() const { return state_->decoder_state.height; }
+
+  const DecoderState & decoder_state() const { return state_->decoder_state; }
+  const References & references() const { return state_->references; }
+  const SafeReferences & safe_references() const { return state_->safe_references; }
 
-  Costs costs_;
+  State & mutable_state();
+
+  bool has_state_;
 
   bool two_pass_encoder_;
   EncoderQuality encode_quality_;
 
-  KeyFrameHandle key_frame_ { width(), height() };
-  KeyFrameHandle subsampled_key_frame_ { uint16_t( width() / WIDTH_SAMPLE_DIMENSION_FACTOR ),
-      uint16_t( height() / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
-      subsampled_frame_pool<KeyFrame>() };
-  InterFrameHandle inter_frame_ { width(), height() };
-  InterFrameHandle subsampled_inter_frame_ { uint16_t( width() / WIDTH_SAMPLE_DIMENSION_FACTOR ),
-      uint16_t( height() / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
-      subsampled_frame_pool<InterFrame>() };
-
   Optional<uint8_t> loop_filter_level_ {};
 
+  /* B_PRED shortcuts that can pick a worse mode than the full search:
+     skip B_PRED when the best residual so far is already small, and only try
+     the subblock modes that follow the block's gradient (both off by default) */
+  bool skip_small_residual_b_pred_ { false };
+  bool gradient_b_modes_ { false };
+
+  /* checked between macroblock rows, see set_cancel_flag() */
+  std::shared_ptr<const std::atomic<bool>> cancelled_ {};
+
+  void check_cancelled() const
+  {
+    if ( cancelled_ and cancelled_->load( std::memory_order_relaxed ) ) {
+      throw EncodeCancelled();
+    }
+  }
+
   /* if set, while encoding with max target size, the search scope for the
      proper quantizer will be:
      last_y_ac_qi_ - a <= y_ac_qi <= last_y_ac_qi_ + a */
@@ -184,6 +242,16 @@ private:
                                  size_t step_size,
                                  const size_t y_ac_qi ) const;
 
+  /* returns the motion vector found by the diamond search, relative to
+     base_mv */
+  MotionVector motion_search( const VP8Raster::Macroblock & original_mb,
+                              VP8Raster::Macroblock & temp_mb,
+                              InterFrameMacroblock & frame_mb,
+                              const VP8Raster & reference,
+                              const SafeRaster & safe_reference,
+                              const MotionVector & base_mv,
+                              const size_t y_ac_qi ) const;
+
   void luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                               VP8Raster::Macroblock & constructed_mb,
                               VP8Raster::Macroblock & temp_mb,
@@ -191,7 +259,8 @@ private:
                               const Quantizer & quantizer,
                               MVComponentCounts & component_counts,
                               const size_t y_ac_qi,
-                              const EncoderPass encoder_pass );
+                              const EncoderPass encoder_pass,
+                              const FrameAnalysis * analysis = nullptr );
 
   void luma_mb_apply_inter_prediction( const VP8Raster::Macroblock & original_mb,
                                        VP8Raster::Macroblock & reconstructed_mb,
@@ -214,7 +283,8 @@ private:
                                                  MacroblockType & frame_mb,
                                                  const Quantizer & quantizer,
                                                  const EncoderPass encoder_pass = FIRST_PASS,
-                                                 const bool interframe = false ) const;
+                                                 const bool interframe = false,
+                                                 const MBPredictionData & incumbent = MBPredictionData() ) const;
 
   template<class MacroblockType>
   void luma_mb_apply_intra_prediction( const VP8Raster::Macroblock & original_mb,
@@ -275,7 +345,18 @@ private:
 
   void check_reset_y2( Y2Block & y2, const Quantizer & quantizer ) const;
 
-  VP8Raster & temp_raster() { return temp_raster_handle_.get(); }
+  Workspace & workspace() const;
+
+  VP8Raster & temp_raster() const { return workspace().temp_raster_handle.get(); }
+  const Costs & costs() const { return *workspace().costs; }
+
+  /* makes costs() refer to the tables for the given probabilities */
+  void load_costs( const ProbabilityTables & probability_tables ) const;
+
+  /* the same for inter frames, whose RD has always priced tokens with the
+     default probabilities; only the motion vector costs follow the given
+     tables */
+  void load_inter_costs( const ProbabilityTables & probability_tables ) const;
 
   /* this function returns the ssim value as the output */
   template<class FrameType>
@@ -299,10 +380,10 @@ private:
   static unsigned calc_prob( unsigned false_count, unsigned total );
 
   template<class FrameType>
-  std::vector<uint8_t> write_frame( const FrameType & frame );
+  SerializedFrame write_frame( const FrameType & frame );
 
   template<class FrameType>
-  std::vector<uint8_t> write_frame( const FrameType & frame, const ProbabilityTables & prob_tables );
+  SerializedFrame write_frame( const FrameType & frame, const ProbabilityTables & prob_tables );
 
 
   /* Encoded frame size estimation */
@@ -334,7 +415,8 @@ private:
   std::pair<FrameType &, double> encode_raster( const VP8Raster & raster,
                                                 const QuantIndices & quant_indices,
                                                 const bool update_state = false,
-                                                const bool compute_ssim = false );
+                                                const bool compute_ssim = false,
+                                                const FrameAnalysis * analysis = nullptr );
 
   template<class FrameType>
   FrameType & encode_with_quantizer_search( const VP8Raster & raster,
@@ -342,6 +424,10 @@ private:
 
   void update_rd_multipliers( const Quantizer & quantizer );
 
+  SerializedFrame encode_with_quantizer( const VP8Raster & raster,
+                                         const uint8_t y_ac_qi,
+                                         const FrameAnalysis * analysis );
+
 public:
   Encoder( const uint16_t s_width, const uint16_t s_height,
            const bool two_pass,
@@ -350,22 +436,34 @@ public:
   Encoder( const Decoder & decoder, const bool two_pass,
            const EncoderQuality quality );
 
-  Encoder( const Encoder & encoder );
+  /* copying an Encoder is cheap: the copy shares its state with the
+     original until either one of them encodes a frame */
+  Encoder( const Encoder & encoder ) = default;
+  Encoder & operator=( const Encoder & encoder ) = default;
 
-  Encoder( Encoder && encoder );
+  Encoder( Encoder && encoder ) = default;
+  Encoder & operator=( Encoder && encoder ) = default;
 
-  Encoder & operator=( Encoder && encoder );
+  SerializedFrame encode_with_minimum_ssim( const VP8Raster & raster,
+                                            const double minimum_ssim );
+
+  SerializedFrame encode_with_quantizer( const VP8Raster & raster,
+                                         const uint8_t y_ac_qi );
 
-  std::vector<uint8_t> encode_with_minimum_ssim( const VP8Raster & raster,
-                                                 const double minimum_ssim );
+  /* Runs the motion search for `raster` against this encoder's last
+   * reference once, so that copies of this encoder can encode the same
+   * raster with different quantizers without repeating it. `y_ac_qi` is the
+   * quantizer the search should be tuned for. */
+  FrameAnalysis analyze( const VP8Raster & raster, const uint8_t y_ac_qi ) const;
 
-  std::vector<uint8_t> encode_with_quantizer( const VP8Raster & raster,
-                                              const uint8_t y_ac_qi );
+  SerializedFrame encode_with_quantizer( const VP8Raster & raster,
+                                         const uint8_t y_ac_qi,
+                                         const FrameAnalysis & analysis );
 
   /* Tries to encode the given raster with the best possible quality, without
    * exceeding the target size. */
-  std::vector<uint8_t> encode_with_target_size( const VP8Raster & raster,
-                                                const size_t target_size );
+  SerializedFrame encode_with_target_size( const VP8Raster & raster,
+                                           const size_t target_size );
 
   void reencode( const std::vector<RasterHandle> & original_rasters,
                  const std::vector<std::pair<Optional<KeyFrame>, Optional<InterFrame> > > & prediction_frames,
@@ -375,10 +473,18 @@ public:
 
   size_t estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi );
 
-  Decoder export_decoder() const { return { decoder_state_, references_ }; }
+  Decoder export_decoder() const { return { decoder_state(), references() }; }
 
   EncodeStats stats() { return encode_stats_; }
 
+  void set_skip_small_residual_b_pred( const bool skip ) { skip_small_residual_b_pred_ = skip; }
+  void set_gradient_b_modes( const bool gradient_b_modes ) { gradient_b_modes_ = gradient_b_modes; }
+
+  /* once the flag is raised, encoding throws EncodeCancelled at the start
+     of the next macroblock row. the encoder's state is left half-updated
+     then, so the encoder has to be thrown away. */
+  void set_cancel_flag( const std::shared_ptr<const std::atomic<bool>> & cancelled ) { cancelled_ = cancelled; }
+
   uint32_t minihash() const;
 };
 
@@ -0,0 +1,83 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "encoder.hh"
+#include "scorer.hh"
+
+using namespace std;
+
+FrameAnalysis Encoder::analyze( const VP8Raster & raster, const uint8_t y_ac_qi ) const
+{
+  if ( width() != raster.display_width() or height() != raster.display_height() ) {
+    throw runtime_error( "scaling is not supported" );
+  }
+
+  /* the macroblocks of the workspace frame are only used for their
+     contexts, which the motion search needs to clamp the vectors */
+  InterFrame & frame = workspace().inter_frame;
+
+  FrameAnalysis analysis { references().last.hash(),
+                           frame.macroblocks().width(),
+                           frame.macroblocks().height() };
+
+  const VP8Raster & reference = references().at( LAST_FRAME );
+  const SafeRaster & safe_reference = safe_references().get( LAST_FRAME );
+
+  raster.macroblocks_forall_ij(
+    [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
+    {
+      if ( mb_column == 0 ) {
+        check_cancelled();
+      }
+
+      auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
+      auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
+      auto & mb_analysis = analysis.at( mb_column, mb_row );
+
+      /* without a state, the next frame will be a key frame */
+      if ( not has_state_ ) {
+        return;
+      }
+
+      /* search the same macroblocks that luma_mb_inter_predict would */
+      if ( encode_quality_ == REALTIME_QUALITY
+           and not ( mb_column % 4 == 0 and mb_row % 4 == 0 ) ) {
+        return;
+      }
+
+      const MotionVector mv = Scorer::clamp( motion_search( original_mb.macroblock(), temp_mb,
+                                                            frame_mb, reference, safe_reference,
+                                                            MotionVector(), y_ac_qi ),
+                                             frame_mb.context() );
+
+      mb_analysis.mv.reset( mv );
+    }
+  );
+
+  return analysis;
+}
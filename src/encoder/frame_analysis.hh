@@ -0,0 +1,82 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef FRAME_ANALYSIS_HH
+#define FRAME_ANALYSIS_HH
+
+#include <vector>
+#include <cassert>
+
+#include "optional.hh"
+#include "vp8_header_structures.hh"
+
+/* Quantizer-independent facts about a raster, relative to the last reference
+   of the encoder that produced it. Computing this once and handing it to
+   several Encoders (forks of the same one, trying different quantizers)
+   saves each of them from redoing the motion search. */
+class FrameAnalysis
+{
+public:
+  struct MacroblockAnalysis
+  {
+    /* best motion vector found against the last reference, if this
+       macroblock was searched */
+    Optional<MotionVector> mv {};
+  };
+
+private:
+  size_t reference_hash_;
+  unsigned int mb_width_, mb_height_;
+  std::vector<MacroblockAnalysis> macroblocks_;
+
+public:
+  FrameAnalysis( const size_t reference_hash,
+                 const unsigned int mb_width, const unsigned int mb_height )
+    : reference_hash_( reference_hash ), mb_width_( mb_width ),
+      mb_height_( mb_height ), macroblocks_( mb_width * mb_height )
+  {}
+
+  size_t reference_hash() const { return reference_hash_; }
+
+  unsigned int mb_width() const { return mb_width_; }
+  unsigned int mb_height() const { return mb_height_; }
+
+  MacroblockAnalysis & at( const unsigned int column, const unsigned int row )
+  {
+    assert( column < mb_width_ and row < mb_height_ );
+    return macroblocks_[ row * mb_width_ + column ];
+  }
+
+  const MacroblockAnalysis & at( const unsigned int column, const unsigned int row ) const
+  {
+    assert( column < mb_width_ and row < mb_height_ );
+    return macroblocks_[ row * mb_width_ + column ];
+  }
+};
+
+#endif /* FRAME_ANALYSIS_HH */
@@ -79,9 +79,9 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
   MVComponentCounts component_counts;
   TokenBranchCounts token_branch_counts;
 
-  ProbabilityTables temp_tables = decoder_state_.probability_tables;
+  ProbabilityTables temp_tables = decoder_state().probability_tables;
   temp_tables.update( if_header );
-  costs_.fill_mv_component_costs( temp_tables.motion_vector_probs );
+  load_inter_costs( temp_tables );
 
   original_raster.macroblocks_forall_ij(
     [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
@@ -107,7 +107,7 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
       frame_mb.calculate_has_nonzero();
 
       if ( frame_mb.inter_coded() ) {
-        frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
+        frame_mb.reconstruct_inter( quantizer, references(), reconstructed_mb );
       }
       else {
         frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
@@ -172,7 +172,7 @@ void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
   case ZEROMV:
   case NEWMV:
   {
-    const VP8Raster & reference = references_.at( frame_mb.header().reference() );
+    const VP8Raster & reference = references().at( frame_mb.header().reference() );
     best_mv = original_fmb.base_motion_vector();
 
     reconstructed_mb.Y.inter_predict( best_mv, reference.Y() );
@@ -181,7 +181,7 @@ void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
 
   case SPLITMV:
   {
-    const VP8Raster & reference = references_.at( frame_mb.header().reference() );
+    const VP8Raster & reference = references().at( frame_mb.header().reference() );
     best_mv = original_fmb.base_motion_vector();
     frame_mb.set_base_motion_vector( best_mv );
 
@@ -212,7 +212,7 @@ void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
                              frame_mb, quantizer, FIRST_PASS );
 
     frame_mb.calculate_has_nonzero();
-    frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
+    frame_mb.reconstruct_inter( quantizer, references(), reconstructed_mb );
   }
   else {
     luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
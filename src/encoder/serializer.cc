@@ -385,9 +385,10 @@ void Macroblock< FrameHeaderType, MacroblockheaderType >::serialize( BoolEncoder
 }
 
 template <class FrameHeaderType, class MacroblockType>
-vector< uint8_t > Frame< FrameHeaderType, MacroblockType >::serialize_first_partition( const ProbabilityTables & probability_tables ) const
+void Frame< FrameHeaderType, MacroblockType >::serialize_first_partition( const ProbabilityTables & probability_tables,
+                                                                          vector< uint8_t > & output ) const
 {
-  BoolEncoder encoder;
+  BoolEncoder encoder( move( output ) );
 
   /* encode frame header */
   encode( encoder, header() );
@@ -401,28 +402,27 @@ vector< uint8_t > Frame< FrameHeaderType, MacroblockType >::serialize_first_part
                                                             segment_tree_probs,
                                                             probability_tables ); } );
 
-  return encoder.finish();
+  output = encoder.finish();
 }
 
 template <class FrameHeaderType, class MacroblockType>
-vector< vector< uint8_t > > Frame< FrameHeaderType, MacroblockType >::serialize_tokens( const ProbabilityTables & probability_tables ) const
-{
-  vector< BoolEncoder > dct_partitions( dct_partition_count() );
-
-  /* serialize every macroblock's tokens */
-  macroblock_headers_.get().forall_ij( [&]( const MacroblockType & macroblock,
-                                            const unsigned int column __attribute((unused)),
-                                            const unsigned int row )
-                                       {
-                                         macroblock.serialize_tokens( dct_partitions.at( row % dct_partition_count() ),
-                                                                      probability_tables ); } );
-
-  /* finish encoding and return the resulting octet sequences */
-  vector< vector< uint8_t > > ret;
-  for ( auto & x : dct_partitions ) {
-    ret.emplace_back( x.finish() );
+void Frame< FrameHeaderType, MacroblockType >::serialize_tokens( const ProbabilityTables & probability_tables,
+                                                                 const unsigned int partition,
+                                                                 vector< uint8_t > & output ) const
+{
+  BoolEncoder encoder( move( output ) );
+
+  /* each partition holds every dct_partition_count()-th row of macroblocks,
+     so only those rows are visited */
+  const TwoD<MacroblockType> & macroblocks = macroblock_headers_.get();
+
+  for ( unsigned int row = partition; row < macroblocks.height(); row += dct_partition_count() ) {
+    for ( unsigned int column = 0; column < macroblocks.width(); column++ ) {
+      macroblocks.at( column, row ).serialize_tokens( encoder, probability_tables );
+    }
   }
-  return ret;
+
+  output = encoder.finish();
 }
 
 template <class FrameHeaderType, class MacroblockheaderType >
@@ -738,92 +738,183 @@ void Block< initial_block_type,
   }
 }
 
-static vector< uint8_t > make_frame( const bool key_frame,
-                                     const bool show_frame,
-                                     const bool experimental,
-                                     const bool reference_update,
-                                     const uint16_t width,
-                                     const uint16_t height,
-                                     const vector< uint8_t > & first_partition,
-                                     const vector< vector< uint8_t > > & dct_partitions )
+/* the pieces of a SerializedFrame holding a VP8 frame */
+enum { FRAME_HEADER, FIRST_PARTITION, PARTITION_SIZES, DCT_PARTITIONS };
+
+/* A freshly constructed SerializedFrame has no storage to reuse, so its
+   pieces are given about as much room as the previous frame serialized on
+   this thread needed, and don't have to grow as they are written. */
+struct PieceSizes
+{
+  size_t first_partition { 0 };
+  size_t dct_partition { 0 };
+};
+
+static PieceSizes & last_piece_sizes()
+{
+  thread_local PieceSizes sizes;
+  return sizes;
+}
+
+static void reserve_like_last_frame( vector< vector< uint8_t > > & pieces )
+{
+  const PieceSizes & last = last_piece_sizes();
+
+  if ( pieces.at( FIRST_PARTITION ).capacity() == 0 ) {
+    pieces.at( FIRST_PARTITION ).reserve( last.first_partition );
+  }
+
+  for ( size_t i = DCT_PARTITIONS; i < pieces.size(); i++ ) {
+    if ( pieces.at( i ).capacity() == 0 ) {
+      pieces.at( i ).reserve( last.dct_partition );
+    }
+  }
+}
+
+static void remember_piece_sizes( const vector< vector< uint8_t > > & pieces )
+{
+  PieceSizes & last = last_piece_sizes();
+
+  last.first_partition = pieces.at( FIRST_PARTITION ).size();
+  last.dct_partition = 0;
+
+  for ( size_t i = DCT_PARTITIONS; i < pieces.size(); i++ ) {
+    last.dct_partition = max( last.dct_partition, pieces.at( i ).size() );
+  }
+}
+
+/* fills in the frame header and the partition sizes, once the partitions
+   have been written */
+static void make_frame( const bool key_frame,
+                        const bool show_frame,
+                        const bool experimental,
+                        const bool reference_update,
+                        const uint16_t width,
+                        const uint16_t height,
+                        vector< vector< uint8_t > > & pieces )
 {
   if ( width > 16383 or height > 16383 ) {
     throw Invalid( "VP8 frame dimensions too large." );
   }
 
-  if ( dct_partitions.empty() ) {
+  if ( pieces.size() <= DCT_PARTITIONS ) {
     throw Invalid( "at least one DCT partition is required." );
   }
 
-  vector< uint8_t > ret;
+  vector< uint8_t > & header = pieces.at( FRAME_HEADER );
+  header.clear();
 
-  const uint32_t first_partition_length = first_partition.size();
+  const uint32_t first_partition_length = pieces.at( FIRST_PARTITION ).size();
 
   /* frame tag */
-  ret.emplace_back( ( !key_frame ) | ( reference_update << 2 ) | ( experimental << 3 ) |
-                    ( show_frame << 4 ) | ( first_partition_length & 0x7 ) << 5 );
-  ret.emplace_back( ( first_partition_length & 0x7f8 ) >> 3 );
-  ret.emplace_back( ( first_partition_length & 0x7f800 ) >> 11 );
+  header.emplace_back( ( !key_frame ) | ( reference_update << 2 ) | ( experimental << 3 ) |
+                       ( show_frame << 4 ) | ( first_partition_length & 0x7 ) << 5 );
+  header.emplace_back( ( first_partition_length & 0x7f8 ) >> 3 );
+  header.emplace_back( ( first_partition_length & 0x7f800 ) >> 11 );
 
   if ( key_frame ) {
     /* start code */
-    ret.emplace_back( 0x9d );
-    ret.emplace_back( 0x01 );
-    ret.emplace_back( 0x2a );
+    header.emplace_back( 0x9d );
+    header.emplace_back( 0x01 );
+    header.emplace_back( 0x2a );
 
     /* width */
-    ret.emplace_back( width & 0xff );
-    ret.emplace_back( (width & 0x3f00) >> 8 );
+    header.emplace_back( width & 0xff );
+    header.emplace_back( (width & 0x3f00) >> 8 );
 
     /* height */
-    ret.emplace_back( height & 0xff );
-    ret.emplace_back( (height & 0x3f00) >> 8 );
+    header.emplace_back( height & 0xff );
+    header.emplace_back( (height & 0x3f00) >> 8 );
   }
 
-  /* first partition */
-  ret.insert( ret.end(), first_partition.begin(), first_partition.end() );
+  /* DCT partition lengths (all but the last) */
+  vector< uint8_t > & partition_sizes = pieces.at( PARTITION_SIZES );
+  partition_sizes.clear();
 
-  /* DCT partition lengths */
-  for ( unsigned int i = 0; i < dct_partitions.size() - 1; i++ ) {
-    const uint32_t length = dct_partitions.at( i ).size();
-    ret.emplace_back( length & 0xff );
-    ret.emplace_back( (length & 0xff00) >> 8 );
-    ret.emplace_back( (length & 0xff0000) >> 16 );
+  for ( unsigned int i = DCT_PARTITIONS; i < pieces.size() - 1; i++ ) {
+    const uint32_t length = pieces.at( i ).size();
+    partition_sizes.emplace_back( length & 0xff );
+    partition_sizes.emplace_back( (length & 0xff00) >> 8 );
+    partition_sizes.emplace_back( (length & 0xff0000) >> 16 );
   }
+}
 
-  for ( const auto & dct_partition : dct_partitions ) {
-    ret.insert( ret.end(), dct_partition.begin(), dct_partition.end() );
-  }
+template <class FrameHeaderType, class MacroblockType>
+void Frame< FrameHeaderType, MacroblockType >::serialize( const ProbabilityTables & probability_tables,
+                                                          vector< uint8_t > & output ) const
+{
+  thread_local SerializedFrame scratch;
 
-  return ret;
+  serialize( probability_tables, scratch );
+  scratch.copy_to( output );
 }
 
+template <class FrameHeaderType, class MacroblockType>
+vector< uint8_t > Frame< FrameHeaderType, MacroblockType >::serialize( const ProbabilityTables & probability_tables ) const
+{
+  vector< uint8_t > output;
+  serialize( probability_tables, output );
+  return output;
+}
+
+
 template <>
-vector<uint8_t> KeyFrame::serialize( const ProbabilityTables & probability_tables ) const
+void KeyFrame::serialize( const ProbabilityTables & probability_tables,
+                          SerializedFrame & output ) const
 {
   ProbabilityTables frame_probability_tables( probability_tables );
   frame_probability_tables.coeff_prob_update( header() );
 
-  return make_frame( true,
-                     show_,
-                     false,
-                     false,
-                     display_width_, display_height_,
-                     serialize_first_partition( frame_probability_tables ),
-                     serialize_tokens( frame_probability_tables ) );
+  auto & pieces = output.mutable_pieces();
+  pieces.resize( DCT_PARTITIONS + dct_partition_count() );
+  reserve_like_last_frame( pieces );
+
+  serialize_first_partition( frame_probability_tables, pieces.at( FIRST_PARTITION ) );
+
+  for ( unsigned int partition = 0; partition < dct_partition_count(); partition++ ) {
+    serialize_tokens( frame_probability_tables, partition, pieces.at( DCT_PARTITIONS + partition ) );
+  }
+
+  make_frame( true,
+              show_,
+              false,
+              false,
+              display_width_, display_height_,
+              pieces );
+
+  remember_piece_sizes( pieces );
 }
 
 template <>
-vector<uint8_t> InterFrame::serialize( const ProbabilityTables & probability_tables ) const
+void InterFrame::serialize( const ProbabilityTables & probability_tables,
+                            SerializedFrame & output ) const
 {
   ProbabilityTables frame_probability_tables( probability_tables );
   frame_probability_tables.update( header() );
 
-  return make_frame( false,
-                     show_,
-                     false,
-                     false,
-                     display_width_, display_height_,
-                     serialize_first_partition( frame_probability_tables ),
-                     serialize_tokens( frame_probability_tables ) );
+  auto & pieces = output.mutable_pieces();
+  pieces.resize( DCT_PARTITIONS + dct_partition_count() );
+  reserve_like_last_frame( pieces );
+
+  serialize_first_partition( frame_probability_tables, pieces.at( FIRST_PARTITION ) );
+
+  for ( unsigned int partition = 0; partition < dct_partition_count(); partition++ ) {
+    serialize_tokens( frame_probability_tables, partition, pieces.at( DCT_PARTITIONS + partition ) );
+  }
+
+  make_frame( false,
+              show_,
+              false,
+              false,
+              display_width_, display_height_,
+              pieces );
+
+  remember_piece_sizes( pieces );
 }
+
+template void KeyFrame::serialize( const ProbabilityTables & probability_tables,
+                                   vector< uint8_t > & output ) const;
+template void InterFrame::serialize( const ProbabilityTables & probability_tables,
+                                     vector< uint8_t > & output ) const;
+template vector< uint8_t > KeyFrame::serialize( const ProbabilityTables & probability_tables ) const;
+template vector< uint8_t > InterFrame::serialize( const ProbabilityTables & probability_tables ) const;
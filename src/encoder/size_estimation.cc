@@ -41,10 +41,10 @@ size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t
       return { column * WIDTH_SAMPLE_DIMENSION_FACTOR, row * HEIGHT_SAMPLE_DIMENSION_FACTOR };
     };
 
-  DecoderState decoder_state_copy = decoder_state_;
-  decoder_state_ = DecoderState( width(), height() );
+  const shared_ptr<const State> original_state = state_;
+  mutable_state().decoder_state = DecoderState( width(), height() );
 
-  KeyFrame & frame = subsampled_key_frame_;
+  KeyFrame & frame = workspace().subsampled_key_frame;
 
   QuantIndices quant_indices;
   quant_indices.y_ac_qi = y_ac_qi;
@@ -59,11 +59,18 @@ size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t
 
   update_rd_multipliers( quantizer );
 
+  /* the default probabilities, as a key frame uses */
+  load_costs( decoder_state().probability_tables );
+
   // TokenBranchCounts token_branch_counts;
 
   frame.mutable_macroblocks().forall_ij(
     [&] ( KeyFrameMacroblock & frame_mb, unsigned int mb_column, unsigned int mb_row )
     {
+      if ( mb_column == 0 ) {
+        check_cancelled();
+      }
+
       const pair<unsigned int, unsigned int> org_mb_location = macroblock_mapper( mb_column, mb_row );
       const unsigned int org_mb_column = org_mb_location.first;
       const unsigned int org_mb_row = org_mb_location.second;
@@ -89,8 +96,9 @@ size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t
   optimize_prob_skip( frame );
   // optimize_probability_tables( frame, token_branch_counts );
 
-  size_t size = frame.serialize( decoder_state_.probability_tables ).size();
-  decoder_state_ = decoder_state_copy;
+  frame.serialize( decoder_state().probability_tables, workspace().serialized_frame );
+  size_t size = workspace().serialized_frame.size();
+  state_ = original_state;
 
   return size * WIDTH_SAMPLE_DIMENSION_FACTOR * HEIGHT_SAMPLE_DIMENSION_FACTOR;
 }
@@ -104,9 +112,7 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
       return make_pair( column * WIDTH_SAMPLE_DIMENSION_FACTOR, row * HEIGHT_SAMPLE_DIMENSION_FACTOR );
     };
 
-  InterFrame & frame = subsampled_inter_frame_;
-
-  DecoderState decoder_state_copy = decoder_state_;
+  InterFrame & frame = workspace().subsampled_inter_frame;
 
   QuantIndices quant_indices;
   quant_indices.y_ac_qi = y_ac_qi;
@@ -124,9 +130,15 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
 
   update_rd_multipliers( quantizer );
 
+  load_inter_costs( decoder_state().probability_tables );
+
   frame.mutable_macroblocks().forall_ij(
   [&] ( InterFrameMacroblock & frame_mb, unsigned int mb_column, unsigned int mb_row )
     {
+      if ( mb_column == 0 ) {
+        check_cancelled();
+      }
+
       const pair<unsigned int, unsigned int> org_mb_location = macroblock_mapper( mb_column, mb_row );
       const unsigned int org_mb_column = org_mb_location.first;
       const unsigned int org_mb_row = org_mb_location.second;
@@ -152,7 +164,7 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
       frame_mb.calculate_has_nonzero();
 
       if ( frame_mb.inter_coded() ) {
-        frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
+        frame_mb.reconstruct_inter( quantizer, references(), reconstructed_mb );
       }
       else {
         frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
@@ -164,8 +176,8 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
   optimize_prob_skip( frame );
   optimize_interframe_probs( frame );
 
-  size_t size = frame.serialize( decoder_state_.probability_tables ).size();
-  decoder_state_ = decoder_state_copy;
+  frame.serialize( decoder_state().probability_tables, workspace().serialized_frame );
+  size_t size = workspace().serialized_frame.size();
 
   return size * WIDTH_SAMPLE_DIMENSION_FACTOR * HEIGHT_SAMPLE_DIMENSION_FACTOR;
 }
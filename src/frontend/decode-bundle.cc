@@ -30,10 +30,12 @@
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <getopt.h>
 
 #include "file_descriptor.hh"
 #include "optional.hh"
 #include "player.hh"
+#include "checkpoints.hh"
 #include "yuv4mpeg.hh"
 
 using namespace std;
@@ -42,16 +44,42 @@ using namespace std;
    xc-decode-bundle: decodes a sequence of IVF files whose
    filenames are given on standard input,
    to a YUV4MPEG video on standard output
+
+   With -f, output starts at the given frame of the first file, and
+   decoding starts at the closest preceding checkpoint or key frame.
 */
 
 int main( int argc, char *argv[] )
 {
   try {
-    if ( argc > 2 ) {
-      cerr << "Usage: " << argv[ 0 ] << " [starting_state]" << endl;
+    unsigned int first_frame = 0;
+
+    while ( true ) {
+      const int opt = getopt( argc, argv, "f:" );
+
+      if ( opt == -1 ) {
+        break;
+      }
+
+      switch ( opt ) {
+      case 'f':
+        first_frame = stoul( optarg );
+        break;
+
+      default:
+        cerr << "Usage: " << argv[ 0 ] << " [-f first_frame] [starting_state]" << endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    if ( argc - optind > 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << " [-f first_frame] [starting_state]" << endl;
       return EXIT_FAILURE;
     }
 
+    const char * starting_state = optind < argc ? argv[ optind ] : nullptr;
+    bool first_file = true;
+
     FileDescriptor stdout( STDOUT_FILENO );
     unique_ptr<FramePlayer> player;
 
@@ -71,8 +99,8 @@ int main( int argc, char *argv[] )
       /* initialize player and output if necessary */
       if ( not player ) {
         cerr << "Initializing with size " << ivf.width() << "x" << ivf.height() << "\n";
-        if (argc > 1) {
-          player.reset( new FramePlayer { move( EncoderStateDeserializer::build<FramePlayer>(argv[1]) ) } );
+        if (starting_state) {
+          player.reset( new FramePlayer { move( EncoderStateDeserializer::build<FramePlayer>(starting_state) ) } );
           assert(ivf.width() == player->width());
           assert(ivf.height() == player->height());
         } else {
@@ -82,7 +110,41 @@ int main( int argc, char *argv[] )
         stdout.write( YUV4MPEGHeader( player->example_raster() ).to_string() );
       }
 
-      if ( not player->current_decoder().minihash_match( ivf.expected_decoder_minihash() ) ) {
+      /* find where to start decoding */
+      const unsigned int output_from = first_file ? first_frame : 0;
+      unsigned int decode_from = 0;
+
+      if ( output_from > 0 ) {
+        if ( output_from >= ivf.frame_count() ) {
+          throw out_of_range( "first frame is past the end of the file" );
+        }
+
+        for ( unsigned int i = output_from; i > 0; i-- ) {
+          if ( ivf.frame_info( i ).key_frame ) {
+            decode_from = i;
+            break;
+          }
+        }
+
+        const Checkpoints checkpoints { filename };
+        const Optional<Checkpoints::Entry> checkpoint = checkpoints.closest( output_from, ivf );
+
+        if ( checkpoint.initialized() and checkpoint.get().frame_no > decode_from ) {
+          Optional<Decoder> restored = Checkpoints::load( checkpoint.get(), ivf.width(), ivf.height() );
+
+          if ( restored.initialized() ) {
+            player->set_decoder( restored.get() );
+            decode_from = checkpoint.get().frame_no;
+          }
+        }
+
+        cerr << "Starting from frame " << decode_from << "\n";
+      }
+
+      first_file = false;
+
+      if ( decode_from == 0
+           and not player->current_decoder().minihash_match( ivf.expected_decoder_minihash() ) ) {
         stringstream error;
         error << hex << "Hash mismatch. Expected " << ivf.expected_decoder_minihash()
               << " but decoder is in state " << player->current_decoder().minihash();
@@ -91,9 +153,9 @@ int main( int argc, char *argv[] )
 
       /* decode file */
       cerr << filename << " entering state: " << *player << "\n";
-      for ( unsigned int frame_no = 0; frame_no < ivf.frame_count(); frame_no++ ) {
+      for ( unsigned int frame_no = decode_from; frame_no < ivf.frame_count(); frame_no++ ) {
         Optional<RasterHandle> raster = player->decode( ivf.frame( frame_no ) );
-        if ( raster.initialized() ) {
+        if ( raster.initialized() and frame_no >= output_from ) {
           YUV4MPEGFrameWriter::write( raster.get(), stdout );
         }
       }
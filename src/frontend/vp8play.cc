@@ -39,7 +39,8 @@ int main( int argc, char *argv[] )
 {
   try {
     if ( argc < 2 ) {
-      cerr << "Usage: " << argv[ 0 ] << " FILENAME [decoder_state]" << endl;
+      cerr << "Usage: " << argv[ 0 ] << " FILENAME [decoder_state]" << endl
+           << "Press Enter for the next frame, or type a frame number to jump to it." << endl;
       return EXIT_FAILURE;
     }
 
@@ -52,7 +53,15 @@ int main( int argc, char *argv[] )
     while ( not player.eof() ) {
       display.draw( player.advance() );
       cerr << "Displaying frame #" << player.cur_frame_no() << "...";
-      getchar();
+
+      string command;
+      if ( not getline( cin, command ) ) {
+        break;
+      }
+
+      if ( not command.empty() ) {
+        player.seek( stoul( command ) );
+      }
     }
   } catch ( const exception & e ) {
     print_exception( argv[ 0 ], e );
@@ -44,6 +44,9 @@ void usage_error( const string & program_name )
   cerr << "Usage: " << program_name << " [options] <state-1> <state-2>" << endl
        << endl
        << "Options:" << endl
+       << " -d <arg>, --delta=<arg>     Also write state-2 as a delta against state-1" << endl
+       << " -a <arg>, --apply=<arg>     Apply the delta in state-2 to state-1 and" << endl
+       << "                               write the resulting state to <arg>" << endl
        << endl;
 }
 
@@ -65,18 +68,31 @@ int main( int argc, char *argv[] )
       return EXIT_FAILURE;
     }
 
+    string delta_output;
+    string apply_output;
+
     const option command_line_options[] = {
+      { "delta", required_argument, nullptr, 'd' },
+      { "apply", required_argument, nullptr, 'a' },
       { 0, 0, nullptr, 0 }
     };
 
     while ( true ) {
-      const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+      const int opt = getopt_long( argc, argv, "d:a:", command_line_options, nullptr );
 
       if ( opt == -1 ) {
         break;
       }
 
       switch( opt ) {
+      case 'd':
+        delta_output = optarg;
+        break;
+
+      case 'a':
+        apply_output = optarg;
+        break;
+
       default:
         throw runtime_error( "getopt_long: unexpected return value." );
       }
@@ -84,15 +100,32 @@ int main( int argc, char *argv[] )
 
     if ( optind + 1 >= argc ) {
       usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
     }
 
     array<const string, 2> state_file = { argv[ optind ], argv[ optind + 1 ] };
 
+    if ( not apply_output.empty() ) {
+      const Decoder base = EncoderStateDeserializer::build<Decoder>( state_file[ 0 ] );
+      EncoderStateDeserializer delta( state_file[ 1 ] );
+
+      EncoderStateSerializer odata;
+      Decoder::deserialize_delta( delta, base ).serialize( odata, true );
+      odata.write( apply_output );
+      return EXIT_SUCCESS;
+    }
+
     array<const Decoder, 2> decoder = {
       EncoderStateDeserializer::build<Decoder>( state_file[ 0 ] ),
       EncoderStateDeserializer::build<Decoder>( state_file[ 1 ] )
     };
 
+    if ( not delta_output.empty() ) {
+      EncoderStateSerializer odata;
+      decoder[ 1 ].serialize_delta( odata, decoder[ 0 ] );
+      odata.write( delta_output );
+    }
+
     bool different = ( decoder[ 0 ] != decoder[ 1 ] );
 
     if ( not different ) {
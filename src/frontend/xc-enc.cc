@@ -45,6 +45,7 @@
 #include "encoder.hh"
 #include "macroblock.hh"
 #include "ivf_writer.hh"
+#include "checkpoints.hh"
 #include "display.hh"
 #include "enc_state_serializer.hh"
 
@@ -61,6 +62,8 @@ void usage_error( const string & program_name )
        << "                                         ivf (default), y4m"                      << endl
        << " -O <arg>, --output-state=<arg>        Output file name for final"                << endl
        << "                                         encoder state (default: none)"           << endl
+       << " -Z, --compress-state                  Compress the reference frames in the"      << endl
+       << "                                         output state"                            << endl
        << " -I <arg>, --input-state=<arg>         Input file name for initial"               << endl
        << "                                         encoder state (default: none)"           << endl
        << " -y, --y-ac-qi=<arg>                   Quantization index for Y"                  << endl
@@ -71,6 +74,15 @@ void usage_error( const string & program_name )
        << "                                         Each line specifies the target size"     << endl
        << "                                         in bytes for the corresponding frame."   << endl
        << " --two-pass                            Do the second encoding pass"               << endl
+       << " --skip-b-pred                         Skip B_PRED when the residual is already"  << endl
+       << "                                         small (faster, may lose quality)"        << endl
+       << " --gradient-b-modes                    Only try the B_PRED subblock modes that"   << endl
+       << "                                         follow the gradient (faster, may lose"   << endl
+       << "                                         quality)"                                << endl
+       << " --fast-b-pred                         Both of the above"                         << endl
+       << " -C <arg>, --checkpoint-interval=<arg> Store a full decoder state every <arg>"    << endl
+       << "                                         frames next to the output (default: 0,"  << endl
+       << "                                         none)"                                   << endl
                                                                                              << endl
        << "Re-encode:"                                                                       << endl
        << " -r, --reencode                        Re-encode"                                 << endl
@@ -82,6 +94,8 @@ void usage_error( const string & program_name )
        << endl;
 }
 
+static constexpr size_t OUTPUT_BUFFER_SIZE = 16 * 1024 * 1024;
+
 size_t read_next_frame_size( istream & in )
 {
   static size_t last_size = numeric_limits<size_t>::max();
@@ -114,10 +128,14 @@ int main( int argc, char *argv[] )
     string frame_sizes_file = "";
     double ssim = 0.99;
     bool two_pass = false;
+    bool skip_b_pred = false;
+    bool gradient_b_modes = false;
     bool re_encode_only = false;
     double kf_q_weight = 1.0;
     bool extra_frame_chunk = false;
     bool no_wait = false;
+    bool compress_state = false;
+    unsigned int checkpoint_interval = 0;
     Optional<uint8_t> y_ac_qi;
     EncoderQuality quality = BEST_QUALITY;
 
@@ -131,6 +149,9 @@ int main( int argc, char *argv[] )
       { "output-state",         required_argument, nullptr, 'O' },
       { "input-state",          required_argument, nullptr, 'I' },
       { "two-pass",             no_argument,       nullptr, '2' },
+      { "fast-b-pred",          no_argument,       nullptr, 'b' },
+      { "skip-b-pred",          no_argument,       nullptr, 'B' },
+      { "gradient-b-modes",     no_argument,       nullptr, 'g' },
       { "y-ac-qi",              required_argument, nullptr, 'y' },
       { "reencode",             no_argument,       nullptr, 'r' },
       { "pred-ivf",             required_argument, nullptr, 'p' },
@@ -140,11 +161,13 @@ int main( int argc, char *argv[] )
       { "quality",              required_argument, nullptr, 'q' },
       { "frame-sizes",          required_argument, nullptr, 'F' },
       { "no-wait",              no_argument,       nullptr, 'W' },
+      { "checkpoint-interval",  required_argument, nullptr, 'C' },
+      { "compress-state",       no_argument,       nullptr, 'Z' },
       { 0, 0, 0, 0 }
     };
 
     while ( true ) {
-      const int opt = getopt_long( argc, argv, "o:s:i:O:I:2y:p:S:rw:eq:F:W", command_line_options, nullptr );
+      const int opt = getopt_long( argc, argv, "o:s:i:O:I:2bBgy:p:S:rw:eq:F:WC:Z", command_line_options, nullptr );
 
       if ( opt == -1 ) {
         break;
@@ -176,6 +199,19 @@ int main( int argc, char *argv[] )
         two_pass = true;
         break;
 
+      case 'b':
+        skip_b_pred = true;
+        gradient_b_modes = true;
+        break;
+
+      case 'B':
+        skip_b_pred = true;
+        break;
+
+      case 'g':
+        gradient_b_modes = true;
+        break;
+
       case 'y':
         y_ac_qi = stoul( optarg );
         encoder_mode = CONSTANT_QUANTIZER;
@@ -218,6 +254,14 @@ int main( int argc, char *argv[] )
         encoder_mode = TARGET_FRAME_SIZE;
         break;
 
+      case 'C':
+        checkpoint_interval = stoul( optarg );
+        break;
+
+      case 'Z':
+        compress_state = true;
+        break;
+
       default:
         throw runtime_error( "getopt_long: unexpected return value." );
       }
@@ -244,7 +288,7 @@ int main( int argc, char *argv[] )
         input_reader = make_shared<YUV4MPEGReader>( FileDescriptor( STDIN_FILENO ) );
       }
       else {
-        input_reader = make_shared<YUV4MPEGReader>( input_file );
+        input_reader = make_yuv4mpeg_reader( input_file );
       }
     }
     else {
@@ -257,7 +301,9 @@ int main( int argc, char *argv[] )
       pred_decoder = EncoderStateDeserializer::build<Decoder>( pred_ivf_initial_state );
     }
 
-    IVFWriter output { output_file, "VP80", input_reader->display_width(), input_reader->display_height(), 1, 1 };
+    /* collect the output in memory and write it out from a separate thread */
+    IVFWriter output { output_file, "VP80", input_reader->display_width(), input_reader->display_height(), 1, 1,
+                       OUTPUT_BUFFER_SIZE, true };
 
     if ( re_encode_only ) {
       /* re-encoding */
@@ -319,7 +365,7 @@ int main( int argc, char *argv[] )
                         extra_frame_chunk, output );
 
       if (output_state != "") {
-        EncoderStateSerializer odata = {};
+        EncoderStateSerializer odata(compress_state);
         encoder.export_decoder().serialize(odata);
         odata.write(output_state);
       }
@@ -332,6 +378,9 @@ int main( int argc, char *argv[] )
         : Encoder( EncoderStateDeserializer::build<Decoder>( input_state ),
                    two_pass, quality );
 
+      encoder.set_skip_small_residual_b_pred( skip_b_pred );
+      encoder.set_gradient_b_modes( gradient_b_modes );
+
       if ( not input_state.empty() ) {
         output.set_expected_decoder_entry_hash( encoder.export_decoder().get_hash().hash() );
       }
@@ -348,27 +397,37 @@ int main( int argc, char *argv[] )
                               ? frame_sizes_if
                               : cin;
 
+      Optional<CheckpointWriter> checkpoints { checkpoint_interval > 0, output_file };
+
       unsigned int frame_no = 0;
       for ( auto raster = input_reader->get_next_frame(); raster.initialized();
             raster = input_reader->get_next_frame() ) {
 
+        /* the decoder's state before this frame, if it's to be checkpointed */
+        Optional<Decoder> decoder_before;
+        if ( checkpoint_interval > 0 and frame_no % checkpoint_interval == 0 ) {
+          decoder_before.initialize( encoder.export_decoder() );
+        }
+
         cerr << "Encoding frame #" << frame_no++ << "...";
         const auto encode_beginning = chrono::system_clock::now();
 
+        SerializedFrame frame;
+
         switch ( encoder_mode ) {
         case MINIMUM_SSIM:
-          output.append_frame( encoder.encode_with_minimum_ssim( raster.get(), ssim ) );
+          frame = encoder.encode_with_minimum_ssim( raster.get(), ssim );
           break;
 
         case CONSTANT_QUANTIZER:
           cerr << " [estimated size=" << encoder.estimate_frame_size( raster.get(), y_ac_qi.get() ) << "] ";
-          output.append_frame( encoder.encode_with_quantizer( raster.get(), y_ac_qi.get() ) );
+          frame = encoder.encode_with_quantizer( raster.get(), y_ac_qi.get() );
           break;
 
         case TARGET_FRAME_SIZE:
         {
           size_t target_size = read_next_frame_size( frame_sizes );
-          output.append_frame( encoder.encode_with_target_size( raster.get(), target_size ) );
+          frame = encoder.encode_with_target_size( raster.get(), target_size );
           cerr << " [target_size=" << target_size << "] ";
           break;
         }
@@ -377,6 +436,12 @@ int main( int argc, char *argv[] )
           throw Unsupported( "unsupported encoder mode." );
         }
 
+        output.append_frame( frame );
+
+        if ( decoder_before.initialized() ) {
+          checkpoints.get().add( frame_no - 1, frame.size(), decoder_before.get() );
+        }
+
         const auto encode_ending = chrono::system_clock::now();
         const int ms_elapsed = chrono::duration_cast<chrono::milliseconds>( encode_ending - encode_beginning ).count();
         cerr << "done (" << ms_elapsed << " ms)." << endl;
@@ -0,0 +1,92 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* xc-index: writes the frame index sidecar for an IVF file, so that
+   opening it later doesn't require walking every frame header */
+
+#include <iostream>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "ivf.hh"
+#include "file_descriptor.hh"
+#include "exception.hh"
+
+using namespace std;
+
+void usage_error( const string & program_name )
+{
+  cerr << "Usage: " << program_name << " <ivf> [<ivf>...]" << endl
+       << endl
+       << "Writes <ivf>" << IVF::index_filename( "" ) << " next to each input file." << endl
+       << endl;
+}
+
+int main( int argc, char const *argv[] )
+{
+  if ( argc <= 0 ) {
+    abort();
+  }
+
+  if ( argc < 2 ) {
+    usage_error( argv[ 0 ] );
+    return EXIT_FAILURE;
+  }
+
+  try {
+    for ( int i = 1; i < argc; i++ ) {
+      const string filename { argv[ i ] };
+
+      /* ignore any existing (possibly stale) index */
+      const IVF ivf( filename, false );
+
+      const string index_filename = IVF::index_filename( filename );
+      const string temp_filename = index_filename + ".tmp";
+
+      {
+        FileDescriptor index_file { SystemCall( temp_filename,
+                                                open( temp_filename.c_str(),
+                                                      O_WRONLY | O_CREAT | O_TRUNC,
+                                                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH ) ) };
+        index_file.write( ivf.serialize_index() );
+      }
+
+      /* replace the old index in one step */
+      SystemCall( "rename", rename( temp_filename.c_str(), index_filename.c_str() ) );
+
+      cerr << filename << ": indexed " << ivf.frame_count() << " frames" << endl;
+    }
+  }
+  catch ( const exception &  e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
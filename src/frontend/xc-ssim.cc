@@ -83,7 +83,7 @@ int main( int argc, char *argv[] )
       video_reader[ i ] = make_shared<IVFReader>( video_file[ i ] );
     }
     else if ( video_format[ i ] == "y4m" ) {
-      video_reader[ i ] = make_shared<YUV4MPEGReader>( video_file[ i ] );
+      video_reader[ i ] = make_yuv4mpeg_reader( video_file[ i ] );
     }
     else {
       throw runtime_error( "unsupported input format" );
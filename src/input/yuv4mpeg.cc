@@ -27,8 +27,11 @@
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "yuv4mpeg.hh"
+#include "async_io.hh"
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sstream>
 #include <utility>
 #include <algorithm>
@@ -152,10 +155,23 @@ YUV4MPEGReader::YUV4MPEGReader( const string & filename )
 
 YUV4MPEGReader::YUV4MPEGReader( FileDescriptor && fd )
   : header_(),
-    fd_( move( fd ) )
+    fd_( move( fd ) ),
+    plane_buffer_()
 {
-  string header_str = fd_.getline();
-  istringstream ssin( header_str );
+  header_ = parse_header( fd_.getline() );
+}
+
+YUV4MPEGReader::~YUV4MPEGReader()
+{
+  if ( prefetch_.valid() ) {
+    prefetch_.wait();
+  }
+}
+
+YUV4MPEGHeader YUV4MPEGReader::parse_header( const string & headerstr )
+{
+  YUV4MPEGHeader header;
+  istringstream ssin( headerstr );
 
   string token;
   ssin >> token;
@@ -171,18 +187,18 @@ YUV4MPEGReader::YUV4MPEGReader( FileDescriptor && fd )
 
     switch ( token[0] ) {
     case 'W': // width
-      header_.width = stoi( token.substr( 1 ) );
+      header.width = stoi( token.substr( 1 ) );
       break;
 
     case 'H': // height
-      header_.height = stoi( token.substr( 1 ) );
+      header.height = stoi( token.substr( 1 ) );
       break;
 
     case 'F': // framerate
     {
       pair< size_t, size_t > fps = YUV4MPEGReader::parse_fraction( token.substr( 1 ) );
-      header_.fps_numerator = fps.first;
-      header_.fps_denominator = fps.second;
+      header.fps_numerator = fps.first;
+      header.fps_denominator = fps.second;
       break;
     }
 
@@ -192,10 +208,10 @@ YUV4MPEGReader::YUV4MPEGReader( FileDescriptor && fd )
       }
 
       switch ( token[ 1 ] ) {
-      case 'p': header_.interlacing_mode = YUV4MPEGHeader::InterlacingMode::PROGRESSIVE; break;
-      case 't': header_.interlacing_mode = YUV4MPEGHeader::InterlacingMode::TOP_FIELD_FIRST; break;
-      case 'b': header_.interlacing_mode = YUV4MPEGHeader::InterlacingMode::BOTTOM_FIELD_FIRST; break;
-      case 'm': header_.interlacing_mode = YUV4MPEGHeader::InterlacingMode::MIXED_MODES; break;
+      case 'p': header.interlacing_mode = YUV4MPEGHeader::InterlacingMode::PROGRESSIVE; break;
+      case 't': header.interlacing_mode = YUV4MPEGHeader::InterlacingMode::TOP_FIELD_FIRST; break;
+      case 'b': header.interlacing_mode = YUV4MPEGHeader::InterlacingMode::BOTTOM_FIELD_FIRST; break;
+      case 'm': header.interlacing_mode = YUV4MPEGHeader::InterlacingMode::MIXED_MODES; break;
       default: throw runtime_error( "invalid interlacing mode" );
       }
       break;
@@ -203,8 +219,8 @@ YUV4MPEGReader::YUV4MPEGReader( FileDescriptor && fd )
     case 'A': // pixel aspect ratio
     {
       pair< size_t, size_t > aspect_ratio = YUV4MPEGReader::parse_fraction( token.substr( 1 ) );
-      header_.pixel_aspect_ratio_numerator = aspect_ratio.first;
-      header_.pixel_aspect_ratio_denominator = aspect_ratio.second;
+      header.pixel_aspect_ratio_numerator = aspect_ratio.first;
+      header.pixel_aspect_ratio_denominator = aspect_ratio.second;
       break;
     }
 
@@ -212,7 +228,7 @@ YUV4MPEGReader::YUV4MPEGReader( FileDescriptor && fd )
         if ( token.substr( 0, 4 ) != "C420" ) {
           throw runtime_error( "only yuv420 color space is supported" );
         }
-        header_.color_space = YUV4MPEGHeader::ColorSpace::C420;
+        header.color_space = YUV4MPEGHeader::ColorSpace::C420;
         break;
 
     case 'X': // comment
@@ -223,9 +239,11 @@ YUV4MPEGReader::YUV4MPEGReader( FileDescriptor && fd )
     }
   }
 
-  if ( header_.width == 0 or header_.height == 0 ) {
+  if ( header.width == 0 or header.height == 0 ) {
     throw runtime_error( "width or height missing" );
   }
+
+  return header;
 }
 
 void edge_extend_component( TwoD<uint8_t> & component,
@@ -270,8 +288,93 @@ void edge_extend( BaseRaster & raster )
   edge_extend_component( raster.V(), raster.chroma_display_width(), raster.chroma_display_height() );
 }
 
+void YUV4MPEGReader::read_plane( TwoD<uint8_t> & plane, const unsigned int width,
+                                 const unsigned int height )
+{
+  uint8_t * const first_row = &plane.at( 0, 0 );
+
+  /* if the rows are back to back in the raster, the plane goes right into it */
+  if ( plane.width() == width ) {
+    fd_.read_exact( first_row, width * height );
+    return;
+  }
+
+  plane_buffer_.resize( width * height );
+  fd_.read_exact( plane_buffer_.data(), plane_buffer_.size() );
+
+  for ( size_t row = 0; row < height; row++ ) {
+    memcpy( first_row + row * plane.width(), &plane_buffer_[ row * width ], width );
+  }
+}
+
+/* asks the I/O thread for the next frame, assuming a plain "FRAME\n" marker */
+void YUV4MPEGReader::start_prefetch()
+{
+  prefetch_buffer_.resize( 6 + header_.frame_length() );
+  prefetch_ = AsyncIO::global().read( fd_.fd_num(), prefetch_buffer_.data(),
+                                      prefetch_buffer_.size(), AsyncIO::CURRENT_POSITION );
+}
+
+Optional<RasterHandle> YUV4MPEGReader::finish_prefetch()
+{
+  const size_t length = prefetch_.get();
+
+  if ( length == 0 ) {
+    return {};
+  }
+
+  const Chunk contents { prefetch_buffer_ };
+  const uint8_t * const marker_end = static_cast<const uint8_t *>(
+    memchr( contents.buffer(), '\n', length ) );
+
+  if ( not marker_end or contents( 0, min<size_t>( length, 5 ) ).to_string() != "FRAME" ) {
+    throw runtime_error( "invalid yuv4mpeg2 input format" );
+  }
+
+  /* frame parameters push the end of the frame past what was read */
+  const size_t data_offset = marker_end - contents.buffer() + 1;
+  const size_t missing = data_offset + header_.frame_length() - length;
+
+  if ( missing > 0 ) {
+    prefetch_buffer_.resize( length + missing );
+    fd_.read_exact( prefetch_buffer_.data() + length, missing );
+  }
+
+  const size_t y_length = header_.y_plane_length();
+  const size_t uv_length = header_.uv_plane_length();
+  const uint8_t * const data = prefetch_buffer_.data() + data_offset;
+
+  MutableRasterHandle raster { header_.width, header_.height };
+
+  auto copy_plane = [] ( TwoD<uint8_t> & plane, const uint8_t * source,
+                         const unsigned int width, const unsigned int height )
+    {
+      for ( unsigned int row = 0; row < height; row++ ) {
+        memcpy( &plane.at( 0, row ), source + row * width, width );
+      }
+    };
+
+  copy_plane( raster.get().Y(), data, header_.width, header_.height );
+  copy_plane( raster.get().U(), data + y_length, header_.width / 2, header_.height / 2 );
+  copy_plane( raster.get().V(), data + y_length + uv_length, header_.width / 2, header_.height / 2 );
+
+  edge_extend( raster.get() );
+
+  return { move( raster ) };
+}
+
 Optional<RasterHandle> YUV4MPEGReader::get_next_frame()
 {
+  if ( prefetch_.valid() ) {
+    Optional<RasterHandle> frame = finish_prefetch();
+
+    if ( frame.initialized() ) {
+      start_prefetch();
+    }
+
+    return frame;
+  }
+
   MutableRasterHandle raster { header_.width, header_.height };
 
   string frame_header = fd_.getline();
@@ -279,33 +382,182 @@ Optional<RasterHandle> YUV4MPEGReader::get_next_frame()
     return {};
   }
 
-  if ( frame_header != "FRAME" ) {
+  /* the marker may carry frame parameters, which are ignored */
+  if ( frame_header.compare( 0, 5, "FRAME" ) != 0 ) {
     throw runtime_error( "invalid yuv4mpeg2 input format" );
   }
 
-  string read_data;
+  read_plane( raster.get().Y(), display_width(), display_height() );
+  read_plane( raster.get().U(), display_width() / 2, display_height() / 2 );
+  read_plane( raster.get().V(), display_width() / 2, display_height() / 2 );
 
-  for ( size_t row = 0; row < display_height(); row++ ) {
-    read_data = fd_.read_exactly( display_width() );
-    memcpy( &raster.get().Y().storage()->at( 0, row ), &read_data[ 0 ], read_data.length() );
+  /* edge-extend the raster */
+  edge_extend( raster.get() );
+
+  /* once the line buffer is used up, the reads can go to the I/O thread */
+  if ( fd_.buffered_bytes() == 0 and not fd_.eof() ) {
+    start_prefetch();
   }
 
-  for ( size_t row = 0; row < display_height() / 2; row++ ) {
-    read_data = fd_.read_exactly( display_width() / 2 );
-    memcpy( &raster.get().U().storage()->at( 0, row ), &read_data[ 0 ], read_data.length() );
+  return { move( raster ) };
+}
+
+MappedYUV4MPEGReader::MappedYUV4MPEGReader( const string & filename, const size_t read_ahead )
+  : file_( filename ),
+    header_(),
+    next_frame_offset_( 0 ),
+    read_ahead_( max<size_t>( read_ahead, 1 ) )
+{
+  const Chunk & contents = file_.chunk();
+  const uint8_t * const header_end = static_cast<const uint8_t *>(
+    memchr( contents.buffer(), '\n', contents.size() ) );
+
+  if ( not header_end ) {
+    throw runtime_error( "invalid yuv4mpeg2 input format" );
   }
 
-  for ( size_t row = 0; row < display_height() / 2; row++ ) {
-    read_data = fd_.read_exactly( display_width() / 2 );
-    memcpy( &raster.get().V().storage()->at( 0, row ), &read_data[ 0 ], read_data.length() );
+  header_ = YUV4MPEGReader::parse_header( contents( 0, header_end - contents.buffer() ).to_string() );
+  next_frame_offset_ = header_end - contents.buffer() + 1;
+
+  /* the file is read front to back, once */
+  if ( contents.size() > 0 ) {
+    madvise( const_cast<uint8_t *>( contents.buffer() ), contents.size(), MADV_SEQUENTIAL );
   }
 
-  /* edge-extend the raster */
+  read_ahead_thread_ = thread( &MappedYUV4MPEGReader::read_ahead_loop, this );
+}
+
+MappedYUV4MPEGReader::~MappedYUV4MPEGReader()
+{
+  {
+    unique_lock<mutex> lock( mutex_ );
+    shutting_down_ = true;
+  }
+
+  frame_taken_.notify_all();
+  read_ahead_thread_.join();
+}
+
+/* copies the frame at next_frame_offset_ out of the mapping */
+Optional<RasterHandle> MappedYUV4MPEGReader::read_frame()
+{
+  const Chunk & contents = file_.chunk();
+
+  if ( next_frame_offset_ >= contents.size() ) {
+    return {};
+  }
+
+  /* frames normally start with "FRAME\n", but may carry parameters */
+  const Chunk rest = contents( next_frame_offset_ );
+  const uint8_t * const marker_end = static_cast<const uint8_t *>(
+    memchr( rest.buffer(), '\n', min<size_t>( rest.size(), 256 ) ) );
+
+  if ( not marker_end or rest( 0, min<size_t>( rest.size(), 5 ) ).to_string() != "FRAME" ) {
+    throw runtime_error( "invalid yuv4mpeg2 input format" );
+  }
+
+  const size_t y_length = header_.width * header_.height;
+  const size_t uv_length = ( header_.width / 2 ) * ( header_.height / 2 );
+  const size_t data_offset = marker_end - rest.buffer() + 1;
+
+  const Chunk data = rest( data_offset, y_length + 2 * uv_length );
+  next_frame_offset_ += data_offset + data.size();
+
+  MutableRasterHandle raster { header_.width, header_.height };
+
+  auto copy_plane = [] ( TwoD<uint8_t> & plane, const Chunk & source,
+                         const unsigned int width, const unsigned int height )
+    {
+      for ( unsigned int row = 0; row < height; row++ ) {
+        memcpy( &plane.at( 0, row ), source.buffer() + row * width, width );
+      }
+    };
+
+  copy_plane( raster.get().Y(), data( 0, y_length ), header_.width, header_.height );
+  copy_plane( raster.get().U(), data( y_length, uv_length ), header_.width / 2, header_.height / 2 );
+  copy_plane( raster.get().V(), data( y_length + uv_length, uv_length ), header_.width / 2, header_.height / 2 );
+
   edge_extend( raster.get() );
 
   return { move( raster ) };
 }
 
+void MappedYUV4MPEGReader::read_ahead_loop()
+{
+  while ( true ) {
+    {
+      unique_lock<mutex> lock( mutex_ );
+      frame_taken_.wait( lock, [&] { return shutting_down_ or ready_frames_.size() < read_ahead_; } );
+
+      if ( shutting_down_ ) {
+        return;
+      }
+    }
+
+    /* the copy happens without holding the lock */
+    Optional<RasterHandle> frame;
+    exception_ptr error;
+
+    try {
+      frame = read_frame();
+    } catch ( ... ) {
+      error = current_exception();
+    }
+
+    unique_lock<mutex> lock( mutex_ );
+
+    if ( frame.initialized() ) {
+      ready_frames_.push( move( frame.get() ) );
+    }
+    else {
+      end_of_file_ = true;
+      read_error_ = error;
+    }
+
+    frame_ready_.notify_all();
+
+    if ( end_of_file_ ) {
+      return;
+    }
+  }
+}
+
+Optional<RasterHandle> MappedYUV4MPEGReader::get_next_frame()
+{
+  unique_lock<mutex> lock( mutex_ );
+  frame_ready_.wait( lock, [&] { return end_of_file_ or not ready_frames_.empty(); } );
+
+  if ( ready_frames_.empty() ) {
+    if ( read_error_ ) {
+      rethrow_exception( read_error_ );
+    }
+
+    return {};
+  }
+
+  Optional<RasterHandle> ret { move( ready_frames_.front() ) };
+  ready_frames_.pop();
+
+  lock.unlock();
+  frame_taken_.notify_all();
+
+  return ret;
+}
+
+shared_ptr<FrameInput> make_yuv4mpeg_reader( const string & filename )
+{
+  struct stat file_info;
+  SystemCall( filename, stat( filename.c_str(), &file_info ) );
+
+  /* with io_uring, the streaming reader's prefetch does not block a
+     thread per read, so it handles regular files as well */
+  if ( S_ISREG( file_info.st_mode ) and not AsyncIO::global().using_io_uring() ) {
+    return make_shared<MappedYUV4MPEGReader>( filename );
+  }
+
+  return make_shared<YUV4MPEGReader>( filename );
+}
+
 void YUV4MPEGFrameWriter::write( const BaseRaster &rh, FileDescriptor &fd )
 {
   fd.write("FRAME\n");
@@ -30,11 +30,20 @@
 #define YUV4MPEG_HH
 
 #include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <future>
 
 #include "frame_input.hh"
 #include "exception.hh"
 #include "raster_handle.hh"
 #include "file_descriptor.hh"
+#include "file.hh"
 #include "vp8_raster.hh"
 
 class YUV4MPEGHeader
@@ -70,13 +79,32 @@ private:
   YUV4MPEGHeader header_;
   FileDescriptor fd_;
 
+  /* for planes whose rows are padded in the raster */
+  std::vector<uint8_t> plane_buffer_;
+
+  /* the next frame, marker included, being read by the I/O thread while
+     the caller works on the current one */
+  std::vector<uint8_t> prefetch_buffer_ {};
+  std::future<size_t> prefetch_ {};
+
+  void start_prefetch();
+  Optional<RasterHandle> finish_prefetch();
+
   static std::pair< size_t, size_t > parse_fraction( const std::string & fraction_str );
 
+  /* reads a width x height plane in one go */
+  void read_plane( TwoD<uint8_t> & plane, const unsigned int width, const unsigned int height );
+
 public:
   YUV4MPEGReader( FileDescriptor && fd );
   YUV4MPEGReader( const std::string & filename );
+  ~YUV4MPEGReader();
+
   Optional<RasterHandle> get_next_frame() override;
 
+  /* parses the stream header line (without its newline) */
+  static YUV4MPEGHeader parse_header( const std::string & header_str );
+
   uint16_t display_width() override { return header_.width; }
   uint16_t display_height() override { return header_.height; }
 
@@ -86,9 +114,56 @@ public:
 
   YUV4MPEGHeader header() const { return header_; }
 
-  FileDescriptor & fd() { return fd_; }
+  /* disallow copying or moving, the I/O thread may be filling the buffer */
+  YUV4MPEGReader( const YUV4MPEGReader & other ) = delete;
+  YUV4MPEGReader & operator=( const YUV4MPEGReader & other ) = delete;
 };
 
+/* Reads a YUV4MPEG file through a memory mapping. A thread copies frames
+   into rasters ahead of the consumer, so get_next_frame() rarely waits on
+   I/O. Only works with regular files. */
+class MappedYUV4MPEGReader : public FrameInput
+{
+private:
+  File file_;
+  YUV4MPEGHeader header_;
+
+  /* the next frame marker for the read-ahead thread to look at */
+  size_t next_frame_offset_;
+
+  const size_t read_ahead_;
+  std::queue<RasterHandle> ready_frames_ {};
+  bool end_of_file_ { false };
+  bool shutting_down_ { false };
+  std::exception_ptr read_error_ {};
+  std::mutex mutex_ {};
+  std::condition_variable frame_taken_ {};
+  std::condition_variable frame_ready_ {};
+  std::thread read_ahead_thread_ {};
+
+  Optional<RasterHandle> read_frame();
+  void read_ahead_loop();
+
+public:
+  MappedYUV4MPEGReader( const std::string & filename, const size_t read_ahead = 4 );
+  ~MappedYUV4MPEGReader();
+
+  Optional<RasterHandle> get_next_frame() override;
+
+  uint16_t display_width() override { return header_.width; }
+  uint16_t display_height() override { return header_.height; }
+
+  YUV4MPEGHeader header() const { return header_; }
+
+  /* disallow copying or moving, the thread refers to this object */
+  MappedYUV4MPEGReader( const MappedYUV4MPEGReader & other ) = delete;
+  MappedYUV4MPEGReader & operator=( const MappedYUV4MPEGReader & other ) = delete;
+};
+
+/* the streaming reader when io_uring is available or the input is not a
+   regular file, the mapped reader otherwise */
+std::shared_ptr<FrameInput> make_yuv4mpeg_reader( const std::string & filename );
+
 class YUV4MPEGFrameWriter
 {
 public:
@@ -29,50 +29,208 @@
 #ifndef PACER_HH
 #define PACER_HH
 
-#include <deque>
+#include <vector>
 #include <chrono>
-#include <string>
+#include <algorithm>
 
-/* pace outgoing packets */
+#include "packet.hh"
+#include "timerfd.hh"
+
+/* pace outgoing packets, on a timer with microsecond deadlines that a
+   Poller can watch. packets are spaced either by the delay given with each
+   one, or, once a rate is set, by a token bucket filling at that rate. */
 class Pacer
 {
+public:
+  typedef std::chrono::steady_clock Clock;
+
 private:
   struct ScheduledPacket {
-    std::chrono::system_clock::time_point when; /* scheduled outgoing time of packet */
-    std::string what; /* serialized packet contents */
+    Clock::time_point when {}; /* earliest outgoing time of packet */
+    Packet what {}; /* shares the frame it is a fragment of */
   };
 
-  std::deque<ScheduledPacket> queue_ {};
+  /* a ring buffer that only ever grows, so that pacing doesn't allocate
+     once it has seen the largest burst */
+  std::vector<ScheduledPacket> ring_ {};
+  size_t head_ { 0 };
+  size_t count_ { 0 };
 
-public:
-  int ms_until_due() const
+  TimerFD timer_ {};
+
+  /* wake up this much early and busy-wait for the deadline, rather than
+     leave the last stretch to the kernel's timer slack */
+  std::chrono::microseconds spin_ { 0 };
+
+  /* token bucket, in bytes */
+  bool token_bucket_ { false };
+  double bytes_per_us_ { 0.0 };
+  double bucket_size_ { 0.0 };
+  double tokens_ { 0.0 };
+  Clock::time_point last_refill_ {};
+
+  ScheduledPacket & at( const size_t i ) { return ring_[ ( head_ + i ) % ring_.size() ]; }
+  const ScheduledPacket & at( const size_t i ) const { return ring_[ ( head_ + i ) % ring_.size() ]; }
+
+  void grow()
+  {
+    std::vector<ScheduledPacket> bigger( std::max<size_t>( 64, 2 * ring_.size() ) );
+
+    for ( size_t i = 0; i < count_; i++ ) {
+      bigger[ i ] = std::move( at( i ) );
+    }
+
+    ring_.swap( bigger );
+    head_ = 0;
+  }
+
+  static double wire_size( const Packet & packet )
+  {
+    return Packet::HEADER_SIZE + packet.payload_length();
+  }
+
+  double tokens_at( const Clock::time_point now ) const
+  {
+    const double elapsed_us = std::chrono::duration<double, std::micro>( now - last_refill_ ).count();
+    return std::min( bucket_size_, tokens_ + std::max( 0.0, elapsed_us ) * bytes_per_us_ );
+  }
+
+  /* when the packet at the front may leave */
+  Clock::time_point front_due( const Clock::time_point now ) const
   {
-    if ( queue_.empty() ) {
-      return 1000; /* could be infinite, but if there's a bug I'd rather we find it in the first second */
+    const Clock::time_point scheduled = at( 0 ).when;
+
+    if ( not token_bucket_ ) {
+      return scheduled;
     }
 
-    int millis = std::chrono::duration_cast<std::chrono::milliseconds>( queue_.front().when - std::chrono::system_clock::now() ).count();
-    if ( millis < 0 ) {
-      millis = 0;
+    /* a packet bigger than the bucket goes once the bucket is full */
+    const double needed = std::min( wire_size( front() ), bucket_size_ );
+    const double available = tokens_at( now );
+
+    if ( available >= needed ) {
+      return std::max( scheduled, now );
     }
 
-    return millis;
+    const auto wait = std::chrono::duration<double, std::micro>( ( needed - available ) / bytes_per_us_ );
+    return std::max( scheduled, now + std::chrono::duration_cast<Clock::duration>( wait ) );
   }
 
-  bool empty() const { return queue_.empty(); }
-  void push( const std::string & payload, const int delay_microseconds )
+  void rearm()
   {
     if ( empty() ) {
-      queue_.push_back( { std::chrono::system_clock::now(), payload } );
-    } else {
-      queue_.push_back( { queue_.back().when + std::chrono::microseconds( delay_microseconds ),
-                          payload } );
+      timer_.disarm();
+    }
+    else {
+      timer_.arm( front_due( Clock::now() ) - spin_ );
+    }
+  }
+
+  void pop()
+  {
+    at( 0 ).what = Packet(); /* let go of the frame */
+    head_ = ( head_ + 1 ) % ring_.size();
+    count_--;
+  }
+
+public:
+  /* space the packets by the delay given with each one (unless a rate has
+     been set, and the token bucket does the spacing) */
+  void push( const Packet & packet, const int delay_microseconds = 0 )
+  {
+    const Clock::time_point when = ( empty() or token_bucket_ )
+                                 ? Clock::now()
+                                 : at( count_ - 1 ).when + std::chrono::microseconds( delay_microseconds );
+
+    if ( count_ == ring_.size() ) {
+      grow();
+    }
+
+    at( count_ ) = { when, packet };
+    count_++;
+
+    if ( count_ == 1 ) {
+      rearm();
+    }
+  }
+
+  /* from now on, let packets out at this rate (ignoring their delays),
+     allowing bursts of up to bucket_size bytes */
+  void set_rate( const double bytes_per_second, const size_t bucket_size )
+  {
+    if ( bytes_per_second <= 0 or bucket_size == 0 ) {
+      throw std::runtime_error( "Pacer: invalid rate" );
+    }
+
+    const Clock::time_point now = Clock::now();
+
+    if ( token_bucket_ ) {
+      tokens_ = tokens_at( now );
+    }
+    else {
+      tokens_ = 0;
+      token_bucket_ = true;
+
+      /* the delays don't apply anymore */
+      for ( size_t i = 0; i < count_; i++ ) {
+        at( i ).when = now;
+      }
+    }
+
+    last_refill_ = now;
+    bytes_per_us_ = bytes_per_second / 1e6;
+    bucket_size_ = bucket_size;
+    tokens_ = std::min( tokens_, bucket_size_ );
+
+    if ( not empty() ) {
+      rearm();
     }
   }
 
-  const std::string & front() const { return queue_.front().what; }
-  void pop() { queue_.pop_front(); }
-  size_t size() const { return queue_.size(); }
+  void set_spin( const std::chrono::microseconds spin ) { spin_ = spin; }
+
+  bool empty() const { return count_ == 0; }
+  size_t size() const { return count_; }
+  const Packet & front() const { return at( 0 ).what; }
+
+  /* readable when packets are (nearly) due; call acknowledge(), and then
+     pop_due() */
+  FileDescriptor & fd() { return timer_; }
+  void acknowledge() { timer_.acknowledge(); }
+
+  /* move all the packets that are due now into burst (which is cleared
+     first), to go out together, and set the timer for the next one */
+  void pop_due( std::vector<Packet> & burst )
+  {
+    burst.clear();
+
+    Clock::time_point now = Clock::now();
+
+    while ( not empty() ) {
+      const Clock::time_point due = front_due( now );
+
+      if ( due > now ) {
+        if ( not burst.empty() or due - now > spin_ ) {
+          break;
+        }
+
+        /* the last few microseconds */
+        while ( Clock::now() < due ) {}
+        now = Clock::now();
+        continue;
+      }
+
+      if ( token_bucket_ ) {
+        tokens_ = tokens_at( now ) - wire_size( front() );
+        last_refill_ = now;
+      }
+
+      burst.push_back( std::move( at( 0 ).what ) );
+      pop();
+    }
+
+    rearm();
+  }
 };
 
 #endif /* PACER_HH */
@@ -34,28 +34,13 @@
 
 using namespace std;
 
-string Packet::put_header_field( const uint16_t n )
-{
-  const uint16_t network_order = htole16( n );
-  return string( reinterpret_cast<const char *>( &network_order ),
-                 sizeof( network_order ) );
-}
-
-string Packet::put_header_field( const uint32_t n )
-{
-  const uint32_t network_order = htole32( n );
-  return string( reinterpret_cast<const char *>( &network_order ),
-                 sizeof( network_order ) );
-}
+constexpr size_t Packet::MAXIMUM_PAYLOAD;
+constexpr size_t Packet::HEADER_SIZE;
+constexpr size_t Packet::FEC_HEADER_SIZE;
+constexpr size_t AckPacket::MAX_COMPLETE_STATES;
+constexpr size_t AckPacket::MAXIMUM_SIZE;
 
-string Packet::put_header_field( const uint64_t n )
-{
-  const uint32_t network_order = htole64( n );
-  return string( reinterpret_cast<const char *>( &network_order ),
-                 sizeof( network_order ) );
-}
-
-Packet::Packet( const vector<uint8_t> & whole_frame,
+Packet::Packet( const shared_ptr<const SerializedFrame> & whole_frame,
                 const uint16_t connection_id,
                 const uint32_t source_state,
                 const uint32_t target_state,
@@ -71,40 +56,119 @@ Packet::Packet( const vector<uint8_t> & whole_frame,
     fragment_no_( fragment_no ),
     fragments_in_this_frame_( 0 ), /* temp value */
     time_since_last_( time_since_last ),
-    payload_()
+    parity_count_( 0 ),
+    last_fragment_length_( 0 ),
+    header_(),
+    payload_( nullptr, 0 ),
+    frame_( whole_frame ),
+    frame_offset_( MAXIMUM_PAYLOAD * fragment_no ),
+    payload_length_()
 {
-  assert( not whole_frame.empty() );
+  const size_t frame_size = frame_->size();
 
-  size_t first_byte = MAXIMUM_PAYLOAD * fragment_no;
-  assert( first_byte < whole_frame.size() );
+  assert( frame_size > 0 );
+  assert( frame_offset_ < frame_size );
 
-  size_t length = min( whole_frame.size() - first_byte, MAXIMUM_PAYLOAD );
-  assert( first_byte + length <= whole_frame.size() );
+  payload_length_ = min( frame_size - frame_offset_, MAXIMUM_PAYLOAD );
+  assert( frame_offset_ + payload_length_ <= frame_size );
 
-  payload_ = string( reinterpret_cast<const char*>( &whole_frame.at( first_byte ) ), length );
+  next_fragment_start = frame_offset_ + payload_length_;
+}
 
-  next_fragment_start = first_byte + length;
+/* construct outgoing parity Packet */
+Packet::Packet( const shared_ptr<const SerializedFrame> & parity,
+                const uint16_t connection_id,
+                const uint32_t source_state,
+                const uint32_t target_state,
+                const uint32_t frame_no,
+                const uint16_t fragment_no,
+                const uint16_t parity_count,
+                const size_t parity_offset,
+                const size_t parity_length )
+  : valid_( true ),
+    connection_id_( connection_id ),
+    source_state_( source_state ),
+    target_state_( target_state ),
+    frame_no_( frame_no ),
+    fragment_no_( fragment_no ),
+    fragments_in_this_frame_( 0 ), /* temp value */
+    time_since_last_( 0 ),
+    parity_count_( parity_count ),
+    last_fragment_length_( 0 ),
+    header_(),
+    payload_( nullptr, 0 ),
+    frame_( parity ),
+    frame_offset_( parity_offset ),
+    payload_length_( parity_length )
+{
+  assert( parity_length > FEC_HEADER_SIZE );
+  assert( parity_length <= FEC_HEADER_SIZE + MAXIMUM_PAYLOAD );
+  assert( parity_offset + parity_length <= frame_->size() );
 }
 
 /* construct incoming Packet */
 Packet::Packet( const Chunk & str )
   : valid_( true ),
-    connection_id_( str( 0, 2 ).le16() ),
-    source_state_( str( 2, 4 ).le32() ),
-    target_state_( str( 6, 4 ).le32() ),
-    frame_no_( str( 10, 4 ).le32() ),
-    fragment_no_( str( 14, 2 ).le16() ),
-    fragments_in_this_frame_( str( 16, 2 ).le16() ),
-    time_since_last_( str( 18, 4 ).le32() ),
-    payload_( str( 22 ).to_string() )
+    connection_id_(),
+    source_state_(),
+    target_state_(),
+    frame_no_(),
+    fragment_no_(),
+    fragments_in_this_frame_(),
+    time_since_last_(),
+    parity_count_( 0 ),
+    last_fragment_length_( 0 ),
+    header_(),
+    payload_( str( HEADER_SIZE ) ),
+    frame_(),
+    frame_offset_(),
+    payload_length_( payload_.size() )
 {
-  if ( fragment_no_ >= fragments_in_this_frame_ ) {
-    throw runtime_error( "invalid packet: fragment_no_ >= fragments_in_this_frame" );
+  FieldReader reader { str };
+
+  connection_id_ = reader.get16();
+  source_state_ = reader.get32();
+  target_state_ = reader.get32();
+  frame_no_ = reader.get32();
+  fragment_no_ = reader.get16();
+  fragments_in_this_frame_ = reader.get16();
+  time_since_last_ = reader.get32();
+
+  memcpy( header_, str.buffer(), HEADER_SIZE );
+
+  if ( fragments_in_this_frame_ == 0 ) {
+    throw runtime_error( "invalid packet: no fragments in this frame" );
+  }
+
+  if ( is_parity() ) {
+    FieldReader fec { payload_ };
+    parity_count_ = fec.get16();
+    last_fragment_length_ = fec.get16();
+    payload_ = fec.rest();
+    payload_length_ = payload_.size();
+
+    /* the sender never sends more parity packets than data fragments, and
+       the receiver sizes its parity buffer by this count */
+    if ( parity_count_ == 0 or parity_count_ > fragments_in_this_frame_ ) {
+      throw runtime_error( "invalid packet: bad parity count" );
+    }
+
+    if ( fragment_no_ - fragments_in_this_frame_ >= parity_count_ ) {
+      throw runtime_error( "invalid packet: fragment_no_ >= fragments_in_this_frame + parity_count" );
+    }
+
+    if ( last_fragment_length_ == 0 or last_fragment_length_ > MAXIMUM_PAYLOAD ) {
+      throw runtime_error( "invalid packet: bad last fragment length" );
+    }
   }
 
-  if ( payload_.empty() ) {
+  if ( payload_.size() == 0 ) {
     throw runtime_error( "invalid packet: empty payload" );
   }
+
+  if ( payload_.size() > MAXIMUM_PAYLOAD ) {
+    throw runtime_error( "invalid packet: oversized payload" );
+  }
 }
 
 /* construct an empty, invalid packet */
@@ -117,28 +181,103 @@ Packet::Packet()
     fragment_no_(),
     fragments_in_this_frame_(),
     time_since_last_(),
-    payload_()
+    parity_count_( 0 ),
+    last_fragment_length_( 0 ),
+    header_(),
+    payload_( nullptr, 0 ),
+    frame_(),
+    frame_offset_(),
+    payload_length_()
 {}
 
+void Packet::serialize_header( uint8_t * buffer ) const
+{
+  assert( fragments_in_this_frame_ > 0 );
+
+  FieldWriter writer { buffer, HEADER_SIZE };
+
+  writer.put( connection_id_ );
+  writer.put( source_state_ );
+  writer.put( target_state_ );
+  writer.put( frame_no_ );
+  writer.put( fragment_no_ );
+  writer.put( fragments_in_this_frame_ );
+  writer.put( time_since_last_ );
+
+  assert( writer.size() == HEADER_SIZE );
+}
+
+void Packet::update_header()
+{
+  if ( fragments_in_this_frame_ > 0 ) {
+    serialize_header( header_ );
+  }
+}
+
 /* serialize a Packet */
 string Packet::to_string() const
+{
+  string ret( reinterpret_cast<const char *>( header_ ), HEADER_SIZE );
+
+  if ( frame_ ) {
+    frame_->for_each_chunk( frame_offset_, payload_length_,
+      [&ret]( const Chunk & piece ) {
+        ret.append( reinterpret_cast<const char *>( piece.buffer() ), piece.size() );
+      } );
+  }
+  else {
+    ret.append( payload_.to_string() );
+  }
+
+  return ret;
+}
+
+void Packet::add_to( UDPSocket::DatagramBatch & batch ) const
 {
   assert( fragments_in_this_frame_ > 0 );
 
-  return put_header_field( connection_id_ )
-       + put_header_field( source_state_ )
-       + put_header_field( target_state_ )
-       + put_header_field( frame_no_ )
-       + put_header_field( fragment_no_ )
-       + put_header_field( fragments_in_this_frame_ )
-       + put_header_field( time_since_last_ )
-       + payload_;
+  batch.add_buffer( Chunk( header_, HEADER_SIZE ) );
+
+  if ( frame_ ) {
+    frame_->for_each_chunk( frame_offset_, payload_length_,
+                            [&batch]( const Chunk & piece ) { batch.add_buffer( piece ); } );
+  }
+  else {
+    batch.add_buffer( payload_ );
+  }
+
+  batch.end_datagram();
+}
+
+void Packet::send( UDPSocket & socket ) const
+{
+  UDPSocket::DatagramBatch batch;
+  add_to( batch );
+  socket.send_batch( batch );
+}
+
+void Packet::send( UDPSocket & socket, const vector<Packet> & packets )
+{
+  UDPSocket::DatagramBatch batch;
+
+  for ( const Packet & packet : packets ) {
+    packet.add_to( batch );
+  }
+
+  socket.send_batch( batch );
 }
 
 void Packet::set_fragments_in_this_frame( const uint16_t x )
 {
   fragments_in_this_frame_ = x;
-  assert( fragment_no_ < fragments_in_this_frame_ );
+  assert( fragment_no_ < fragments_in_this_frame_ + parity_count_ );
+  update_header();
+}
+
+void Packet::set_time_to_next( const uint32_t val )
+{
+  time_since_last_ = val;
+  update_header();
 }
 
 /* construct outgoing FragmentedFrame */
@@ -147,18 +286,26 @@ FragmentedFrame::FragmentedFrame( const uint16_t connection_id,
                                   const uint32_t target_state,
                                   const uint32_t frame_no,
                                   const uint32_t time_since_last,
-                                  const vector<uint8_t> & whole_frame )
+                                  const shared_ptr<const SerializedFrame> & whole_frame,
+                                  const uint16_t parity_count )
   : connection_id_( connection_id ),
     source_state_( source_state ),
     target_state_( target_state ),
     frame_no_( frame_no ),
     fragments_in_this_frame_(),
     fragments_(),
-    remaining_fragments_( 0 )
+    remaining_fragments_( 0 ),
+    frame_buffer_(),
+    parity_count_( 0 ),
+    last_fragment_length_( 0 ),
+    parity_(),
+    parity_buffer_(),
+    recovered_fragments_( 0 )
 {
   size_t next_fragment_start = 0;
+  const size_t frame_size = whole_frame->size();
 
-  for ( uint16_t fragment_no = 0; next_fragment_start < whole_frame.size();
+  for ( uint16_t fragment_no = 0; next_fragment_start < frame_size;
         fragment_no++ ) {
     fragments_.emplace_back( whole_frame, connection_id, source_state_, target_state_,
                              frame_no, fragment_no, 0, next_fragment_start );
@@ -169,6 +316,55 @@ FragmentedFrame::FragmentedFrame( const uint16_t connection_id,
   fragments_in_this_frame_ = fragments_.size();
   remaining_fragments_ = 0;
 
+  parity_count_ = min<size_t>( parity_count, fragments_in_this_frame_ );
+  last_fragment_length_ = fragments_.back().payload_length();
+
+  if ( parity_count_ > 0 ) {
+    auto parity = make_shared<SerializedFrame>();
+    vector<vector<uint8_t>> & pieces = parity->mutable_pieces();
+    pieces.resize( parity_count_ );
+
+    for ( vector<uint8_t> & piece : pieces ) {
+      piece.assign( Packet::FEC_HEADER_SIZE, 0 );
+      FieldWriter writer { piece.data(), piece.size() };
+      writer.put( parity_count_ );
+      writer.put( last_fragment_length_ );
+    }
+
+    for ( size_t i = 0; i < fragments_in_this_frame_; i++ ) {
+      vector<uint8_t> & piece = pieces[ i % parity_count_ ];
+      const Packet & fragment = fragments_[ i ];
+
+      if ( piece.size() < Packet::FEC_HEADER_SIZE + fragment.payload_length() ) {
+        piece.resize( Packet::FEC_HEADER_SIZE + fragment.payload_length(), 0 );
+      }
+
+      uint8_t * destination = piece.data() + Packet::FEC_HEADER_SIZE;
+
+      whole_frame->for_each_chunk( fragment.frame_offset_, fragment.payload_length(),
+        [&destination]( const Chunk & chunk ) {
+          for ( size_t j = 0; j < chunk.size(); j++ ) {
+            destination[ j ] ^= chunk.buffer()[ j ];
+          }
+          destination += chunk.size();
+        } );
+    }
+
+    vector<size_t> offsets( parity_count_ );
+    for ( uint16_t group = 1; group < parity_count_; group++ ) {
+      offsets[ group ] = offsets[ group - 1 ] + pieces[ group - 1 ].size();
+    }
+
+    for ( uint16_t j = 0; j < parity_count_; j++ ) {
+      const uint16_t fragment_no = fragments_in_this_frame_ + j;
+      const uint16_t group = fragment_no % parity_count_;
+
+      fragments_.emplace_back( parity, connection_id, source_state_, target_state_,
+                               frame_no, fragment_no, parity_count_,
+                               offsets[ group ], pieces[ group ].size() );
+    }
+  }
+
   for ( Packet & packet : fragments_ ) {
     packet.set_fragments_in_this_frame( fragments_in_this_frame_ );
   }
@@ -183,7 +379,13 @@ FragmentedFrame::FragmentedFrame( const uint16_t connection_id,
     frame_no_( packet.frame_no() ),
     fragments_in_this_frame_( packet.fragments_in_this_frame() ),
     fragments_( packet.fragments_in_this_frame() ),
-    remaining_fragments_( packet.fragments_in_this_frame() )
+    remaining_fragments_( packet.fragments_in_this_frame() ),
+    frame_buffer_( Packet::MAXIMUM_PAYLOAD * packet.fragments_in_this_frame() ),
+    parity_count_( 0 ),
+    last_fragment_length_( 0 ),
+    parity_(),
+    parity_buffer_(),
+    recovered_fragments_( 0 )
 {
   sanity_check( packet );
 
@@ -212,8 +414,20 @@ void FragmentedFrame::sanity_check( const Packet & packet ) const {
     throw runtime_error( "invalid packet, frame_no mismatch" );
   }
 
-  if ( packet.fragment_no() >= fragments_in_this_frame_ ) {
-    throw runtime_error( "invalid packet, fragment_no >= fragments_in_this_frame" );
+  if ( packet.is_parity() ) {
+    if ( parity_count_ != 0 and
+         ( packet.parity_count() != parity_count_ or
+           packet.last_fragment_length() != last_fragment_length_ ) ) {
+      throw runtime_error( "invalid packet, parity_count mismatch" );
+    }
+
+    return;
+  }
+
+  /* the sender fills every fragment but the last one */
+  if ( packet.fragment_no() + 1 < fragments_in_this_frame_ and
+       packet.payload_length() != Packet::MAXIMUM_PAYLOAD ) {
+    throw runtime_error( "invalid packet, short fragment" );
   }
 }
 
@@ -222,24 +436,112 @@ void FragmentedFrame::add_packet( const Packet & packet )
 {
   sanity_check( packet );
 
+  if ( packet.is_parity() ) {
+    if ( parity_count_ == 0 ) {
+      parity_count_ = packet.parity_count();
+      last_fragment_length_ = packet.last_fragment_length();
+      parity_.resize( parity_count_ );
+      parity_buffer_.resize( Packet::MAXIMUM_PAYLOAD * parity_count_ );
+    }
+
+    const uint16_t group = packet.fragment_no() % parity_count_;
+
+    if ( not parity_[ group ].valid() ) {
+      uint8_t * const destination = parity_buffer_.data() + Packet::MAXIMUM_PAYLOAD * group;
+      memcpy( destination, packet.payload().buffer(), packet.payload().size() );
+
+      Packet & parity = parity_[ group ];
+      parity = packet;
+      parity.payload_ = Chunk( destination, packet.payload().size() );
+
+      recover( group );
+    }
+
+    return;
+  }
+
   if ( not fragments_[ packet.fragment_no() ].valid() ) {
     remaining_fragments_--;
-    fragments_[ packet.fragment_no() ] = packet;
+
+    uint8_t * const destination = frame_buffer_.data()
+                                + Packet::MAXIMUM_PAYLOAD * packet.fragment_no();
+    memcpy( destination, packet.payload().buffer(), packet.payload().size() );
+
+    Packet & fragment = fragments_[ packet.fragment_no() ];
+    fragment = packet;
+    fragment.payload_ = Chunk( destination, packet.payload().size() );
+
+    if ( parity_count_ > 0 ) {
+      recover( packet.fragment_no() % parity_count_ );
+    }
+  }
+}
+
+void FragmentedFrame::recover( const uint16_t group )
+{
+  if ( complete() or not parity_[ group ].valid() ) {
+    return;
+  }
+
+  size_t missing = fragments_in_this_frame_;
+
+  for ( size_t i = group; i < fragments_in_this_frame_; i += parity_count_ ) {
+    if ( not fragments_[ i ].valid() ) {
+      if ( missing != fragments_in_this_frame_ ) {
+        return; /* more than one missing; wait for more */
+      }
+
+      missing = i;
+    }
+  }
+
+  if ( missing == fragments_in_this_frame_ ) {
+    return;
   }
+
+  const Chunk & parity = parity_[ group ].payload();
+  const size_t length = ( missing + 1 == fragments_in_this_frame_ )
+                        ? last_fragment_length_ : Packet::MAXIMUM_PAYLOAD;
+
+  if ( length > parity.size() ) {
+    throw runtime_error( "invalid parity packet, too short" );
+  }
+
+  /* the parity, XORed with all the fragments we have, is the one we don't */
+  uint8_t * const destination = frame_buffer_.data() + Packet::MAXIMUM_PAYLOAD * missing;
+  memcpy( destination, parity.buffer(), length );
+
+  for ( size_t i = group; i < fragments_in_this_frame_; i += parity_count_ ) {
+    if ( i != missing ) {
+      const Chunk & payload = fragments_[ i ].payload();
+      const size_t overlap = min<size_t>( length, payload.size() );
+
+      for ( size_t j = 0; j < overlap; j++ ) {
+        destination[ j ] ^= payload.buffer()[ j ];
+      }
+    }
+  }
+
+  Packet & fragment = fragments_[ missing ];
+  fragment = parity_[ group ];
+  fragment.fragment_no_ = missing;
+  fragment.payload_ = Chunk( destination, length );
+  fragment.payload_length_ = length;
+
+  remaining_fragments_--;
+  recovered_fragments_++;
 }
 
 /* send */
 void FragmentedFrame::send( UDPSocket & socket )
 {
-  if ( fragments_.size() != fragments_in_this_frame_ ) {
+  if ( fragments_.size() != size_t( fragments_in_this_frame_ ) + parity_count_ ) {
     throw runtime_error( "attempt to send unfinished FragmentedFrame" );
   }
 
   assert( complete() );
 
-  for ( const Packet & packet : fragments_ ) {
-    socket.send( packet.to_string() );
-  }
+  Packet::send( socket, fragments_ );
 }
 
 bool FragmentedFrame::complete() const
@@ -249,84 +551,108 @@ bool FragmentedFrame::complete() const
 
 const vector<Packet> & FragmentedFrame::packets() const
 {
-  if ( (not complete()) or (fragments_.size() != fragments_in_this_frame_) ) {
+  if ( (not complete()) or (fragments_.size() != size_t( fragments_in_this_frame_ ) + parity_count_) ) {
     throw runtime_error( "attempt to access unfinished FragmentedFrame" );
   }
 
   return fragments_;
 }
 
-string FragmentedFrame::frame() const
+Chunk FragmentedFrame::assembled( const size_t count ) const
 {
-  string ret;
+  size_t length = 0;
 
-  if ( not complete() ) {
-    throw runtime_error( "attempt to build frame from unfinished FragmentedFrame" );
+  for ( size_t i = 0; i < count; i++ ) {
+    length += fragments_[ i ].payload().size();
   }
 
-  for ( const auto & fragment : fragments_ ) {
-    ret.append( fragment.payload() );
+  return Chunk( frame_buffer_.data(), length );
+}
+
+Chunk FragmentedFrame::frame() const
+{
+  if ( not complete() ) {
+    throw runtime_error( "attempt to build frame from unfinished FragmentedFrame" );
   }
 
-  return ret;
+  return assembled( fragments_.size() );
 }
 
-string FragmentedFrame::partial_frame() const
+Chunk FragmentedFrame::partial_frame() const
 {
-  string ret;
+  size_t count = 0;
 
-  for ( const auto & fragment : fragments_ ) {
-    if ( not fragment.valid() ) {
-      break;
-    }
-
-    ret.append( fragment.payload() );
+  while ( count < fragments_.size() and fragments_[ count ].valid() ) {
+    count++;
   }
 
-  return ret;
+  return assembled( count );
 }
 
 /* AckPacket */
 
 AckPacket::AckPacket( const uint16_t connection_id, const uint32_t frame_no,
                       const uint16_t fragment_no, const uint32_t avg_delay,
-                      const uint32_t current_state, deque<uint32_t> complete_states )
+                      const uint32_t current_state, const deque<uint32_t> & complete_states )
   : connection_id_( connection_id ), frame_no_( frame_no ),
     fragment_no_( fragment_no ), avg_delay_( avg_delay ),
-    current_state_( current_state ), complete_states_( complete_states )
-{}
+    current_state_( current_state ), complete_states_(),
+    complete_state_count_( min( complete_states.size(), MAX_COMPLETE_STATES ) )
+{
+  copy( complete_states.end() - complete_state_count_, complete_states.end(),
+        complete_states_ );
+}
 
 AckPacket::AckPacket( const Chunk & str )
-  : connection_id_( str( 0, 2 ).le16() ),
-    frame_no_( str( 2, 4 ).le32() ),
-    fragment_no_( str( 6, 2 ).le16() ),
-    avg_delay_( str( 8, 4 ).le32() ),
-    current_state_( str( 12, 4 ).le32() ),
-    complete_states_( str( 16, 4 ).le32() )
+  : connection_id_(), frame_no_(), fragment_no_(), avg_delay_(),
+    current_state_(), complete_states_(), complete_state_count_( 0 )
 {
-  for ( size_t i = 0; i < complete_states_.size(); i++ ) {
-    complete_states_[ i ] = str( 20 + i * 4, 4 ).le32();
+  FieldReader reader { str };
+
+  connection_id_ = reader.get16();
+  frame_no_ = reader.get32();
+  fragment_no_ = reader.get16();
+  avg_delay_ = reader.get32();
+  current_state_ = reader.get32();
+
+  const size_t count = reader.get32();
+
+  /* keep the most recent ones */
+  for ( size_t i = 0; i < count; i++ ) {
+    const uint32_t state = reader.get32();
+
+    if ( i + MAX_COMPLETE_STATES >= count ) {
+      complete_states_[ complete_state_count_++ ] = state;
+    }
   }
 }
 
-std::string AckPacket::to_string()
+size_t AckPacket::serialize( uint8_t * buffer, const size_t capacity ) const
 {
-  string packet = Packet::put_header_field( connection_id_ )
-                + Packet::put_header_field( frame_no_ )
-                + Packet::put_header_field( fragment_no_ )
-                + Packet::put_header_field( avg_delay_ )
-                + Packet::put_header_field( current_state_ );
+  FieldWriter writer { buffer, capacity };
 
-  packet += Packet::put_header_field( static_cast<uint32_t>( complete_states_.size() ) );
+  writer.put( connection_id_ );
+  writer.put( frame_no_ );
+  writer.put( fragment_no_ );
+  writer.put( avg_delay_ );
+  writer.put( current_state_ );
+  writer.put( static_cast<uint32_t>( complete_state_count_ ) );
 
-  for ( const auto state : complete_states_ ) {
-    packet += Packet::put_header_field( state );
+  for ( size_t i = 0; i < complete_state_count_; i++ ) {
+    writer.put( complete_states_[ i ] );
   }
 
-  return packet;
+  return writer.size();
+}
+
+string AckPacket::to_string() const
+{
+  uint8_t buffer[ MAXIMUM_SIZE ];
+  return string( reinterpret_cast<const char *>( buffer ), serialize( buffer, sizeof( buffer ) ) );
 }
 
-void AckPacket::sendto( UDPSocket & socket, const Address & addr )
+void AckPacket::sendto( UDPSocket & socket, const Address & addr ) const
 {
-  socket.sendto( addr, to_string() );
+  uint8_t buffer[ MAXIMUM_SIZE ];
+  socket.sendto( addr, Chunk( buffer, serialize( buffer, sizeof( buffer ) ) ) );
 }
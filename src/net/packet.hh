@@ -31,15 +31,90 @@
 
 #include <vector>
 #include <deque>
+#include <memory>
 #include <cassert>
+#include <cstring>
+#include <endian.h>
 
 #include "chunk.hh"
 #include "socket.hh"
 #include "exception.hh"
-#include "pacer.hh"
+#include "serialized_frame.hh"
+
+/* writes little-endian fields one after another into a caller-provided
+   buffer, without allocating */
+class FieldWriter
+{
+private:
+  uint8_t * const buffer_;
+  const size_t capacity_;
+  size_t size_ { 0 };
+
+  template <typename T>
+  void put_raw( const T value )
+  {
+    if ( size_ + sizeof( T ) > capacity_ ) {
+      throw std::out_of_range( "attempted to write past end of buffer" );
+    }
+
+    std::memcpy( buffer_ + size_, &value, sizeof( T ) );
+    size_ += sizeof( T );
+  }
+
+public:
+  FieldWriter( uint8_t * buffer, const size_t capacity )
+    : buffer_( buffer ), capacity_( capacity )
+  {}
+
+  void put( const uint16_t n ) { put_raw( htole16( n ) ); }
+  void put( const uint32_t n ) { put_raw( htole32( n ) ); }
+
+  size_t size() const { return size_; }
+
+  /* disallow copying */
+  FieldWriter( const FieldWriter & other ) = delete;
+  FieldWriter & operator=( const FieldWriter & other ) = delete;
+};
+
+/* reads little-endian fields one after another from a received buffer */
+class FieldReader
+{
+private:
+  Chunk remaining_;
+
+public:
+  FieldReader( const Chunk & buffer ) : remaining_( buffer ) {}
+
+  uint16_t get16()
+  {
+    const uint16_t value = remaining_.le16();
+    remaining_ = remaining_( sizeof( uint16_t ) );
+    return value;
+  }
+
+  uint32_t get32()
+  {
+    const uint32_t value = remaining_.le32();
+    remaining_ = remaining_( sizeof( uint32_t ) );
+    return value;
+  }
+
+  /* whatever hasn't been read yet */
+  const Chunk & rest() const { return remaining_; }
+};
 
 class Packet
 {
+  friend class FragmentedFrame;
+
+public:
+  static constexpr size_t MAXIMUM_PAYLOAD = 1400;
+  static constexpr size_t HEADER_SIZE = 22;
+
+  /* a parity packet's payload starts with the number of parity packets for
+     the frame, and the length of the frame's last data fragment */
+  static constexpr size_t FEC_HEADER_SIZE = 4;
+
 private:
   bool valid_;
 
@@ -51,15 +126,26 @@ private:
   uint16_t fragments_in_this_frame_;
   uint32_t time_since_last_; /* microseconds */
 
-  std::string payload_;
+  /* parity packets (fragment_no >= fragments_in_this_frame) only */
+  uint16_t parity_count_;
+  uint16_t last_fragment_length_;
 
-public:
-  static constexpr size_t MAXIMUM_PAYLOAD = 1400;
+  /* the header as it goes on the wire, kept up to date so that a batch of
+     datagrams can point at it */
+  uint8_t header_[ HEADER_SIZE ];
+
+  /* an incoming packet refers to its payload in the buffer it was parsed
+     from (or wherever its FragmentedFrame copied it to); an outgoing one
+     refers to a range of the frame it is a fragment of. neither is copied
+     until it has to be. */
+  Chunk payload_;
+  std::shared_ptr<const SerializedFrame> frame_;
+  size_t frame_offset_;
+  size_t payload_length_;
 
-  static std::string put_header_field( const uint16_t n );
-  static std::string put_header_field( const uint32_t n );
-  static std::string put_header_field( const uint64_t n );
+  void update_header();
 
+public:
   /* getters */
   bool valid() const { return valid_; }
   uint16_t connection_id() const { return connection_id_; }
@@ -69,10 +155,14 @@ public:
   uint16_t fragment_no() const { return fragment_no_; }
   uint16_t fragments_in_this_frame() const { return fragments_in_this_frame_; }
   uint32_t time_since_last() const { return time_since_last_; }
-  const std::string & payload() const { return payload_; }
+  bool is_parity() const { return fragment_no_ >= fragments_in_this_frame_; }
+  uint16_t parity_count() const { return parity_count_; }
+  uint16_t last_fragment_length() const { return last_fragment_length_; } /* incoming packets only */
+  const Chunk & payload() const { return payload_; } /* incoming packets only */
+  size_t payload_length() const { return payload_length_; }
 
   /* construct outgoing Packet */
-  Packet( const std::vector<uint8_t> & whole_frame,
+  Packet( const std::shared_ptr<const SerializedFrame> & whole_frame,
           const uint16_t connection_id,
           const uint32_t source_state,
           const uint32_t target_state,
@@ -81,17 +171,41 @@ public:
           const uint16_t time_to_next,
           size_t & next_fragment_start );
 
-  /* construct incoming Packet */
+  /* construct outgoing parity Packet; its payload (FEC header included) is
+     bytes [parity_offset, parity_offset + parity_length) of parity */
+  Packet( const std::shared_ptr<const SerializedFrame> & parity,
+          const uint16_t connection_id,
+          const uint32_t source_state,
+          const uint32_t target_state,
+          const uint32_t frame_no,
+          const uint16_t fragment_no,
+          const uint16_t parity_count,
+          const size_t parity_offset,
+          const size_t parity_length );
+
+  /* construct incoming Packet; its payload points into str */
   Packet( const Chunk & str );
 
   /* construct an empty, invalid packet */
   Packet();
 
+  /* write the header into a caller-provided buffer of HEADER_SIZE bytes */
+  void serialize_header( uint8_t * buffer ) const;
+
   /* serialize a Packet */
   std::string to_string() const;
 
+  /* add the Packet to a batch of datagrams, without copying its header or payload */
+  void add_to( UDPSocket::DatagramBatch & batch ) const;
+
+  /* send a Packet, reading the payload straight from the frame */
+  void send( UDPSocket & socket ) const;
+
+  /* send several Packets back to back, with as few system calls as possible */
+  static void send( UDPSocket & socket, const std::vector<Packet> & packets );
+
   void set_fragments_in_this_frame( const uint16_t x );
-  void set_time_to_next( const uint32_t val ) { time_since_last_ = val; }
+  void set_time_to_next( const uint32_t val );
 };
 
 class FragmentedFrame
@@ -103,10 +217,33 @@ private:
   uint32_t frame_no_;
   uint16_t fragments_in_this_frame_;
 
+  /* outgoing frames: the data fragments, followed by the parity packets */
   std::vector<Packet> fragments_;
 
   uint32_t remaining_fragments_;
 
+  /* incoming frames: the payloads are copied in here as they arrive, at
+     fixed offsets, so that the frame ends up contiguous */
+  std::vector<uint8_t> frame_buffer_;
+
+  /* forward error correction: the parity packets follow the data fragments,
+     and parity packet f is the XOR of the data fragments i with
+     i % parity_count == f % parity_count (each padded with zeros to
+     MAXIMUM_PAYLOAD). a group that has lost just one of its packets can
+     rebuild it; since any parity_count consecutive packets are all in
+     different groups, so can a burst of up to parity_count losses. */
+  uint16_t parity_count_;
+  uint16_t last_fragment_length_;
+  std::vector<Packet> parity_;
+  std::vector<uint8_t> parity_buffer_;
+  uint16_t recovered_fragments_;
+
+  /* the first fragments (up to count) of the frame, as one piece */
+  Chunk assembled( const size_t count ) const;
+
+  /* rebuild the missing fragment of a group, if it's the only one */
+  void recover( const uint16_t group );
+
 public:
   /* construct outgoing FragmentedFrame */
   FragmentedFrame( const uint16_t connection_id,
@@ -114,7 +251,8 @@ public:
                    const uint32_t target_state,
                    const uint32_t frame_no,
                    const uint32_t time_to_next_frame,
-                   const std::vector<uint8_t> & whole_frame );
+                   const std::shared_ptr<const SerializedFrame> & whole_frame,
+                   const uint16_t parity_count = 0 );
 
   /* construct incoming FragmentedFrame from a Packet */
   FragmentedFrame( const uint16_t connection_id,
@@ -122,7 +260,8 @@ public:
 
   void sanity_check( const Packet & packet ) const;
 
-  /* read a new packet */
+  /* read a new packet; its payload is copied, so the buffer it was
+     parsed from can be reused afterwards */
   void add_packet( const Packet & packet );
 
   /* send */
@@ -136,15 +275,21 @@ public:
   uint32_t target_state() const { return target_state_; }
   uint32_t frame_no() const { return frame_no_; }
   uint16_t fragments_in_this_frame() const { return fragments_in_this_frame_; }
-  std::string frame() const;
-  std::string partial_frame() const;
+  uint16_t parity_count() const { return parity_count_; }
+  uint16_t recovered_fragments() const { return recovered_fragments_; }
+
+  /* the received frame (or its longest complete prefix); these point
+     into the FragmentedFrame */
+  Chunk frame() const;
+  Chunk partial_frame() const;
+
   const std::vector<Packet> & packets() const;
 
   /* delete copy-constructor and copy-assign operator */
   FragmentedFrame( const FragmentedFrame & other ) = delete;
   FragmentedFrame & operator=( const FragmentedFrame & other ) = delete;
 
-  /* allow moving */
+  /* allow moving; the payloads stay where they are */
   FragmentedFrame( FragmentedFrame && other ) noexcept
     : connection_id_( other.connection_id_ ),
       source_state_( other.source_state_ ),
@@ -152,12 +297,24 @@ public:
       frame_no_( other.frame_no_ ),
       fragments_in_this_frame_( other.fragments_in_this_frame_ ),
       fragments_( move( other.fragments_ ) ),
-      remaining_fragments_( other.remaining_fragments_ )
+      remaining_fragments_( other.remaining_fragments_ ),
+      frame_buffer_( move( other.frame_buffer_ ) ),
+      parity_count_( other.parity_count_ ),
+      last_fragment_length_( other.last_fragment_length_ ),
+      parity_( move( other.parity_ ) ),
+      parity_buffer_( move( other.parity_buffer_ ) ),
+      recovered_fragments_( other.recovered_fragments_ )
   {}
 };
 
 class AckPacket
 {
+public:
+  /* only the most recent complete states are acknowledged; the sender
+     doesn't look further back than the latest one */
+  static constexpr size_t MAX_COMPLETE_STATES = 16;
+  static constexpr size_t MAXIMUM_SIZE = 20 + 4 * MAX_COMPLETE_STATES;
+
 private:
   uint16_t connection_id_;
   uint32_t frame_no_;
@@ -165,18 +322,22 @@ private:
   uint32_t avg_delay_;
 
   uint32_t current_state_;
-  std::deque<uint32_t> complete_states_;
+  uint32_t complete_states_[ MAX_COMPLETE_STATES ];
+  size_t complete_state_count_;
 
 public:
   AckPacket( const uint16_t connection_id, const uint32_t frame_no,
              const uint16_t fragment_no, const uint32_t avg_delay,
-             const uint32_t current_state, std::deque<uint32_t> complete_states );
+             const uint32_t current_state, const std::deque<uint32_t> & complete_states );
 
   AckPacket( const Chunk & str );
 
-  std::string to_string();
+  /* write the AckPacket into a caller-provided buffer; returns its length */
+  size_t serialize( uint8_t * buffer, const size_t capacity ) const;
 
-  void sendto( UDPSocket & socket, const Address & addr );
+  std::string to_string() const;
+
+  void sendto( UDPSocket & socket, const Address & addr ) const;
 
   /* getters */
   uint16_t connection_id() const { return connection_id_; }
@@ -185,7 +346,10 @@ public:
   uint32_t avg_delay() const { return avg_delay_; }
 
   uint32_t current_state() const { return current_state_; }
-  std::deque<uint32_t> complete_states() const { return complete_states_; }
+
+  /* complete states, oldest first */
+  const uint32_t * complete_states_begin() const { return complete_states_; }
+  const uint32_t * complete_states_end() const { return complete_states_ + complete_state_count_; }
 };
 
 #endif /* PACKET_HH */
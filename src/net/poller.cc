@@ -34,10 +34,65 @@
 using namespace std;
 using namespace PollerShortNames;
 
-void Poller::add_action( Poller::Action action )
+Poller::Poller( const Backend backend )
+    : backend_( backend ), actions_(), pollfds_(),
+      epoll_fd_( backend == Backend::Epoll
+                 ? SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) )
+                 : -1 ),
+      registration_of_fd_(), registrations_(), registration_of_action_(),
+      interested_(), dirty_(), with_predicate_(), watched_( 0 ), events_()
+{}
+
+size_t Poller::add_action( Poller::Action action )
 {
     actions_.push_back( action );
     pollfds_.push_back( { action.fd.fd_num(), 0, 0 } );
+
+    if ( backend_ != Backend::Epoll ) {
+        return actions_.size() - 1;
+    }
+
+    /* an fd can only be registered once, so actions on the same fd share */
+    const int fd = action.fd.fd_num();
+    auto found = registration_of_fd_.find( fd );
+
+    if ( found == registration_of_fd_.end() ) {
+        found = registration_of_fd_.emplace( fd, registrations_.size() ).first;
+        registrations_.push_back( { fd, {}, 0, false, false } );
+
+        epoll_event event {};
+        event.data.u64 = found->second;
+        SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_ADD, fd, &event ) );
+    }
+
+    Registration & registration = registrations_.at( found->second );
+    registration.actions.push_back( actions_.size() - 1 );
+    registration_of_action_.push_back( found->second );
+    interested_.push_back( false );
+    events_.resize( registrations_.size() );
+
+    if ( action.when_interested and not registration.has_predicate ) {
+        registration.has_predicate = true;
+        with_predicate_.push_back( found->second );
+    }
+
+    mark_dirty( found->second );
+
+    return actions_.size() - 1;
+}
+
+void Poller::set_interest( const size_t action, const bool interested )
+{
+    Action & target = actions_.at( action );
+    assert( not target.when_interested );
+
+    if ( target.interested != interested ) {
+        target.interested = interested;
+
+        if ( backend_ == Backend::Epoll ) {
+            mark_dirty( registration_of_action_.at( action ) );
+        }
+    }
 }
 
 unsigned int Poller::Action::service_count( void ) const
@@ -45,21 +100,98 @@ unsigned int Poller::Action::service_count( void ) const
     return direction == Direction::In ? fd.read_count() : fd.write_count();
 }
 
+bool Poller::is_interested( Action & action )
+{
+    /* don't poll in on fds that have had EOF */
+    if ( action.direction == Direction::In and action.fd.eof() ) {
+        return false;
+    }
+
+    return action.active and action.interested
+        and ( not action.when_interested or action.when_interested() );
+}
+
+void Poller::mark_dirty( const size_t registration )
+{
+    if ( not registrations_[ registration ].dirty ) {
+        registrations_[ registration ].dirty = true;
+        dirty_.push_back( registration );
+    }
+}
+
+void Poller::update_interest( const size_t r )
+{
+    Registration & registration = registrations_[ r ];
+    uint32_t events = 0;
+
+    for ( const size_t i : registration.actions ) {
+        interested_[ i ] = is_interested( actions_[ i ] );
+        if ( interested_[ i ] ) {
+            events |= actions_[ i ].direction;
+        }
+    }
+
+    if ( events != registration.events ) {
+        set_events( registration, events );
+    }
+}
+
+void Poller::set_events( Registration & registration, const uint32_t events )
+{
+    epoll_event event {};
+    event.events = events;
+    event.data.u64 = &registration - &registrations_[ 0 ];
+
+    SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_MOD,
+                                        registration.fd, &event ) );
+
+    if ( events and not registration.events ) {
+        watched_++;
+    } else if ( registration.events and not events ) {
+        watched_--;
+    }
+
+    registration.events = events;
+}
+
+bool Poller::run_callback( Action & action, Result & result )
+{
+    const auto count_before = action.service_count();
+    auto callback_result = action.callback();
+
+    switch ( callback_result.result ) {
+    case ResultType::Exit:
+        result = Result( Result::Type::Exit, callback_result.exit_status );
+        return false;
+    case ResultType::Cancel:
+        action.active = false;
+        break;
+    case ResultType::Continue:
+        break;
+    }
+
+    if ( count_before == action.service_count() ) {
+        throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+    }
+
+    return true;
+}
+
 Poller::Result Poller::poll( const int & timeout_ms )
+{
+    return backend_ == Backend::Epoll ? poll_with_epoll( timeout_ms )
+                                      : poll_with_poll( timeout_ms );
+}
+
+Poller::Result Poller::poll_with_poll( const int & timeout_ms )
 {
     assert( pollfds_.size() == actions_.size() );
 
     /* tell poll whether we care about each fd */
     for ( unsigned int i = 0; i < actions_.size(); i++ ) {
         assert( pollfds_.at( i ).fd == actions_.at( i ).fd.fd_num() );
-        pollfds_.at( i ).events = (actions_.at( i ).active and actions_.at( i ).when_interested())
+        pollfds_.at( i ).events = is_interested( actions_.at( i ) )
             ? actions_.at( i ).direction : 0;
-
-        /* don't poll in on fds that have had EOF */
-        if ( actions_.at( i ).direction == Direction::In
-             and actions_.at( i ).fd.eof() ) {
-            pollfds_.at( i ).events = 0;
-        }
     }
 
     /* Quit if no member in pollfds_ has a non-zero direction */
@@ -80,21 +212,64 @@ Poller::Result Poller::poll( const int & timeout_ms )
         if ( pollfds_[ i ].revents & pollfds_[ i ].events ) {
             /* we only want to call callback if revents includes
                the event we asked for */
-            const auto count_before = actions_.at( i ).service_count();
-            auto result = actions_.at( i ).callback();
-
-            switch ( result.result ) {
-            case ResultType::Exit:
-                return Result( Result::Type::Exit, result.exit_status );
-            case ResultType::Cancel:
-                actions_.at( i ).active = false;
-                break;
-            case ResultType::Continue:
-                break;
+            Result result = Result::Type::Success;
+            if ( not run_callback( actions_.at( i ), result ) ) {
+                return result;
             }
+        }
+    }
+
+    return Result::Type::Success;
+}
+
+Poller::Result Poller::poll_with_epoll( const int & timeout_ms )
+{
+    assert( interested_.size() == actions_.size() );
+
+    /* only the registrations whose interest may have changed are looked
+       at; the rest cost nothing until epoll_wait reports them */
+    for ( const size_t r : with_predicate_ ) {
+        update_interest( r );
+    }
+
+    for ( const size_t r : dirty_ ) {
+        registrations_[ r ].dirty = false;
+        if ( not registrations_[ r ].has_predicate ) {
+            update_interest( r );
+        }
+    }
+
+    dirty_.clear();
+
+    if ( watched_ == 0 ) {
+        return Result::Type::Exit;
+    }
+
+    const int event_count = SystemCall( "epoll_wait",
+        epoll_wait( epoll_fd_.fd_num(), &events_[ 0 ], events_.size(), timeout_ms ) );
+
+    if ( event_count == 0 ) {
+        return Result::Type::Timeout;
+    }
+
+    for ( int i = 0; i < event_count; i++ ) {
+        /* callbacks don't add actions, so this reference stays valid */
+        const Registration & registration = registrations_[ events_[ i ].data.u64 ];
+        const uint32_t ready = events_[ i ].events;
+
+        if ( ready & (EPOLLERR | EPOLLHUP) ) {
+            return { Result::Type::Exit, EXIT_FAILURE };
+        }
+
+        for ( const size_t action : registration.actions ) {
+            if ( interested_[ action ] and (ready & actions_[ action ].direction) ) {
+                /* a callback may Cancel its action or reach EOF */
+                mark_dirty( events_[ i ].data.u64 );
 
-            if ( count_before == actions_.at( i ).service_count() ) {
-                throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+                Result result = Result::Type::Success;
+                if ( not run_callback( actions_[ action ], result ) ) {
+                    return result;
+                }
             }
         }
     }
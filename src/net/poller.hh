@@ -31,9 +31,11 @@
 
 #include <functional>
 #include <vector>
+#include <unordered_map>
 #include <cassert>
 
 #include <poll.h>
+#include <sys/epoll.h>
 
 #include "file_descriptor.hh"
 
@@ -55,24 +57,28 @@ public:
         FileDescriptor & fd;
         enum PollDirection : short { In = POLLIN, Out = POLLOUT } direction;
         CallbackType callback;
+
+        /* an action is either asked whether it's interested on every poll()
+           (when_interested), or told, with Poller::set_interest(). only the
+           latter is free for the epoll backend when nothing changes. */
         std::function<bool(void)> when_interested;
+        bool interested;
         bool active;
 
         Action( FileDescriptor & s_fd,
                 const PollDirection & s_direction,
                 const CallbackType & s_callback,
-                const std::function<bool(void)> & s_when_interested = [] () { return true; } )
+                const std::function<bool(void)> & s_when_interested = {} )
             : fd( s_fd ), direction( s_direction ), callback( s_callback ),
-              when_interested( s_when_interested ), active( true ) {}
+              when_interested( s_when_interested ), interested( true ), active( true ) {}
 
         unsigned int service_count( void ) const;
     };
 
-private:
-    std::vector< Action > actions_;
-    std::vector< pollfd > pollfds_;
+    /* poll(2) looks at every fd on every call; epoll(7) keeps the interest
+       list in the kernel, and only hears about the fds that became ready */
+    enum class Backend { Poll, Epoll };
 
-public:
     struct Result
     {
         enum class Type { Success, Timeout, Exit } result;
@@ -81,8 +87,57 @@ public:
             : result( s_result ), exit_status( s_status ) {}
     };
 
-    Poller() : actions_(), pollfds_() {}
-    void add_action( Action action );
+private:
+    Backend backend_;
+
+    std::vector< Action > actions_;
+    std::vector< pollfd > pollfds_;
+
+    /* epoll backend: one level-triggered registration per fd, covering
+       all the actions on it, so a callback may leave data behind just as
+       with poll(2). a registration's interest is only looked at again when
+       it may have changed -- it has a when_interested predicate, was given
+       set_interest(), or had a callback run (which may Cancel or hit EOF) --
+       and the kernel is only told (with epoll_ctl) when it did change. */
+    struct Registration
+    {
+        int fd;
+        std::vector< size_t > actions;
+        uint32_t events;  /* what the kernel is watching for */
+        bool dirty;       /* on dirty_ */
+        bool has_predicate;
+    };
+
+    FileDescriptor epoll_fd_;
+    std::unordered_map< int, size_t > registration_of_fd_;
+    std::vector< Registration > registrations_;
+    std::vector< size_t > registration_of_action_;
+    std::vector< bool > interested_;       /* per action, as of this call */
+    std::vector< size_t > dirty_;          /* registrations to look at */
+    std::vector< size_t > with_predicate_; /* registrations to always look at */
+    size_t watched_;                       /* registrations with events */
+    std::vector< epoll_event > events_;
+
+    bool is_interested( Action & action );
+    void mark_dirty( const size_t registration );
+    void update_interest( const size_t registration );
+    void set_events( Registration & registration, const uint32_t events );
+
+    /* runs the callback, returns false if the poller should exit */
+    bool run_callback( Action & action, Result & result );
+
+    Result poll_with_poll( const int & timeout_ms );
+    Result poll_with_epoll( const int & timeout_ms );
+
+public:
+    Poller( const Backend backend = Backend::Poll );
+
+    /* returns the action's index, for set_interest() */
+    size_t add_action( Action action );
+
+    /* for actions without a when_interested predicate */
+    void set_interest( const size_t action, const bool interested );
+
     Result poll( const int & timeout_ms );
 };
 
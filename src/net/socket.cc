@@ -27,6 +27,9 @@
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <sys/socket.h>
+#include <netinet/udp.h>
+#include <algorithm>
+
 #include "socket.hh"
 #include "exception.hh"
 
@@ -116,11 +119,39 @@ static uint64_t timestamp_us_raw( const timespec & ts )
   return nanos / THOUSAND;
 }
 
+/* make sure we got the whole datagram */
+static void check_received_flags( const msghdr & header )
+{
+  if ( header.msg_flags & MSG_TRUNC ) {
+    throw runtime_error( "recvfrom (oversized datagram)" );
+  } else if ( header.msg_flags ) {
+    throw runtime_error( "recvfrom (unhandled flag)" );
+  }
+}
+
+/* find the timestamp header (if there is one) */
+static uint64_t received_timestamp_us( msghdr & header )
+{
+  uint64_t timestamp_us = -1;
+
+  cmsghdr *ts_hdr = CMSG_FIRSTHDR( &header );
+  while ( ts_hdr ) {
+    if ( ts_hdr->cmsg_level == SOL_SOCKET
+	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
+      const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( ts_hdr ) );
+      timestamp_us = timestamp_us_raw( *kernel_time );
+    }
+    ts_hdr = CMSG_NXTHDR( &header, ts_hdr );
+  }
+
+  return timestamp_us;
+}
+
+static const size_t RECEIVE_MTU = 65536;
+
 /* receive datagram and where it came from */
 UDPSocket::received_datagram UDPSocket::recv( void )
 {
-  static const ssize_t RECEIVE_MTU = 65536;
-
   /* receive source address, timestamp and payload */
   Address::raw datagram_source_address;
   msghdr header; zero( header );
@@ -147,29 +178,11 @@ UDPSocket::received_datagram UDPSocket::recv( void )
   ssize_t recv_len = SystemCall( "recvmsg",
 				 recvmsg( fd_num(), &header, 0 ) );
 
-  /* make sure we got the whole datagram */
-  if ( header.msg_flags & MSG_TRUNC ) {
-    throw runtime_error( "recvfrom (oversized datagram)" );
-  } else if ( header.msg_flags ) {
-    throw runtime_error( "recvfrom (unhandled flag)" );
-  }
-
-  uint64_t timestamp_us = -1;
-
-  /* find the timestamp header (if there is one) */
-  cmsghdr *ts_hdr = CMSG_FIRSTHDR( &header );
-  while ( ts_hdr ) {
-    if ( ts_hdr->cmsg_level == SOL_SOCKET
-	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
-      const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( ts_hdr ) );
-      timestamp_us = timestamp_us_raw( *kernel_time );
-    }
-    ts_hdr = CMSG_NXTHDR( &header, ts_hdr );
-  }
+  check_received_flags( header );
 
   received_datagram ret = { Address( datagram_source_address,
                                      header.msg_namelen ),
-                            timestamp_us,
+                            received_timestamp_us( header ),
                             string( msg_payload, recv_len ) };
 
   register_read();
@@ -177,12 +190,68 @@ UDPSocket::received_datagram UDPSocket::recv( void )
   return ret;
 }
 
+/* receive the datagrams waiting on the socket, with one system call */
+const vector<UDPSocket::received_datagram_view> & UDPSocket::recv_batch( const size_t max_count )
+{
+  static const size_t CONTROL_SIZE = 256;
+
+  if ( max_count == 0 ) {
+    throw runtime_error( "recv_batch: nothing to receive" );
+  }
+
+  if ( batch_headers_.size() < max_count ) {
+    batch_payload_.resize( max_count * RECEIVE_MTU );
+    batch_control_.resize( max_count * CONTROL_SIZE );
+    batch_addresses_.resize( max_count );
+    batch_iovecs_.resize( max_count );
+    batch_headers_.resize( max_count );
+  }
+
+  for ( size_t i = 0; i < max_count; i++ ) {
+    msghdr & header = batch_headers_[ i ].msg_hdr;
+    zero( header );
+
+    header.msg_name = &batch_addresses_[ i ];
+    header.msg_namelen = sizeof( batch_addresses_[ i ] );
+
+    batch_iovecs_[ i ].iov_base = &batch_payload_[ i * RECEIVE_MTU ];
+    batch_iovecs_[ i ].iov_len = RECEIVE_MTU;
+    header.msg_iov = &batch_iovecs_[ i ];
+    header.msg_iovlen = 1;
+
+    header.msg_control = &batch_control_[ i * CONTROL_SIZE ];
+    header.msg_controllen = CONTROL_SIZE;
+  }
+
+  /* wait for the first datagram, then take whatever else is already here */
+  const int received = SystemCall( "recvmmsg",
+                                   recvmmsg( fd_num(), batch_headers_.data(), max_count,
+                                             MSG_WAITFORONE, nullptr ) );
+
+  batch_received_.clear();
+
+  for ( int i = 0; i < received; i++ ) {
+    msghdr & header = batch_headers_[ i ].msg_hdr;
+
+    check_received_flags( header );
+
+    batch_received_.push_back( { Address( batch_addresses_[ i ], header.msg_namelen ),
+                                 received_timestamp_us( header ),
+                                 Chunk( reinterpret_cast<const uint8_t *>( &batch_payload_[ i * RECEIVE_MTU ] ),
+                                        batch_headers_[ i ].msg_len ) } );
+  }
+
+  register_read();
+
+  return batch_received_;
+}
+
 /* send datagram to specified address */
-void UDPSocket::sendto( const Address & destination, const string & payload )
+void UDPSocket::sendto( const Address & destination, const Chunk & payload )
 {
   const ssize_t bytes_sent =
     SystemCall( "sendto", ::sendto( fd_num(),
-				    payload.data(),
+				    payload.buffer(),
 				    payload.size(),
 				    0,
 				    &destination.to_sockaddr(),
@@ -211,6 +280,163 @@ void UDPSocket::send( const string & payload )
   register_write();
 }
 
+/* send datagram made of several buffers to connected address */
+void UDPSocket::send( const vector<Chunk> & payload )
+{
+  vector<iovec> iov;
+  iov.reserve( payload.size() );
+
+  size_t payload_size = 0;
+
+  for ( const Chunk & buffer : payload ) {
+    iov.push_back( { const_cast<uint8_t *>( buffer.buffer() ), buffer.size() } );
+    payload_size += buffer.size();
+  }
+
+  msghdr header; zero( header );
+  header.msg_iov = iov.data();
+  header.msg_iovlen = iov.size();
+
+  const ssize_t bytes_sent =
+    SystemCall( "sendmsg", ::sendmsg( fd_num(), &header, 0 ) );
+
+  if ( size_t( bytes_sent ) != payload_size ) {
+    throw runtime_error( "datagram payload too big for sendmsg()" );
+  }
+
+  register_write();
+}
+
+/* is UDP generic segmentation offload usable on this socket? */
+bool UDPSocket::segmentation_offload( void )
+{
+#ifdef UDP_SEGMENT
+  if ( segmentation_ == Segmentation::Unknown ) {
+    int value;
+    socklen_t len = sizeof( value );
+    segmentation_ = ( getsockopt( fd_num(), SOL_UDP, UDP_SEGMENT, &value, &len ) == 0 )
+                  ? Segmentation::Available
+                  : Segmentation::Unavailable;
+  }
+
+  return segmentation_ == Segmentation::Available;
+#else
+  return false;
+#endif
+}
+
+/* send several datagrams to connected address. with segmentation offload,
+   a run of equal-sized datagrams (optionally ending with a shorter one) goes
+   down as a single message that the kernel splits up; otherwise, every
+   datagram is its own message. either way, sendmmsg() sends them all. */
+void UDPSocket::send_batch( const DatagramBatch & datagrams )
+{
+  /* kernel limits on a segmented message */
+  static const size_t MAX_SEGMENTS = 64;
+  static const size_t MAX_SEGMENTED_LENGTH = 65000;
+
+  static const size_t CONTROL_SIZE = CMSG_SPACE( sizeof( uint16_t ) );
+
+  const vector<iovec> & buffers = datagrams.buffers();
+
+  size_t first_unsent_datagram = 0;
+
+  while ( first_unsent_datagram < datagrams.size() ) {
+    const bool segmenting = segmentation_offload();
+
+    /* group the datagrams into messages */
+    outgoing_messages_.clear();
+
+    for ( size_t i = first_unsent_datagram; i < datagrams.size(); i++ ) {
+      size_t datagram_size = 0;
+      for ( size_t j = datagrams.first_buffer( i ); j < datagrams.end_buffer( i ); j++ ) {
+        datagram_size += buffers[ j ].iov_len;
+      }
+
+      const bool extend = segmenting and not outgoing_messages_.empty()
+        and not outgoing_messages_.back().closed
+        and datagram_size > 0
+        and datagram_size <= outgoing_messages_.back().segment_size
+        and outgoing_messages_.back().segments < MAX_SEGMENTS
+        and outgoing_messages_.back().length + datagram_size <= MAX_SEGMENTED_LENGTH;
+
+      if ( not extend ) {
+        outgoing_messages_.push_back( { i, datagrams.first_buffer( i ), 0, 0, datagram_size, 0, false } );
+      }
+
+      OutgoingMessage & message = outgoing_messages_.back();
+      message.buffer_count += datagrams.end_buffer( i ) - datagrams.first_buffer( i );
+      message.length += datagram_size;
+      message.segments++;
+
+      /* only the last segment may be shorter than the others */
+      message.closed = datagram_size < message.segment_size;
+    }
+
+    const size_t message_count = outgoing_messages_.size();
+
+    if ( outgoing_headers_.size() < message_count ) {
+      outgoing_headers_.resize( message_count );
+      outgoing_control_.resize( message_count * CONTROL_SIZE );
+    }
+
+    for ( size_t i = 0; i < message_count; i++ ) {
+      msghdr & header = outgoing_headers_[ i ].msg_hdr;
+      zero( header );
+
+      header.msg_iov = const_cast<iovec *>( buffers.data() ) + outgoing_messages_[ i ].first_buffer;
+      header.msg_iovlen = outgoing_messages_[ i ].buffer_count;
+
+#ifdef UDP_SEGMENT
+      if ( outgoing_messages_[ i ].segments > 1 ) {
+        header.msg_control = &outgoing_control_[ i * CONTROL_SIZE ];
+        header.msg_controllen = CONTROL_SIZE;
+
+        cmsghdr * const cmsg = CMSG_FIRSTHDR( &header );
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+
+        const uint16_t segment_size = outgoing_messages_[ i ].segment_size;
+        memcpy( CMSG_DATA( cmsg ), &segment_size, sizeof( segment_size ) );
+      }
+#endif
+    }
+
+    /* hand the messages to the kernel */
+    size_t first_unsent = 0;
+
+    while ( first_unsent < message_count ) {
+      const int sent = ::sendmmsg( fd_num(), outgoing_headers_.data() + first_unsent,
+                                   min<size_t>( message_count - first_unsent, UIO_MAXIOV ), 0 );
+
+      if ( sent < 0 ) {
+        if ( errno == EIO and segmenting ) {
+          /* the device can't offload segmentation after all; regroup
+             what's left one datagram per message */
+          segmentation_ = Segmentation::Unavailable;
+          break;
+        }
+
+        throw unix_error( "sendmmsg" );
+      }
+
+      for ( int i = 0; i < sent; i++ ) {
+        if ( outgoing_headers_[ first_unsent + i ].msg_len != outgoing_messages_[ first_unsent + i ].length ) {
+          throw runtime_error( "datagram payload too big for sendmmsg()" );
+        }
+      }
+
+      first_unsent += sent;
+      register_write();
+    }
+
+    first_unsent_datagram = ( first_unsent < message_count )
+                          ? outgoing_messages_[ first_unsent ].first_datagram
+                          : datagrams.size();
+  }
+}
+
 /* set socket option */
 template <typename option_type>
 void Socket::setsockopt( const int level, const int option, const option_type & option_value )
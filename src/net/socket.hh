@@ -30,6 +30,9 @@
 #define SOCKET_HH
 
 #include <functional>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "address.hh"
 #include "file_descriptor.hh"
@@ -72,23 +75,101 @@ public:
 class UDPSocket : public Socket
 {
 public:
-  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ) {}
-
   struct received_datagram {
     Address source_address;
     uint64_t timestamp_us;
     std::string payload;
   };
 
+  /* a datagram received by recv_batch(); the payload points into the
+     socket's receive buffer, and is only good until the next call */
+  struct received_datagram_view {
+    Address source_address;
+    uint64_t timestamp_us;
+    Chunk payload;
+  };
+
+  /* outgoing datagrams for send_batch(), each gathered from several
+     buffers. clear() keeps the storage, so a batch that is reused doesn't
+     allocate once it has grown to size. */
+  class DatagramBatch
+  {
+  private:
+    std::vector<iovec> buffers_ {};
+    std::vector<size_t> ends_ {}; /* one past the last buffer of each datagram */
+
+  public:
+    void clear( void ) { buffers_.clear(); ends_.clear(); }
+
+    void add_buffer( const Chunk & buffer )
+    {
+      if ( buffer.size() > 0 ) {
+        buffers_.push_back( { const_cast<uint8_t *>( buffer.buffer() ), buffer.size() } );
+      }
+    }
+
+    void end_datagram( void ) { ends_.push_back( buffers_.size() ); }
+
+    size_t size( void ) const { return ends_.size(); }
+    size_t first_buffer( const size_t datagram ) const { return datagram ? ends_[ datagram - 1 ] : 0; }
+    size_t end_buffer( const size_t datagram ) const { return ends_[ datagram ]; }
+    const std::vector<iovec> & buffers( void ) const { return buffers_; }
+  };
+
+private:
+  /* receive buffers for recv_batch(), one slot per datagram */
+  std::vector<char> batch_payload_ {};
+  std::vector<char> batch_control_ {};
+  std::vector<Address::raw> batch_addresses_ {};
+  std::vector<iovec> batch_iovecs_ {};
+  std::vector<mmsghdr> batch_headers_ {};
+  std::vector<received_datagram_view> batch_received_ {};
+
+  /* what send_batch() hands to the kernel, kept between calls */
+  struct OutgoingMessage {
+    size_t first_datagram;
+    size_t first_buffer;
+    size_t buffer_count;
+    size_t length;
+    size_t segment_size;
+    size_t segments;
+    bool closed;
+  };
+
+  std::vector<OutgoingMessage> outgoing_messages_ {};
+  std::vector<mmsghdr> outgoing_headers_ {};
+  std::vector<char> outgoing_control_ {};
+
+  /* can the kernel split a run of equal-sized datagrams for us (UDP GSO)? */
+  enum class Segmentation { Unknown, Available, Unavailable };
+  Segmentation segmentation_ { Segmentation::Unknown };
+
+  bool segmentation_offload( void );
+
+public:
+  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ) {}
+
   /* receive datagram, timestamp, and where it came from */
   received_datagram recv( void );
 
+  /* receive the datagrams waiting on the socket (at least one, blocking
+     if necessary), each with its own timestamp and source */
+  const std::vector<received_datagram_view> & recv_batch( const size_t max_count = 32 );
+
   /* send datagram to specified address */
-  void sendto( const Address & peer, const std::string & payload );
+  void sendto( const Address & peer, const Chunk & payload );
 
   /* send datagram to connected address */
   void send( const std::string & payload );
 
+  /* send datagram made of several buffers to connected address, without
+     copying them together first */
+  void send( const std::vector<Chunk> & payload );
+
+  /* send several datagrams to connected address in as few system calls
+     as possible */
+  void send_batch( const DatagramBatch & datagrams );
+
   /* turn on timestamps on receipt */
   void set_timestamps( void );
 };
@@ -53,7 +53,7 @@ int main( int argc, char *argv[] )
   }
 
   /* open the YUV4MPEG input */
-  YUV4MPEGReader input { argv[ 1 ] };
+  shared_ptr<FrameInput> input = make_yuv4mpeg_reader( argv[ 1 ] );
 
   /* parse the # of frames per second of playback */
   unsigned int frames_per_second = paranoid::stoul( argv[ 2 ] );
@@ -72,7 +72,7 @@ int main( int argc, char *argv[] )
     next_frame_is_due += interval_between_frames;
 
     /* get the next frame to send */
-    const Optional<RasterHandle> raster = input.get_next_frame();
+    const Optional<RasterHandle> raster = input->get_next_frame();
     if ( not raster.initialized() ) {
       break; /* eof */
     }
@@ -33,16 +33,21 @@
 #include <unordered_map>
 #include <utility>
 #include <tuple>
-#include <queue>
 #include <deque>
 #include <thread>
-#include <condition_variable>
-#include <future>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <algorithm>
 
 #include "socket.hh"
 #include "packet.hh"
 #include "poller.hh"
 #include "optional.hh"
+#include "eventfd.hh"
+#include "spsc_queue.hh"
+#include "finally.hh"
+#include "state_cache.hh"
 #include "player.hh"
 #include "display.hh"
 #include "paranoid.hh"
@@ -52,6 +57,13 @@ using namespace std;
 using namespace std::chrono;
 using namespace PollerShortNames;
 
+/* frames waiting to be decoded; if the decoder falls this far behind, new
+   frames are dropped (and the acks tell the sender) */
+static constexpr size_t DECODE_QUEUE_SIZE = 16;
+
+/* memory for the saved decoder states */
+static constexpr size_t DEFAULT_STATE_CACHE_MB = 256;
+
 class AverageInterPacketDelay
 {
 private:
@@ -84,7 +96,8 @@ public:
 
 void usage( const char *argv0 )
 {
-  cerr << "Usage: " << argv0 << " [-f, --fullscreen] [--verbose] PORT WIDTH HEIGHT" << endl;
+  cerr << "Usage: " << argv0 << " [-f, --fullscreen] [--verbose] [--state-cache-mb MB]"
+       << " PORT WIDTH HEIGHT" << endl;
 }
 
 uint16_t ezrand()
@@ -95,43 +108,74 @@ uint16_t ezrand()
   return ud( rd );
 }
 
-queue<RasterHandle> display_queue;
-mutex mtx;
-condition_variable cv;
+/* a frame handed over by the network thread, to be decoded */
+struct DecodeJob
+{
+  FragmentedFrame frame;
+  bool complete; /* otherwise, what arrived of it is decoded with concealment */
+};
+
+/* how far the decoder thread has got, for the network thread to ack */
+struct DecoderStatus
+{
+  std::mutex mutex {};
+  uint32_t current_state;
+  deque<uint32_t> complete_states {};
+  StateCacheStats cache_stats {};
+  exception_ptr error {};
+
+  DecoderStatus( const uint32_t initial_state ) : current_state( initial_state ) {}
+};
+
+/* the newest decoded frame; if the display hasn't drawn the last one yet,
+   it is replaced rather than queued behind it */
+struct DisplayMailbox
+{
+  std::mutex mutex {};
+  Optional<RasterHandle> raster {};
+  EventFD ready {};
+};
 
-void display_task( const VP8Raster & example_raster, bool fullscreen )
+void display_task( const VP8Raster & example_raster, bool fullscreen, DisplayMailbox & mailbox )
 {
   VideoDisplay display { example_raster, fullscreen };
 
   while( true ) {
-    unique_lock<mutex> lock( mtx );
-    cv.wait( lock, []() { return not display_queue.empty(); } );
+    mailbox.ready.wait_any();
+
+    Optional<RasterHandle> raster;
 
-    while( not display_queue.empty() ) {
-      display.draw( display_queue.front() );
-      display_queue.pop();
+    {
+      unique_lock<mutex> lock { mailbox.mutex };
+
+      if ( mailbox.raster.initialized() ) {
+        raster = move( mailbox.raster );
+        mailbox.raster.clear();
+      }
+    }
+
+    if ( raster.initialized() ) {
+      display.draw( raster.get() );
     }
   }
 }
 
-void enqueue_frame( FramePlayer & player, const Chunk & frame )
+void decode_frame( FramePlayer & player, const Chunk & frame, DisplayMailbox & mailbox )
 {
   if ( frame.size() == 0 ) {
     return;
   }
 
-  const Optional<RasterHandle> raster = player.decode( frame );
+  Optional<RasterHandle> raster = player.decode( frame );
 
-  async( launch::async,
-    [&raster]()
+  if ( raster.initialized() ) {
     {
-      if ( raster.initialized() ) {
-        lock_guard<mutex> lock( mtx );
-        display_queue.push( raster.get() );
-        cv.notify_all();
-      }
+      unique_lock<mutex> lock { mailbox.mutex };
+      mailbox.raster = move( raster );
     }
-  );
+
+    mailbox.ready.signal();
+  }
 }
 
 int main( int argc, char *argv[] )
@@ -144,10 +188,12 @@ int main( int argc, char *argv[] )
   /* fullscreen player */
   bool fullscreen = false;
   bool verbose = false;
+  size_t state_cache_budget = DEFAULT_STATE_CACHE_MB << 20;
 
   const option command_line_options[] = {
-    { "fullscreen", no_argument, nullptr, 'f' },
-    { "verbose",    no_argument, nullptr, 'v' },
+    { "fullscreen",     no_argument,       nullptr, 'f' },
+    { "verbose",        no_argument,       nullptr, 'v' },
+    { "state-cache-mb", required_argument, nullptr, 'm' },
     { 0, 0, 0, 0 }
   };
 
@@ -167,6 +213,10 @@ int main( int argc, char *argv[] )
       verbose = true;
       break;
 
+    case 'm':
+      state_cache_budget = paranoid::stoul( optarg ) << 20;
+      break;
+
     default:
       usage( argv[ 0 ] );
       return EXIT_FAILURE;
@@ -192,128 +242,238 @@ int main( int argc, char *argv[] )
   player.set_error_concealment( true );
 
   /* construct display thread */
-  thread( [&player, fullscreen]() { display_task( player.example_raster(), fullscreen ); } ).detach();
-
-  /* frame no => FragmentedFrame; used when receiving packets out of order */
-  unordered_map<size_t, FragmentedFrame> fragmented_frames;
-  size_t next_frame_no = 0;
-
-  /* EWMA */
-  AverageInterPacketDelay avg_delay;
+  DisplayMailbox display_mailbox;
+  thread( [&player, fullscreen, &display_mailbox]()
+          { display_task( player.example_raster(), fullscreen, display_mailbox ); } ).detach();
 
   /* decoder states */
-  uint32_t current_state = player.current_decoder().get_hash().hash();
-  const uint32_t initial_state = current_state;
-  deque<uint32_t> complete_states;
-  unordered_map<uint32_t, Decoder> decoders { { current_state, player.current_decoder() } };
+  const uint32_t initial_state = player.current_decoder().get_hash().hash();
+  DecoderStatus decoder_status { initial_state };
 
-  /* memory usage logs */
-  system_clock::time_point next_mem_usage_report = system_clock::now();
+  /* frames are decoded on their own thread, so that a slow decode doesn't
+     hold up the acks (or the inter-packet delays they report) */
+  SPSCQueue<DecodeJob> decode_queue { DECODE_QUEUE_SIZE };
+  EventFD decode_ready;
+  EventFD decoder_failed;
+  atomic<bool> decoding { true };
 
-  Poller poller;
-  poller.add_action( Poller::Action( socket, Direction::In,
-    [&]()
+  thread decode_thread( [&]()
     {
-      /* wait for next UDP datagram */
-      const auto new_fragment = socket.recv();
+      try {
+        uint32_t current_state = initial_state;
+
+        /* only this thread changes the complete states, so it can read them
+           without the lock */
+        deque<uint32_t> & complete_states = decoder_status.complete_states;
+
+        /* the sender may always fall back to the initial state, or to the
+           newest complete state we've told it about */
+        const VP8Raster & example_raster = player.example_raster();
+        StateCache<Decoder> decoders { state_cache_budget,
+                                       size_t( example_raster.width() ) * example_raster.height() * 3 / 2,
+                                       sizeof( Decoder ),
+                                       [&]( const uint32_t state )
+                                       {
+                                         return state == initial_state or
+                                           ( not complete_states.empty() and state == complete_states.back() );
+                                       } };
+
+        Decoder initial_decoder = player.current_decoder();
+        decoders.insert( initial_state, move( initial_decoder ), player.current_decoder().get_references() );
+
+        while ( decoding ) {
+          Optional<DecodeJob> job = decode_queue.pop();
+
+          if ( not job.initialized() ) {
+            decode_ready.wait_any();
+            continue;
+          }
 
-      /* parse into Packet */
-      const Packet packet { new_fragment.payload };
+          const FragmentedFrame & fragment = job.get().frame;
 
-      if ( packet.frame_no() < next_frame_no ) {
-        /* we're not interested in this anymore */
-        return ResultType::Continue;
-      }
-      else if ( packet.frame_no() > next_frame_no ) {
-        /* current frame is not finished yet, but we just received a packet
-           for the next frame, so here we just encode the partial frame and
-           display it and move on to the next frame */
-        cerr << "got a packet for frame #" << packet.frame_no()
-             << ", display previous frame(s)." << endl;
-
-        for ( size_t i = next_frame_no; i < packet.frame_no(); i++ ) {
-          if ( fragmented_frames.count( i ) == 0 ) continue;
-
-          enqueue_frame( player, fragmented_frames.at( i ).partial_frame() );
-          fragmented_frames.erase( i );
-        }
+          if ( not job.get().complete ) {
+            decode_frame( player, fragment.partial_frame(), display_mailbox );
+            current_state = player.current_decoder().minihash();
 
-        next_frame_no = packet.frame_no();
-        current_state = player.current_decoder().minihash();
-      }
+            unique_lock<mutex> lock { decoder_status.mutex };
+            decoder_status.current_state = current_state;
+            continue;
+          }
 
-      /* add to current frame */
-      if ( fragmented_frames.count( packet.frame_no() ) ) {
-        fragmented_frames.at( packet.frame_no() ).add_packet( packet );
-      } else {
-        /*
-          This was judged "too fancy" by the Code Review Board of Dec. 29, 2016.
+          uint32_t expected_source_state = fragment.source_state();
 
-          fragmented_frames.emplace( std::piecewise_construct,
-                                     forward_as_tuple( packet.frame_no() ),
-                                     forward_as_tuple( connection_id, packet ) );
-        */
+          if ( current_state != expected_source_state ) {
+            Decoder * saved = decoders.find( expected_source_state );
+            if ( saved != nullptr ) {
+              /* we have this state! let's load it */
+              player.set_decoder( *saved );
+              current_state = expected_source_state;
+            }
+          }
 
-        fragmented_frames.insert( make_pair( packet.frame_no(),
-                                             FragmentedFrame( connection_id, packet ) ) );
-      }
+          if ( current_state == expected_source_state and
+               expected_source_state != initial_state ) {
+            /* sender won't refer to any decoder older than this, so let's get
+               rid of them */
 
-      /* is the next frame ready to be decoded? */
-      if ( fragmented_frames.count( next_frame_no ) > 0 and fragmented_frames.at( next_frame_no ).complete() ) {
-        auto & fragment = fragmented_frames.at( next_frame_no );
+            /* (unless the cache has already let it go) */
+            auto it = find( complete_states.begin(), complete_states.end(),
+                            expected_source_state );
 
-        uint32_t expected_source_state = fragment.source_state();
+            if ( it != complete_states.end() ) {
+              for_each( complete_states.begin(), it,
+                        [&]( const uint32_t state ) { decoders.erase( state ); } );
 
-        if ( current_state != expected_source_state ) {
-          if ( decoders.count( expected_source_state ) ) {
-            /* we have this state! let's load it */
-            player.set_decoder( decoders.at( expected_source_state ) );
-            current_state = expected_source_state;
+              unique_lock<mutex> lock { decoder_status.mutex };
+              complete_states.erase( complete_states.begin(), it );
+            }
           }
-        }
 
-        if ( current_state == expected_source_state and
-             expected_source_state != initial_state ) {
-          /* sender won't refer to any decoder older than this, so let's get
-             rid of them */
+          // here we apply the frame
+          decode_frame( player, fragment.frame(), display_mailbox );
 
-          auto it = complete_states.begin();
+          // state "after" applying the frame
+          current_state = player.current_decoder().minihash();
 
-          for ( ; it != complete_states.end(); it++ ) {
-            if ( *it != expected_source_state ) {
-              decoders.erase( *it );
-            }
-            else {
-              break;
+          const bool full_state = current_state == fragment.target_state()
+                                  and current_state != initial_state;
+
+          unique_lock<mutex> lock { decoder_status.mutex, defer_lock };
+
+          if ( full_state ) {
+            /* this is a full state. let's save it, and stop telling the
+               sender about any that were evicted to make room */
+            Decoder saved = player.current_decoder();
+            const vector<uint32_t> & evicted =
+              decoders.insert( current_state, move( saved ), player.current_decoder().get_references() );
+
+            lock.lock();
+
+            for ( const uint32_t state : evicted ) {
+              complete_states.erase( remove( complete_states.begin(), complete_states.end(), state ),
+                                     complete_states.end() );
             }
+
+            complete_states.push_back( current_state );
+          }
+          else {
+            lock.lock();
           }
 
-          assert( it != complete_states.end() );
-          complete_states.erase( complete_states.begin(), it );
+          decoder_status.current_state = current_state;
+          decoder_status.cache_stats = decoders.stats();
         }
+      }
+      catch ( ... ) {
+        unique_lock<mutex> lock { decoder_status.mutex };
+        decoder_status.error = current_exception();
+        decoder_failed.signal();
+      }
+    } );
 
-        // here we apply the frame
-        enqueue_frame( player, fragment.frame() );
+  auto stop_decoding = finally(
+    [&]()
+    {
+      decoding = false;
+      decode_ready.signal();
+      decode_thread.join();
+    }
+  );
 
-        // state "after" applying the frame
-        current_state = player.current_decoder().minihash();
+  /* hands a frame to the decoder thread, without waiting for it */
+  auto enqueue_frame =
+    [&]( FragmentedFrame && frame, const bool complete )
+    {
+      const uint32_t frame_no = frame.frame_no();
+
+      if ( not decode_queue.push( { move( frame ), complete } ) ) {
+        cerr << "decoder is falling behind, dropping frame #" << frame_no << endl;
+        return;
+      }
 
-        if ( current_state == fragment.target_state() and
-             current_state != initial_state ) {
-          /* this is a full state. let's save it */
-          decoders.insert( make_pair( current_state, player.current_decoder() ) );
-          complete_states.push_back( current_state );
+      decode_ready.signal();
+    };
+
+  /* frame no => FragmentedFrame; used when receiving packets out of order */
+  unordered_map<size_t, FragmentedFrame> fragmented_frames;
+  size_t next_frame_no = 0;
+
+  /* fragments rebuilt from parity packets */
+  size_t recovered_fragments = 0;
+
+  /* EWMA */
+  AverageInterPacketDelay avg_delay;
+
+  /* memory usage logs */
+  system_clock::time_point next_mem_usage_report = system_clock::now();
+
+  Poller poller { Poller::Backend::Epoll };
+  poller.add_action( Poller::Action( socket, Direction::In,
+    [&]()
+    {
+      /* wait for the next UDP datagrams, and take all that are waiting */
+      for ( const auto & new_fragment : socket.recv_batch() ) {
+        /* parse into Packet */
+        const Packet packet { new_fragment.payload };
+
+        if ( packet.frame_no() > next_frame_no ) {
+          /* current frame is not finished yet, but we just received a packet
+             for the next frame, so here we just encode the partial frame and
+             display it and move on to the next frame */
+          cerr << "got a packet for frame #" << packet.frame_no()
+               << ", display previous frame(s)." << endl;
+
+          for ( size_t i = next_frame_no; i < packet.frame_no(); i++ ) {
+            if ( fragmented_frames.count( i ) == 0 ) continue;
+
+            recovered_fragments += fragmented_frames.at( i ).recovered_fragments();
+            enqueue_frame( move( fragmented_frames.at( i ) ), false );
+            fragmented_frames.erase( i );
+          }
+
+          next_frame_no = packet.frame_no();
         }
 
-        fragmented_frames.erase( next_frame_no );
-        next_frame_no++;
-      }
+        /* add to current frame */
+        if ( packet.frame_no() < next_frame_no ) {
+          /* we're not interested in this anymore, but the sender still
+             wants an ack for it (e.g. parity that arrived after its frame
+             was already rebuilt) */
+        }
+        else if ( fragmented_frames.count( packet.frame_no() ) ) {
+          fragmented_frames.at( packet.frame_no() ).add_packet( packet );
+        } else {
+          /*
+            This was judged "too fancy" by the Code Review Board of Dec. 29, 2016.
+
+            fragmented_frames.emplace( std::piecewise_construct,
+                                       forward_as_tuple( packet.frame_no() ),
+                                       forward_as_tuple( connection_id, packet ) );
+          */
+
+          fragmented_frames.insert( make_pair( packet.frame_no(),
+                                               FragmentedFrame( connection_id, packet ) ) );
+        }
+
+        /* is the next frame ready to be decoded? */
+        if ( fragmented_frames.count( next_frame_no ) > 0 and fragmented_frames.at( next_frame_no ).complete() ) {
+          recovered_fragments += fragmented_frames.at( next_frame_no ).recovered_fragments();
+          enqueue_frame( move( fragmented_frames.at( next_frame_no ) ), true );
+          fragmented_frames.erase( next_frame_no );
+          next_frame_no++;
+        }
 
-      avg_delay.add( new_fragment.timestamp_us, packet.time_since_last() );
+        avg_delay.add( new_fragment.timestamp_us, packet.time_since_last() );
 
-      AckPacket( connection_id, packet.frame_no(), packet.fragment_no(),
-                 avg_delay.int_value(), current_state,
-                 complete_states ).sendto( socket, new_fragment.source_address );
+        /* the ack carries whatever state the decoder has reached by now */
+        unique_lock<mutex> lock { decoder_status.mutex };
+        const AckPacket ack { connection_id, packet.frame_no(), packet.fragment_no(),
+                              avg_delay.int_value(), decoder_status.current_state,
+                              decoder_status.complete_states };
+        lock.unlock();
+
+        ack.sendto( socket, new_fragment.source_address );
+      }
 
       auto now = system_clock::now();
 
@@ -321,13 +481,27 @@ int main( int argc, char *argv[] )
         cerr << "["
              << duration_cast<milliseconds>( now.time_since_epoch() ).count()
              << "] "
-             << " <mem = " << procinfo::memory_usage() << ">\n";
+             << " <mem = " << procinfo::memory_usage() << ">"
+             << " <recovered = " << recovered_fragments << ">";
+
+        unique_lock<mutex> lock { decoder_status.mutex };
+        cerr << " <states: " << decoder_status.cache_stats << ">\n";
         next_mem_usage_report = now + 5s;
       }
 
       return ResultType::Continue;
-    },
-    [&]() { return not socket.eof(); } )
+    } )
+  );
+
+  poller.add_action( Poller::Action( decoder_failed, Direction::In,
+    [&]()
+    {
+      decoder_failed.wait();
+
+      unique_lock<mutex> lock { decoder_status.mutex };
+      rethrow_exception( decoder_status.error );
+      return ResultType::Exit;
+    } )
   );
 
   /* handle events */
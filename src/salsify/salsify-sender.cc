@@ -34,12 +34,13 @@
 #include <vector>
 #include <random>
 #include <limits>
-#include <thread>
-#include <future>
+#include <mutex>
 #include <algorithm>
 #include <unordered_map>
 #include <iomanip>
 #include <cmath>
+#include <thread>
+#include <atomic>
 
 #include "exception.hh"
 #include "finally.hh"
@@ -49,10 +50,12 @@
 #include "socket.hh"
 #include "packet.hh"
 #include "poller.hh"
-#include "socketpair.hh"
 #include "camera.hh"
 #include "pacer.hh"
 #include "procinfo.hh"
+#include "worker_pool.hh"
+#include "eventfd.hh"
+#include "state_cache.hh"
 
 using namespace std;
 using namespace std::chrono;
@@ -85,12 +88,223 @@ public:
     last_update_ = timestamp_us;
   }
 
-  uint32_t int_value() const { return static_cast<uint32_t>( value_ ); }
+  /* for samples that are durations themselves, rather than the time since
+     the last call */
+  void add_duration( const microseconds duration )
+  {
+    value_ = ( value_ < 0 )
+           ? duration.count()
+           : ALPHA * duration.count() + ( 1 - ALPHA ) * value_;
+  }
+
+  uint32_t int_value() const { return static_cast<uint32_t>( max( 0.0, value_ ) ); }
+};
+
+/* decides how many quantizers S2 mode tries for each frame, and how far
+   apart they are. more options cover more of the capacity curve, as long
+   as they all finish within a camera frame interval; when the network
+   estimate is jumpy, the options are spread further apart. */
+class CandidatePlanner
+{
+private:
+  static constexpr double ALPHA = 0.2;
+
+  /* the options have to be ready before the camera's next frame (30 fps) */
+  static constexpr double FRAME_BUDGET_MS = 33.0;
+
+  /* hysteresis: drop options when the frames take longer than HIGH_WATER of
+     the budget, add one only if the prediction stays below LOW_WATER */
+  static constexpr double HIGH_WATER = 0.9;
+  static constexpr double LOW_WATER = 0.6;
+
+  /* frames to wait after a change before adding, or dropping, options again */
+  static constexpr unsigned int GROW_FRAMES = 10;
+  static constexpr unsigned int SHRINK_FRAMES = 3;
+
+  /* quantizer steps below and above the last quantizer, for a steady network */
+  static constexpr int BASE_STEP_DOWN = 17;
+  static constexpr int BASE_STEP_UP = 23;
+
+  const unsigned int max_count_;
+  unsigned int count_ { 2 };
+  unsigned int frames_since_change_ { 0 };
+
+  /* how long one option takes to encode, and how long all of a frame's
+     options take, from submission until the last one is done */
+  AverageEncodingTime option_time_ {};
+  AverageEncodingTime frame_time_ {};
+
+  double delay_volatility_ { 0.0 };
+  uint32_t last_avg_delay_ { 0 };
+
+  /* how long `count` options would take, if they run as much side by side
+     as the current ones did */
+  double predicted_frame_ms( const unsigned int count ) const
+  {
+    const double option_ms = max( 0.001, option_time_.int_value() / 1000.0 );
+    const double frame_ms = max( option_ms, frame_time_.int_value() / 1000.0 );
+    const double parallelism = max( 1.0, min<double>( max_count_, count_ * option_ms / frame_ms ) );
+
+    return option_ms * ceil( count / parallelism );
+  }
+
+public:
+  static constexpr unsigned int MAX_CANDIDATES = 8;
+
+  /* `workers` is the number of options that can be encoded at once */
+  CandidatePlanner( const unsigned int workers )
+    : max_count_( max( 1u, min( workers, MAX_CANDIDATES ) ) ),
+      count_( min( 2u, max_count_ ) )
+  {}
+
+  /* a frame's options are all done: `elapsed` is the wall-clock time from
+     submitting them until the last one finished, `option_time` the average
+     time one of them took to encode */
+  void add_frame_time( const microseconds elapsed, const microseconds option_time )
+  {
+    option_time_.add_duration( option_time );
+    frame_time_.add_duration( elapsed );
+    frames_since_change_++;
+
+    const double frame_ms = frame_time_.int_value() / 1000.0;
+
+    if ( frame_ms > HIGH_WATER * FRAME_BUDGET_MS ) {
+      if ( count_ > 1 and frames_since_change_ >= SHRINK_FRAMES ) {
+        /* back off to what fits comfortably */
+        unsigned int count = count_ - 1;
+        while ( count > 1 and predicted_frame_ms( count ) > LOW_WATER * FRAME_BUDGET_MS ) {
+          count--;
+        }
+
+        count_ = count;
+        frames_since_change_ = 0;
+      }
+    }
+    else if ( count_ < max_count_ and frames_since_change_ >= GROW_FRAMES
+              and predicted_frame_ms( count_ + 1 ) < LOW_WATER * FRAME_BUDGET_MS ) {
+      /* grow one option at a time */
+      count_++;
+      frames_since_change_ = 0;
+    }
+  }
+
+  /* the receiver's average inter-packet delay, as reported in an ack */
+  void add_delay_sample( const uint32_t avg_delay )
+  {
+    if ( avg_delay == 0 or avg_delay == numeric_limits<uint32_t>::max() ) {
+      return;
+    }
+
+    if ( last_avg_delay_ != 0 ) {
+      const double change = abs( 1.0 * avg_delay - 1.0 * last_avg_delay_ ) / last_avg_delay_;
+      delay_volatility_ = ALPHA * min( 1.0, change ) + ( 1 - ALPHA ) * delay_volatility_;
+    }
+
+    last_avg_delay_ = avg_delay;
+  }
+
+  unsigned int count() const { return count_; }
+
+  /* the quantizers to try, from the finest to the coarsest, without repeats */
+  vector<uint8_t> quantizers( const uint8_t last_quantizer ) const
+  {
+    if ( count_ == 1 ) {
+      return { last_quantizer };
+    }
+
+    /* up to twice the usual spread when the estimate is changing fast */
+    const double spread = 1.0 + min( 1.0, 4 * delay_volatility_ );
+    const int low = max( 3, static_cast<int>( last_quantizer - spread * BASE_STEP_DOWN ) );
+    const int high = min( 127, static_cast<int>( last_quantizer + spread * BASE_STEP_UP ) );
+
+    vector<uint8_t> output;
+
+    for ( unsigned int i = 0; i < count_; i++ ) {
+      const uint8_t q = low + lround( 1.0 * ( high - low ) * i / ( count_ - 1 ) );
+
+      if ( output.empty() or output.back() != q ) {
+        output.push_back( q );
+      }
+    }
+
+    return output;
+  }
+};
+
+constexpr unsigned int CandidatePlanner::MAX_CANDIDATES;
+
+/* Decides how many parity packets to send with each frame (--fec). Every
+   packet on the wire, parity included, is acked, so packets that never got
+   an ack are counted as lost; the overhead follows that loss rate, with
+   some headroom since losses come in bursts. */
+class FECPlanner
+{
+private:
+  static constexpr double ALPHA = 0.02;
+
+  /* below this loss rate no parity is sent at all */
+  static constexpr double MIN_LOSS = 0.002;
+  static constexpr double HEADROOM = 3.0;
+  static constexpr double MAX_OVERHEAD = 0.5;
+
+  double loss_rate_ { 0.0 };
+
+public:
+  /* an ack arrived for a packet, after `missed` earlier packets went unacked */
+  void add_ack( const uint64_t missed )
+  {
+    /* one sample per packet, without looping over a long outage */
+    const double keep = pow( 1 - ALPHA, min<uint64_t>( missed, 1000 ) );
+    loss_rate_ = keep * loss_rate_ + ( 1 - keep );
+    loss_rate_ = ( 1 - ALPHA ) * loss_rate_;
+  }
+
+  double loss_rate() const { return loss_rate_; }
+
+  /* parity packets per data packet */
+  double overhead() const
+  {
+    return ( loss_rate_ < MIN_LOSS ) ? 0.0 : min( MAX_OVERHEAD, HEADROOM * loss_rate_ );
+  }
+
+  uint16_t parity_count( const size_t fragments ) const
+  {
+    if ( overhead() == 0.0 ) {
+      return 0;
+    }
+
+    return min<size_t>( fragments, max<size_t>( 1, ceil( fragments * overhead() ) ) );
+  }
+};
+
+constexpr double FECPlanner::MAX_OVERHEAD;
+
+/* motion search results shared by all the jobs of a frame; the first job
+   to need them does the search, and the others wait for it */
+struct SharedAnalysis
+{
+  once_flag done {};
+  unique_ptr<const FrameAnalysis> analysis {};
+  uint8_t quantizer;
+
+  SharedAnalysis( const uint8_t quantizer ) : quantizer( quantizer ) {}
+};
+
+/* the newest frame from the camera, handed over by the capture thread */
+struct CapturedFrame
+{
+  std::mutex mutex {};
+  Optional<RasterHandle> raster {};
+  bool failed { false };
+  exception_ptr error {};
 };
 
 struct EncodeJob
 {
   string name;
+  size_t index { 0 }; /* among the jobs of this frame */
+  uint64_t batch { 0 };
+  shared_ptr<const atomic<bool>> cancelled {};
 
   RasterHandle raster;
 
@@ -100,34 +314,45 @@ struct EncodeJob
   uint8_t y_ac_qi;
   size_t target_size;
 
+  shared_ptr<SharedAnalysis> analysis;
+
   EncodeJob( const string & name, RasterHandle raster, const Encoder & encoder,
              const EncoderMode mode, const uint8_t y_ac_qi, const size_t target_size )
     : name( name ), raster( raster ), encoder( encoder ),
-      mode( mode ), y_ac_qi( y_ac_qi ), target_size( target_size )
+      mode( mode ), y_ac_qi( y_ac_qi ), target_size( target_size ),
+      analysis()
   {}
+
+  bool is_cancelled() const { return cancelled and *cancelled; }
 };
 
 struct EncodeOutput
 {
   Encoder encoder;
-  vector<uint8_t> frame;
+  shared_ptr<const SerializedFrame> frame; /* shared with the packets in the pacer */
   uint32_t source_minihash;
-  milliseconds encode_time;
+  microseconds encode_time;
   string job_name;
+  size_t job_index;
+  uint64_t batch;
   uint8_t y_ac_qi;
 
-  EncodeOutput( Encoder && encoder, vector<uint8_t> && frame,
-                const uint32_t source_minihash, const milliseconds encode_time,
-                const string & job_name, const uint8_t y_ac_qi )
-    : encoder( move( encoder ) ), frame( move( frame ) ),
+  /* set if the encode threw (e.g. EncodeCancelled) instead of producing a frame */
+  exception_ptr error {};
+
+  EncodeOutput( Encoder && encoder, SerializedFrame && frame,
+                const uint32_t source_minihash, const microseconds encode_time,
+                const string & job_name, const size_t job_index, const uint64_t batch,
+                const uint8_t y_ac_qi )
+    : encoder( move( encoder ) ), frame( make_shared<const SerializedFrame>( move( frame ) ) ),
       source_minihash( source_minihash ), encode_time( encode_time ),
-      job_name( job_name ), y_ac_qi( y_ac_qi )
+      job_name( job_name ), job_index( job_index ), batch( batch ), y_ac_qi( y_ac_qi )
   {}
 };
 
 EncodeOutput do_encode_job( EncodeJob && encode_job )
 {
-  vector<uint8_t> output;
+  SerializedFrame output;
 
   uint32_t source_minihash = encode_job.encoder.minihash();
 
@@ -135,26 +360,62 @@ EncodeOutput do_encode_job( EncodeJob && encode_job )
 
   uint8_t quantizer_in_use = 0;
 
-  switch ( encode_job.mode ) {
-  case CONSTANT_QUANTIZER:
-    output = encode_job.encoder.encode_with_quantizer( encode_job.raster.get(),
-                                                       encode_job.y_ac_qi );
-    quantizer_in_use = encode_job.y_ac_qi;
-    break;
+  if ( encode_job.is_cancelled() ) {
+    /* abandoned before it started; nobody will look at the output */
+    return { move( encode_job.encoder ), move( output ), source_minihash, microseconds( 0 ),
+             encode_job.name, encode_job.index, encode_job.batch, quantizer_in_use };
+  }
+
+  /* abandoning the job stops the encoder between macroblock rows */
+  encode_job.encoder.set_cancel_flag( encode_job.cancelled );
+
+  exception_ptr error;
 
-  case TARGET_FRAME_SIZE:
-    output = encode_job.encoder.encode_with_target_size( encode_job.raster.get(),
-                                                         encode_job.target_size );
-    break;
+  try {
+    switch ( encode_job.mode ) {
+    case CONSTANT_QUANTIZER:
+      if ( encode_job.analysis ) {
+        SharedAnalysis & shared = *encode_job.analysis;
+        call_once( shared.done, [&]() {
+            shared.analysis.reset( new FrameAnalysis(
+              encode_job.encoder.analyze( encode_job.raster.get(), shared.quantizer ) ) );
+          } );
+      }
 
-  default:
-    throw runtime_error( "unsupported encoding mode." );
+      output = encode_job.analysis
+        ? encode_job.encoder.encode_with_quantizer( encode_job.raster.get(),
+                                                    encode_job.y_ac_qi,
+                                                    *encode_job.analysis->analysis )
+        : encode_job.encoder.encode_with_quantizer( encode_job.raster.get(),
+                                                    encode_job.y_ac_qi );
+      quantizer_in_use = encode_job.y_ac_qi;
+      break;
+
+    case TARGET_FRAME_SIZE:
+      output = encode_job.encoder.encode_with_target_size( encode_job.raster.get(),
+                                                           encode_job.target_size );
+      break;
+
+    default:
+      throw runtime_error( "unsupported encoding mode." );
+    }
+  } catch ( ... ) {
+    /* whether this matters depends on whether the batch is still wanted,
+       which only the main thread knows */
+    error = current_exception();
   }
 
+  /* the encoder outlives this job (if the job wasn't abandoned) */
+  encode_job.encoder.set_cancel_flag( nullptr );
+
   const auto encode_ending = system_clock::now();
-  const auto ms_elapsed = duration_cast<milliseconds>( encode_ending - encode_beginning );
+  const auto elapsed = duration_cast<microseconds>( encode_ending - encode_beginning );
+
+  EncodeOutput encode_output { move( encode_job.encoder ), move( output ), source_minihash, elapsed,
+                               encode_job.name, encode_job.index, encode_job.batch, quantizer_in_use };
+  encode_output.error = error;
 
-  return { move( encode_job.encoder ), move( output ), source_minihash, ms_elapsed, encode_job.name, quantizer_in_use };
+  return encode_output;
 }
 
 size_t target_size( uint32_t avg_delay, const uint64_t last_acked, const uint64_t last_sent,
@@ -169,13 +430,26 @@ size_t target_size( uint32_t avg_delay, const uint64_t last_acked, const uint64_
   return 1400 * max( 0l, static_cast<int64_t>( max_delay / avg_delay - ( last_sent - last_acked ) ) );
 }
 
+/* encode jobs that can be waiting for or running on the workers at once */
+static constexpr size_t ENCODE_QUEUE_SIZE = 64;
+
+/* memory for the encoder states kept for the receiver to refer to */
+static constexpr size_t DEFAULT_STATE_CACHE_MB = 256;
+
 void usage( const char *argv0 )
 {
   cerr << "Usage: " << argv0
        << " [-m,--mode MODE] [-d, --device CAMERA] [-p, --pixfmt PIXEL_FORMAT]"
-       << " [-u,--update-rate RATE] [--log-mem-usage] HOST PORT CONNECTION_ID" << endl
+       << " [-u,--update-rate RATE] [--log-mem-usage] [--token-bucket] [--spin-us MICROSECONDS]"
+       << " [--state-cache-mb MB] [--fec]"
+       << " HOST PORT CONNECTION_ID" << endl
        << endl
-       << "Accepted MODEs are s1, s2 (default), conventional." << endl;
+       << "Accepted MODEs are s1, s2 (default), conventional." << endl
+       << "--token-bucket paces packets at the estimated capacity, rather than spacing them out;" << endl
+       << "--spin-us busy-waits for the last few microseconds before each packet is due;" << endl
+       << "--state-cache-mb limits the memory for the encoder states kept (default: "
+       << DEFAULT_STATE_CACHE_MB << ");" << endl
+       << "--fec sends parity packets with each frame, as many as the loss rate calls for." << endl;
 }
 
 uint64_t ack_seq_no( const AckPacket & ack,
@@ -204,6 +478,10 @@ int main( int argc, char *argv[] )
   size_t update_rate __attribute__((unused)) = 1;
   OperationMode operation_mode = OperationMode::S2;
   bool log_mem_usage = false;
+  bool token_bucket = false;
+  microseconds pacer_spin { 0 };
+  size_t state_cache_budget = DEFAULT_STATE_CACHE_MB << 20;
+  bool fec = false;
 
   const option command_line_options[] = {
     { "mode",          required_argument, nullptr, 'm' },
@@ -211,6 +489,10 @@ int main( int argc, char *argv[] )
     { "pixfmt",        required_argument, nullptr, 'p' },
     { "update-rate",   required_argument, nullptr, 'u' },
     { "log-mem-usage", no_argument,       nullptr, 'M' },
+    { "token-bucket",  no_argument,       nullptr, 'T' },
+    { "spin-us",       required_argument, nullptr, 'S' },
+    { "state-cache-mb", required_argument, nullptr, 'C' },
+    { "fec",           no_argument,       nullptr, 'F' },
     { 0, 0, 0, 0 }
   };
 
@@ -243,6 +525,22 @@ int main( int argc, char *argv[] )
       log_mem_usage = true;
       break;
 
+    case 'T':
+      token_bucket = true;
+      break;
+
+    case 'S':
+      pacer_spin = microseconds( paranoid::stoul( optarg ) );
+      break;
+
+    case 'C':
+      state_cache_budget = paranoid::stoul( optarg ) << 20;
+      break;
+
+    case 'F':
+      fec = true;
+      break;
+
     default:
       usage( argv[ 0 ] );
       return EXIT_FAILURE;
@@ -261,6 +559,7 @@ int main( int argc, char *argv[] )
 
   /* make pacer to smooth out outgoing packets */
   Pacer pacer;
+  pacer.set_spin( pacer_spin );
 
   /* get connection_id */
   const uint16_t connection_id = paranoid::stoul( argv[ optind + 2 ] );
@@ -272,6 +571,9 @@ int main( int argc, char *argv[] )
   vector<uint64_t> cumulative_fpf;
   uint64_t last_acked = numeric_limits<uint64_t>::max();
 
+  /* in token-bucket mode, how many bytes may go out back to back */
+  const size_t PACER_BUCKET_SIZE = 4 * ( Packet::HEADER_SIZE + Packet::MAXIMUM_PAYLOAD );
+
   /* maximum number of frames to be skipped in a row */
   const size_t MAX_SKIPPED = 3;
   size_t skipped_count = 0;
@@ -295,9 +597,28 @@ int main( int argc, char *argv[] )
   /* latest raster that is received from the input */
   Optional<RasterHandle> last_raster;
 
+  /* the encoding jobs run on long-lived workers: enough for the most options
+     S2 mode will try at once, given the CPUs we may use, or a single one that
+     runs the options back to back */
+  const unsigned int encode_workers = ( operation_mode == OperationMode::S2 )
+    ? max( 1u, min( static_cast<unsigned int>( WorkerPool<EncodeJob, EncodeOutput>::allowed_cpus().size() ),
+                    CandidatePlanner::MAX_CANDIDATES ) )
+    : 1u;
+
+  WorkerPool<EncodeJob, EncodeOutput> encode_pool { encode_workers, do_encode_job,
+                                                    true, ENCODE_QUEUE_SIZE };
+
+  /* how many options to encode in S2 mode, and at which quantizers */
+  CandidatePlanner candidate_planner { encode_workers };
+  FECPlanner fec_planner;
+
   /* where we keep the outputs of parallel encoding jobs */
-  vector<EncodeJob> encode_jobs;
-  vector<future<EncodeOutput>> encode_outputs;
+  vector<Optional<EncodeOutput>> encode_outputs;
+  size_t outstanding_jobs = 0;
+
+  /* jobs submitted and not popped yet, including abandoned ones */
+  size_t jobs_in_pool = 0;
+  steady_clock::time_point encode_submitted = steady_clock::now();
 
   /* keep the moving average of encoding times */
   AverageEncodingTime avg_encoding_time;
@@ -305,14 +626,13 @@ int main( int argc, char *argv[] )
   /* track the last quantizer used */
   uint8_t last_quantizer = 64;
 
-  /* decoder hash => encoder object */
+  /* the encoder states, in the order they were sent */
   deque<uint32_t> encoder_states;
-  unordered_map<uint32_t, Encoder> encoders { { initial_state, base_encoder } };
 
   /* latest state of the receiver, based on ack packets */
   Optional<uint32_t> receiver_last_acked_state;
   Optional<uint32_t> receiver_assumed_state;
-  deque<uint32_t> receiver_complete_states;
+  vector<uint32_t> receiver_complete_states;
 
   /* if the receiver goes into an invalid state, for this amount of seconds,
      we will go into a conservative mode: we only encode based on a known state */
@@ -329,35 +649,102 @@ int main( int argc, char *argv[] )
   /* :D */
   system_clock::time_point last_sent = system_clock::now();
 
-  /* comment */
-  auto encode_start_pipe = UnixDomainSocket::make_pair();
-  auto encode_end_pipe = UnixDomainSocket::make_pair();
+  /* signalled when the camera has a new frame, or the encoder has become free */
+  EventFD encode_start;
 
-  /* mem usage timer */
-  system_clock::time_point next_mem_usage_report = system_clock::now();
+  /* the camera is read, and its frames converted, on a separate thread;
+     only the newest frame is kept for the encoder to pick up */
+  CapturedFrame captured;
+  atomic<bool> capturing { true };
 
-  Poller poller;
+  thread capture_thread( [&]()
+    {
+      try {
+        while ( capturing ) {
+          Optional<RasterHandle> raster = camera.get_next_frame();
+          const bool got_frame = raster.initialized();
 
-  /* fetch frames from webcam */
-  poller.add_action( Poller::Action( encode_start_pipe.second, Direction::In,
-    [&]() -> Result {
-      encode_start_pipe.second.read();
+          {
+            unique_lock<mutex> lock { captured.mutex };
 
-      last_raster = camera.get_next_frame();
+            if ( got_frame ) {
+              captured.raster = move( raster );
+            }
+            else {
+              captured.failed = true;
+            }
+          }
 
-      if ( not last_raster.initialized() ) {
-        return { ResultType::Exit, EXIT_FAILURE };
-      }
+          encode_start.signal();
 
-      if ( encode_jobs.size() > 0 ) {
-        /* a frame is being encoded now */
-        return ResultType::Continue;
+          if ( not got_frame ) {
+            break;
+          }
+        }
+      }
+      catch ( ... ) {
+        unique_lock<mutex> lock { captured.mutex };
+        captured.error = current_exception();
+        encode_start.signal();
       }
+    } );
+
+  auto stop_capture = finally(
+    [&]()
+    {
+      capturing = false;
+      capture_thread.join();
+    }
+  );
+
+  /* the next frame to encode, once the encoder is free */
+  Optional<RasterHandle> next_raster;
+
+  /* the frame being encoded now, and the state it is encoded against */
+  Optional<RasterHandle> encoding_raster;
+  uint32_t encoding_source_hash = initial_state;
+
+  /* every start of an encode gets a new batch number; jobs from an abandoned
+     batch skip their work if they haven't started, and their outputs are dropped */
+  uint64_t encode_batch = 0;
+  shared_ptr<atomic<bool>> encode_cancelled;
+
+  /* decoder hash => encoder object. the states the receiver has or is
+     assumed to have, the newest one it has kept, and the one being encoded
+     against now are never evicted. each distinct raster is accounted for
+     along with the safe copy of it the encoder keeps. */
+  const Decoder base_decoder = base_encoder.export_decoder();
+  const VP8Raster & example_raster = base_decoder.example_raster();
+  const size_t raster_bytes =
+    size_t( example_raster.width() ) * example_raster.height() * 3 / 2
+    + size_t( example_raster.width() + 2 * SafeRaster::MARGIN_WIDTH )
+      * ( example_raster.height() + 2 * SafeRaster::MARGIN_WIDTH );
+
+  StateCache<Encoder> encoders { state_cache_budget, raster_bytes, sizeof( DecoderState ),
+    [&]( const uint32_t state )
+    {
+      return state == initial_state or state == encoding_source_hash
+        or ( receiver_last_acked_state.initialized() and state == receiver_last_acked_state.get() )
+        or ( receiver_assumed_state.initialized() and state == receiver_assumed_state.get() )
+        or ( not receiver_complete_states.empty() and state == receiver_complete_states.back() );
+    } };
+
+  {
+    Encoder initial_encoder = base_encoder;
+    encoders.insert( initial_state, move( initial_encoder ), base_decoder.get_references() );
+  }
+
+  /* mem usage timer */
+  system_clock::time_point next_mem_usage_report = system_clock::now();
 
-      /* let's cleanup the stored encoders based on the lastest ack */
+  Poller poller { Poller::Backend::Epoll };
+
+  /* let's cleanup the stored encoders based on the lastest ack */
+  auto cleanup_encoders = [&]()
+    {
       if ( receiver_last_acked_state.initialized() and
            receiver_last_acked_state.get() != initial_state and
-           encoders.count( receiver_last_acked_state.get() ) ) {
+           encoders.contains( receiver_last_acked_state.get() ) ) {
         // cleaning up
         auto it = encoder_states.begin();
 
@@ -378,27 +765,33 @@ int main( int argc, char *argv[] )
         encoder_states.erase( encoder_states.begin(), it );
       }
 
-      RasterHandle raster = last_raster.get();
+    };
 
-      uint32_t selected_source_hash = initial_state;
+  /* the newest state the receiver has kept that we have kept too; the
+     receiver always has the initial state */
+  auto newest_complete_state = [&]() -> uint32_t
+    {
+      for ( auto it = receiver_complete_states.rbegin(); it != receiver_complete_states.rend(); it++ ) {
+        if ( encoders.contains( *it ) ) {
+          return *it;
+        }
+      }
 
-      /* reason about the state of the receiver based on ack messages
-       * this is the logic that decides which encoder to use. for example,
-       * if the packet loss is huge, we can always select an encoder with a sure
-       * state. */
+      return initial_state;
+    };
+
+  /* reason about the state of the receiver based on ack messages
+   * this is the logic that decides which encoder to use. for example,
+   * if the packet loss is huge, we can always select an encoder with a sure
+   * state. */
+  auto select_source_hash = [&]() -> uint32_t
+    {
+      uint32_t selected_source_hash = initial_state;
 
       /* if we're in 'conservative' mode, let's just encode based on something
          we're sure that is available in the receiver */
       if ( system_clock::now() < conservative_until ) {
-        if( receiver_complete_states.size() == 0 ) {
-          /* and the receiver doesn't have any other states, other than the
-             default state */
-          selected_source_hash = initial_state;
-        }
-        else {
-          /* the receiver has at least one stored state, let's use it */
-          selected_source_hash = receiver_complete_states.back();
-        }
+        selected_source_hash = newest_complete_state();
       }
       else if ( not receiver_last_acked_state.initialized() ) {
         /* okay, we're not in 'conservative' mode */
@@ -412,7 +805,7 @@ int main( int argc, char *argv[] )
         }
       }
       else {
-        if ( encoders.count( receiver_last_acked_state.get() ) == 0 ) {
+        if ( not encoders.contains( receiver_last_acked_state.get() ) ) {
           /* it seems that the receiver is in an invalid state */
 
           /* step 1: let's go into 'conservative' mode; just encode based on a
@@ -423,15 +816,7 @@ int main( int argc, char *argv[] )
           cerr << "Going into 'conservative' mode for next "
                << conservative_for.count() << " seconds." << endl;
 
-          if( receiver_complete_states.size() == 0 ) {
-            /* and the receiver doesn't have any other states, other than the
-               default state */
-            selected_source_hash = initial_state;
-          }
-          else {
-            /* the receiver has at least one stored state, let's use it */
-            selected_source_hash = receiver_complete_states.back();
-          }
+          selected_source_hash = newest_complete_state();
         }
         else {
           /* we assume that the receiver is in a right state */
@@ -439,7 +824,26 @@ int main( int argc, char *argv[] )
         }
       }
       /* end of encoder selection logic */
-      const Encoder & encoder = encoders.at( selected_source_hash );
+      return selected_source_hash;
+    };
+
+  /* encode the options for a frame against the given state, abandoning
+     whatever is still running for an earlier start */
+  auto start_encode = [&]( const RasterHandle raster, const uint32_t source_hash )
+    {
+      if ( encode_cancelled ) {
+        encode_cancelled->store( true );
+      }
+
+      encode_cancelled = make_shared<atomic<bool>>( false );
+      encode_batch++;
+
+      encoding_raster.reset( raster );
+      encoding_source_hash = source_hash;
+
+      const Encoder & encoder = encoders.at( source_hash );
+
+      vector<EncodeJob> encode_jobs;
 
       const static auto increment_quantizer = []( const uint16_t q, const int8_t inc ) -> uint8_t
         {
@@ -487,7 +891,7 @@ int main( int argc, char *argv[] )
         encode_jobs.emplace_back( "frame", raster, encoder, CONSTANT_QUANTIZER,
                                   cc_quantizer, 0  );
       }
-      else {
+      else if ( operation_mode == OperationMode::S1 ) {
         /* try various quantizers */
         encode_jobs.emplace_back( "improve", raster, encoder, CONSTANT_QUANTIZER,
                                   increment_quantizer( last_quantizer, -17 ), 0 );
@@ -495,72 +899,201 @@ int main( int argc, char *argv[] )
         encode_jobs.emplace_back( "fail-small", raster, encoder, CONSTANT_QUANTIZER,
                                   increment_quantizer( last_quantizer, +23 ), 0 );
       }
+      else {
+        /* try as many quantizers as there is time for; the last one is
+           always the coarsest */
+        const vector<uint8_t> quantizers = candidate_planner.quantizers( last_quantizer );
+
+        for ( size_t i = 0; i < quantizers.size(); i++ ) {
+          const string name = ( quantizers.size() == 1 ) ? "steady"
+                            : ( i == 0 ) ? "improve"
+                            : ( i + 1 == quantizers.size() ) ? "fail-small"
+                            : "option-" + to_string( i );
+
+          encode_jobs.emplace_back( name, raster, encoder, CONSTANT_QUANTIZER,
+                                    quantizers[ i ], 0 );
+        }
+      }
 
-      // this thread will spawn all the encoding jobs and will wait on the results
-      thread(
-        [&encode_jobs, &encode_outputs, &encode_end_pipe, operation_mode]()
-        {
-          encode_outputs.clear();
-          encode_outputs.reserve( encode_jobs.size() );
+      /* all the options start from the same encoder and raster, so they
+         can share one motion search */
+      if ( encode_jobs.size() > 1 ) {
+        auto analysis = make_shared<SharedAnalysis>( last_quantizer );
 
-          for ( auto & job : encode_jobs ) {
-            encode_outputs.push_back(
-              async( ( ( operation_mode == OperationMode::S2 ) ? launch::async : launch::deferred ),
-                     do_encode_job, move( job ) ) );
-          }
+        for ( auto & job : encode_jobs ) {
+          job.analysis = analysis;
+        }
+      }
 
-          for ( auto & future_res : encode_outputs ) {
-            future_res.wait();
-          }
+      encode_outputs.clear();
+      encode_outputs.resize( encode_jobs.size() );
+      encode_submitted = steady_clock::now();
+
+      outstanding_jobs = 0;
+
+      for ( size_t i = 0; i < encode_jobs.size(); i++ ) {
+        encode_jobs[ i ].index = i;
+        encode_jobs[ i ].batch = encode_batch;
+        encode_jobs[ i ].cancelled = encode_cancelled;
+        encode_pool.submit( move( encode_jobs[ i ] ) );
+        outstanding_jobs++;
+        jobs_in_pool++;
+      }
+
+    };
+
+  /* a new frame from the camera, or the encoder is free again */
+  poller.add_action( Poller::Action( encode_start, Direction::In,
+    [&]() -> Result {
+      encode_start.wait();
 
-          encode_end_pipe.first.write( "1" );
+      {
+        unique_lock<mutex> lock { captured.mutex };
+
+        if ( captured.error ) {
+          rethrow_exception( captured.error );
+        }
+
+        if ( captured.failed ) {
+          return { ResultType::Exit, EXIT_FAILURE };
+        }
+
+        if ( captured.raster.initialized() ) {
+          next_raster = move( captured.raster );
+          captured.raster.clear();
         }
-      ).detach();
+      }
+
+      if ( outstanding_jobs > 0 or not next_raster.initialized() ) {
+        /* a frame is being encoded now, or there's nothing new to encode */
+        return ResultType::Continue;
+      }
+
+      cleanup_encoders();
+
+      const RasterHandle raster = next_raster.get();
+      next_raster.clear();
+
+      start_encode( raster, select_source_hash() );
 
       return ResultType::Continue;
     } )
   );
 
   /* all encode jobs have finished */
-  poller.add_action( Poller::Action( encode_end_pipe.second, Direction::In,
+  poller.add_action( Poller::Action( encode_pool.completions_fd(), Direction::In,
     [&]()
     {
-      /* whatever happens, encode_jobs will be empty after this block is done. */
+      encode_pool.acknowledge();
+
+      for ( auto completion = encode_pool.pop(); completion.initialized();
+            completion = encode_pool.pop() ) {
+        jobs_in_pool--;
+
+        if ( completion.get().error ) {
+          rethrow_exception( completion.get().error );
+        }
+
+        EncodeOutput & output = completion.get().result.get();
+
+        if ( output.batch != encode_batch ) {
+          /* left over from an abandoned encode, including any error it hit
+             (it was most likely cancelled) */
+          continue;
+        }
+
+        if ( output.error ) {
+          rethrow_exception( output.error );
+        }
+
+        encode_outputs.at( output.job_index ).initialize( move( output ) );
+        outstanding_jobs--;
+      }
+
+      /* what is the current capacity of the network? */
+      size_t frame_size = numeric_limits<size_t>::max();
+
+      if ( avg_delay != numeric_limits<uint32_t>::max() ) {
+        frame_size = target_size( avg_delay, last_acked, cumulative_fpf.back() );
+
+        /* leave room for the parity */
+        if ( fec ) {
+          frame_size = static_cast<size_t>( frame_size / ( 1 + fec_planner.overhead() ) );
+        }
+      }
+
+      if ( outstanding_jobs > 0 ) {
+        /* the options go from the finest quantizer to the coarsest, and a
+           coarser one comes out smaller, so the best option is the finest
+           one that fits. once an option fits and all the finer ones are in,
+           none of those still running can do better: send the frame now,
+           abandon the rest, and get on with the next frame. */
+        bool decided = false;
+
+        for ( const auto & output : encode_outputs ) {
+          if ( not output.initialized() ) {
+            break;
+          }
+
+          if ( output.get().frame->size() <= frame_size ) {
+            decided = true;
+            break;
+          }
+        }
+
+        if ( not decided ) {
+          return ResultType::Continue;
+        }
+
+        encode_cancelled->store( true );
+        encode_batch++;
+        outstanding_jobs = 0;
+      }
+
+      /* whatever happens, the next frame is encoded after this block is done. */
       auto _ = finally(
         [&]()
         {
-          encode_jobs.clear();
-          encode_start_pipe.first.write( "1" );
+          encoding_raster.clear();
+          encode_start.signal();
         }
       );
 
-      encode_end_pipe.second.read();
-
       avg_encoding_time.add( duration_cast<microseconds>( system_clock::now().time_since_epoch() ) );
 
+      if ( operation_mode == OperationMode::S2 ) {
+        microseconds option_time { 0 };
+        size_t option_count = 0;
+
+        for ( const auto & output : encode_outputs ) {
+          if ( output.initialized() ) {
+            option_time += output.get().encode_time;
+            option_count++;
+          }
+        }
+
+        if ( option_count > 0 ) {
+          candidate_planner.add_frame_time(
+            duration_cast<microseconds>( steady_clock::now() - encode_submitted ),
+            option_time / option_count );
+        }
+      }
+
       if ( not any_of( encode_outputs.cbegin(), encode_outputs.cend(),
-                       [&]( const future<EncodeOutput> & o ) { return o.valid(); } ) ) {
+                       [&]( const Optional<EncodeOutput> & o ) { return o.initialized(); } ) ) {
         cerr << "All encoding jobs got killed for frame " << frame_no << "\n";
         // no encoding job has ended in time
         return ResultType::Continue;
       }
 
-      /* what is the current capacity of the network,
-         now that the encoding is done? */
-      size_t frame_size = numeric_limits<size_t>::max();
-
-      if ( avg_delay != numeric_limits<uint32_t>::max() ) {
-        frame_size = target_size( avg_delay, last_acked, cumulative_fpf.back() );
-      }
-
       size_t best_output_index = numeric_limits<size_t>::max();
       size_t best_size_diff = numeric_limits<size_t>::max();
 
       vector<EncodeOutput> good_outputs;
 
-      for ( auto & out_future : encode_outputs ) {
-        if ( out_future.valid() ) {
-          good_outputs.push_back( move( out_future.get() ) );
+      for ( auto & output : encode_outputs ) {
+        if ( output.initialized() ) {
+          good_outputs.push_back( move( output.get() ) );
         }
       }
 
@@ -570,16 +1103,19 @@ int main( int argc, char *argv[] )
       else {
         /* choose the best based on the current capacity */
         for ( size_t i = 0; i < good_outputs.size(); i++ ) {
-          if ( good_outputs[ i ].frame.size() <= frame_size ) {
-            if ( frame_size - good_outputs[ i ].frame.size() < best_size_diff ) {
-              best_size_diff = frame_size - good_outputs[ i ].frame.size();
+          if ( good_outputs[ i ].frame->size() <= frame_size ) {
+            if ( frame_size - good_outputs[ i ].frame->size() < best_size_diff ) {
+              best_size_diff = frame_size - good_outputs[ i ].frame->size();
               best_output_index = i;
             }
           }
         }
 
         if ( best_output_index == numeric_limits<size_t>::max() ) {
-          if ( skipped_count < MAX_SKIPPED or good_outputs.back().job_name != "fail-small" ) {
+          /* only the coarsest option may be forced through */
+          const bool have_coarsest = good_outputs.back().job_index + 1 == encode_outputs.size();
+
+          if ( skipped_count < MAX_SKIPPED or not have_coarsest ) {
             /* skip frame */
             cerr << "["
                  << duration_cast<milliseconds>( system_clock::now().time_since_epoch() ).count()
@@ -590,7 +1126,7 @@ int main( int argc, char *argv[] )
           } else {
             cerr << "Too many skipped frames; sending the bad-quality option on " << frame_no << "\n";
             best_output_index = good_outputs.size() - 1;
-            assert( good_outputs[ best_output_index ].job_name == "fail-small" );
+            assert( good_outputs[ best_output_index ].job_index + 1 == encode_outputs.size() );
           }
         }
       }
@@ -600,22 +1136,27 @@ int main( int argc, char *argv[] )
       uint32_t target_minihash = output.encoder.minihash();
 
       /*
-      cerr << "Sending frame #" << frame_no << " (size=" << output.frame.size() << " bytes, "
+      cerr << "Sending frame #" << frame_no << " (size=" << output.frame->size() << " bytes, "
            << "source_hash=" << output.source_minihash << ", target_hash="
            << target_minihash << ")...";
       */
 
       last_quantizer = output.y_ac_qi;
 
+      const size_t fragments = ( output.frame->size() + Packet::MAXIMUM_PAYLOAD - 1 )
+                               / Packet::MAXIMUM_PAYLOAD;
+
       FragmentedFrame ff { connection_id, output.source_minihash, target_minihash,
                            frame_no,
                            static_cast<uint32_t>( duration_cast<microseconds>( system_clock::now() - last_sent ).count() ),
-                           output.frame };
+                           output.frame,
+                           fec ? fec_planner.parity_count( fragments ) : uint16_t( 0 ) };
       /* enqueue the packets to be sent */
-      /* send 5x faster than packets are being received */
+      /* send 5x faster than packets are being received (unless the
+         token bucket sets the pace) */
       const unsigned int inter_send_delay = min( 2000u, max( 500u, avg_delay / 5 ) );
       for ( const auto & packet : ff.packets() ) {
-        pacer.push( packet.to_string(), inter_send_delay );
+        pacer.push( packet, inter_send_delay );
       }
 
       last_sent = system_clock::now();
@@ -632,20 +1173,24 @@ int main( int argc, char *argv[] )
            << " intersend_delay = " << inter_send_delay << " us"; */
 
       if ( log_mem_usage and next_mem_usage_report < last_sent ) {
-        cerr << " <mem = " << procinfo::memory_usage() << ">";
+        cerr << " <mem = " << procinfo::memory_usage() << ">"
+             << " <states: " << encoders.stats() << ">"
+             << " <loss = " << fixed << setprecision( 2 ) << 100 * fec_planner.loss_rate() << "%>";
         next_mem_usage_report = last_sent + 5s;
       }
 
       // cerr << "\n";
 
+      /* every packet sent (and acked), parity included */
       cumulative_fpf.push_back( ( frame_no > 0 )
-                                ? ( cumulative_fpf[ frame_no - 1 ] + ff.fragments_in_this_frame() )
-                                : ff.fragments_in_this_frame() );
+                                ? ( cumulative_fpf[ frame_no - 1 ] + ff.packets().size() )
+                                : ff.packets().size() );
 
       /* now we assume that the receiver will successfully get this */
       receiver_assumed_state.reset( target_minihash );
 
-      encoders.insert( make_pair( target_minihash, move( output.encoder ) ) );
+      const References references = output.encoder.export_decoder().get_references();
+      encoders.insert( target_minihash, move( output.encoder ), references );
       encoder_states.push_back( target_minihash );
 
       skipped_count = 0;
@@ -659,51 +1204,87 @@ int main( int argc, char *argv[] )
   poller.add_action( Poller::Action( socket, Direction::In,
     [&]()
     {
-      auto packet = socket.recv();
-      AckPacket ack( packet.payload );
+      /* take all the acks that have arrived */
+      for ( auto & packet : socket.recv_batch() ) {
+        AckPacket ack( packet.payload );
 
-      if ( ack.connection_id() != connection_id ) {
-        /* this is not an ack for this session! */
-        return ResultType::Continue;
-      }
+        if ( ack.connection_id() != connection_id ) {
+          /* this is not an ack for this session! */
+          continue;
+        }
 
-      uint64_t this_ack_seq = ack_seq_no( ack, cumulative_fpf );
+        uint64_t this_ack_seq = ack_seq_no( ack, cumulative_fpf );
 
-      if ( last_acked != numeric_limits<uint64_t>::max() and
-           this_ack_seq < last_acked ) {
-        /* we have already received an ACK newer than this */
-        return ResultType::Continue;
-      }
+        if ( last_acked != numeric_limits<uint64_t>::max() and
+             this_ack_seq < last_acked ) {
+          /* we have already received an ACK newer than this */
+          continue;
+        }
+
+        if ( last_acked == numeric_limits<uint64_t>::max() ) {
+          fec_planner.add_ack( 0 );
+        }
+        else if ( this_ack_seq > last_acked ) {
+          fec_planner.add_ack( this_ack_seq - last_acked - 1 );
+        }
 
-      last_acked = this_ack_seq;
-      avg_delay = ack.avg_delay();
-      receiver_last_acked_state.reset( ack.current_state() );
-      receiver_complete_states = move( ack.complete_states() );
+        const bool receiver_state_changed = not receiver_last_acked_state.initialized()
+                                            or receiver_last_acked_state.get() != ack.current_state();
+
+        last_acked = this_ack_seq;
+        avg_delay = ack.avg_delay();
+
+        /* one full packet per inter-packet delay at the receiver */
+        if ( token_bucket and avg_delay > 0 and avg_delay != numeric_limits<uint32_t>::max() ) {
+          pacer.set_rate( 1e6 * ( Packet::HEADER_SIZE + Packet::MAXIMUM_PAYLOAD ) / avg_delay,
+                          PACER_BUCKET_SIZE );
+        }
+        candidate_planner.add_delay_sample( avg_delay );
+        receiver_last_acked_state.reset( ack.current_state() );
+        receiver_complete_states.assign( ack.complete_states_begin(), ack.complete_states_end() );
+
+        /* the frame being encoded was started against what we predicted the
+           receiver would have; if we'd pick another state now, start over */
+        if ( receiver_state_changed and outstanding_jobs > 0 ) {
+          const uint32_t source_hash = select_source_hash();
+
+          /* the abandoned jobs stop at their next macroblock row, but they
+             still hold the queue until then; don't let restarts pile up */
+          if ( source_hash != encoding_source_hash
+               and jobs_in_pool + CandidatePlanner::MAX_CANDIDATES <= ENCODE_QUEUE_SIZE ) {
+            start_encode( encoding_raster.get(), source_hash );
+          }
+        }
+      }
 
       return ResultType::Continue;
     } )
   );
 
-  /* outgoing packet ready to leave the pacer */
-  poller.add_action( Poller::Action( socket, Direction::Out, [&]() {
-        assert( pacer.ms_until_due() == 0 );
+  /* reused for every burst, so that sending doesn't allocate */
+  vector<Packet> burst;
+  UDPSocket::DatagramBatch outgoing;
 
-        while ( pacer.ms_until_due() == 0 ) {
-          assert( not pacer.empty() );
+  /* outgoing packets are due to leave the pacer */
+  poller.add_action( Poller::Action( pacer.fd(), Direction::In, [&]() {
+        pacer.acknowledge();
+        pacer.pop_due( burst );
 
-          socket.send( pacer.front() );
-          pacer.pop();
+        if ( not burst.empty() ) {
+          outgoing.clear();
+          for ( const Packet & packet : burst ) {
+            packet.add_to( outgoing );
+          }
+
+          socket.send_batch( outgoing );
         }
 
         return ResultType::Continue;
-      }, [&]() { return pacer.ms_until_due() == 0; } ) );
-
-  /* kick off the first encode */
-  encode_start_pipe.first.write( "1" );
+      } ) );
 
   /* handle events */
   while ( true ) {
-    const auto poll_result = poller.poll( pacer.ms_until_due() );
+    const auto poll_result = poller.poll( -1 );
     if ( poll_result.result == Poller::Result::Type::Exit ) {
       if ( poll_result.exit_status ) {
         cerr << "Connection error." << endl;
@@ -0,0 +1,227 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef STATE_CACHE_HH
+#define STATE_CACHE_HH
+
+#include <list>
+#include <vector>
+#include <array>
+#include <ostream>
+#include <functional>
+#include <unordered_map>
+#include <stdexcept>
+
+#include "decoder.hh"
+
+struct StateCacheStats
+{
+  uint64_t hits { 0 };
+  uint64_t misses { 0 };
+  uint64_t insertions { 0 };
+  uint64_t evictions { 0 };
+
+  size_t states { 0 };
+  size_t bytes { 0 };
+};
+
+inline std::ostream & operator<<( std::ostream & out, const StateCacheStats & stats )
+{
+  return out << stats.states << " states, " << ( stats.bytes >> 20 ) << " MiB, "
+             << stats.hits << " hits, " << stats.misses << " misses, "
+             << stats.evictions << " evictions";
+}
+
+/* Decoder (or Encoder) states by minihash, kept within a memory budget.
+
+   Most of a state is its three reference rasters, and consecutive states
+   mostly share them, so the rasters are accounted for per raster object: a
+   raster that several states hold a handle to is only counted once, and is
+   only taken off the books when the last of those states goes. Rasters that
+   merely have the same contents are separate allocations, and are counted
+   separately.
+
+   Inserting a state that takes the cache over budget evicts the least
+   recently used states, other than the pinned ones (the states the other
+   end might still refer to). The evicted minihashes are handed back to the
+   caller, which mustn't advertise them in acks anymore (the receiver) or
+   choose them as a source (the sender). */
+template <class State>
+class StateCache
+{
+private:
+  struct Entry
+  {
+    State state;
+    /* keeps the rasters counted below alive, so their addresses can't be
+       reused while this entry is around */
+    References references;
+    std::list<uint32_t>::iterator lru_position;
+  };
+
+  size_t budget_;
+
+  /* what one distinct reference raster takes up, and everything else */
+  size_t raster_bytes_;
+  size_t state_bytes_;
+
+  std::function<bool( uint32_t )> pinned_;
+
+  std::unordered_map<uint32_t, Entry> entries_ {};
+  std::list<uint32_t> lru_ {}; /* most recently used first */
+
+  /* raster => number of references to it from the states here */
+  std::unordered_map<const HashCachedRaster *, size_t> raster_refs_ {};
+
+  StateCacheStats stats_ {};
+  std::vector<uint32_t> evicted_ {};
+
+  void touch( Entry & entry )
+  {
+    lru_.splice( lru_.begin(), lru_, entry.lru_position );
+  }
+
+  static std::array<const HashCachedRaster *, 3> rasters( const References & references )
+  {
+    return { { &references.last.get(), &references.golden.get(),
+               &references.alternative.get() } };
+  }
+
+  void release( typename std::unordered_map<uint32_t, Entry>::iterator it )
+  {
+    for ( const HashCachedRaster * raster : rasters( it->second.references ) ) {
+      auto ref = raster_refs_.find( raster );
+
+      if ( ref != raster_refs_.end() and --ref->second == 0 ) {
+        raster_refs_.erase( ref );
+        stats_.bytes -= raster_bytes_;
+      }
+    }
+
+    stats_.bytes -= state_bytes_;
+    lru_.erase( it->second.lru_position );
+    entries_.erase( it );
+    stats_.states = entries_.size();
+  }
+
+public:
+  StateCache( const size_t budget, const size_t raster_bytes, const size_t state_bytes,
+              const std::function<bool( uint32_t )> & pinned = [] ( uint32_t ) { return false; } )
+    : budget_( budget ), raster_bytes_( raster_bytes ), state_bytes_( state_bytes ),
+      pinned_( pinned )
+  {}
+
+  bool contains( const uint32_t id ) const { return entries_.count( id ) > 0; }
+
+  /* returns nullptr if the state isn't here */
+  State * find( const uint32_t id )
+  {
+    auto it = entries_.find( id );
+
+    if ( it == entries_.end() ) {
+      stats_.misses++;
+      return nullptr;
+    }
+
+    stats_.hits++;
+    touch( it->second );
+    return &it->second.state;
+  }
+
+  State & at( const uint32_t id )
+  {
+    State * state = find( id );
+
+    if ( state == nullptr ) {
+      throw std::out_of_range( "StateCache: no such state" );
+    }
+
+    return *state;
+  }
+
+  /* returns the states evicted to make room (valid until the next insert) */
+  const std::vector<uint32_t> & insert( const uint32_t id, State && state,
+                                        const References & references )
+  {
+    evicted_.clear();
+
+    auto found = entries_.find( id );
+    if ( found != entries_.end() ) {
+      touch( found->second );
+      return evicted_;
+    }
+
+    lru_.push_front( id );
+    entries_.emplace( id, Entry { std::move( state ), references, lru_.begin() } );
+
+    for ( const HashCachedRaster * raster : rasters( references ) ) {
+      if ( raster_refs_[ raster ]++ == 0 ) {
+        stats_.bytes += raster_bytes_;
+      }
+    }
+
+    stats_.bytes += state_bytes_;
+    stats_.insertions++;
+    stats_.states = entries_.size();
+
+    /* evict from the least recently used end, never the new state */
+    auto candidate = lru_.end();
+    while ( stats_.bytes > budget_ and candidate != lru_.begin() ) {
+      --candidate;
+
+      if ( *candidate == id or pinned_( *candidate ) ) {
+        continue;
+      }
+
+      const uint32_t victim = *candidate;
+      candidate++;
+      release( entries_.find( victim ) );
+      evicted_.push_back( victim );
+      stats_.evictions++;
+    }
+
+    return evicted_;
+  }
+
+  void erase( const uint32_t id )
+  {
+    auto it = entries_.find( id );
+
+    if ( it != entries_.end() ) {
+      release( it );
+    }
+  }
+
+  const StateCacheStats & stats() const { return stats_; }
+
+  /* disallow copying */
+  StateCache( const StateCache & other ) = delete;
+  StateCache & operator=( const StateCache & other ) = delete;
+};
+
+#endif /* STATE_CACHE_HH */
@@ -0,0 +1,189 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks BoundedQueue at its limits on one thread (full, empty, and many
+   laps around the ring), then with producers and consumers on separate
+   threads: every value comes out exactly once, and one producer's values
+   come out in the order it pushed them */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bounded_queue.hh"
+#include "exception.hh"
+#include "expect.hh"
+
+using namespace std;
+
+static bool test_single_thread()
+{
+  BoundedQueue<unsigned int> queue { 4 };
+
+  if ( not expect( not queue.pop().initialized(), "a new queue is empty" ) ) {
+    return false;
+  }
+
+  unsigned int next_in = 0, next_out = 0;
+
+  /* fill it, drain it, and repeat, starting at every offset of the ring */
+  for ( unsigned int lap = 0; lap < 100; lap++ ) {
+    for ( unsigned int i = 0; i < queue.capacity(); i++ ) {
+      if ( not expect( queue.push( next_in++ ), "push into a queue with room" ) ) {
+        return false;
+      }
+    }
+
+    unsigned int rejected = next_in;
+    if ( not expect( not queue.push( move( rejected ) ), "push into a full queue fails" ) ) {
+      return false;
+    }
+
+    /* take out a varying number, so the ends wrap at different places */
+    const unsigned int taken = 1 + lap % queue.capacity();
+    for ( unsigned int i = 0; i < taken; i++ ) {
+      Optional<unsigned int> value = queue.pop();
+      if ( not expect( value.initialized() and value.get() == next_out++,
+                       "values come out in order" ) ) {
+        return false;
+      }
+    }
+
+    while ( next_out < next_in ) {
+      Optional<unsigned int> value = queue.pop();
+      if ( not expect( value.initialized() and value.get() == next_out++,
+                       "values come out in order" ) ) {
+        return false;
+      }
+    }
+
+    if ( not expect( not queue.pop().initialized(), "a drained queue is empty" ) ) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* producers push (producer, sequence) pairs as fast as the small queue
+   lets them, so it's full and empty over and over */
+static bool test_threads( const unsigned int producers, const unsigned int consumers )
+{
+  const unsigned int COUNT = 200000;
+
+  BoundedQueue<pair<unsigned int, unsigned int>> queue { 8 };
+  vector<vector<unsigned int>> received( consumers );
+  vector<thread> threads;
+
+  for ( unsigned int p = 0; p < producers; p++ ) {
+    threads.emplace_back( [&queue, p, COUNT]()
+      {
+        for ( unsigned int i = 0; i < COUNT; i++ ) {
+          while ( not queue.push( make_pair( p, i ) ) ) {
+            this_thread::yield();
+          }
+        }
+      } );
+  }
+
+  atomic<bool> in_order { true };
+  atomic<unsigned int> popped { 0 };
+
+  for ( unsigned int c = 0; c < consumers; c++ ) {
+    threads.emplace_back( [&, c]()
+      {
+        vector<unsigned int> last_seen( producers, 0 );
+        vector<bool> seen_any( producers, false );
+
+        while ( popped.load() < producers * COUNT ) {
+          Optional<pair<unsigned int, unsigned int>> value = queue.pop();
+          if ( not value.initialized() ) {
+            this_thread::yield();
+            continue;
+          }
+
+          popped++;
+
+          const unsigned int p = value.get().first;
+          const unsigned int i = value.get().second;
+
+          /* a consumer sees each producer's values in increasing order */
+          if ( seen_any[ p ] and i <= last_seen[ p ] ) {
+            in_order = false;
+          }
+
+          seen_any[ p ] = true;
+          last_seen[ p ] = i;
+          received[ c ].push_back( p * COUNT + i );
+        }
+      } );
+  }
+
+  for ( thread & t : threads ) {
+    t.join();
+  }
+
+  vector<unsigned int> times_seen( producers * COUNT, 0 );
+  for ( const vector<unsigned int> & values : received ) {
+    for ( const unsigned int value : values ) {
+      times_seen.at( value )++;
+    }
+  }
+
+  bool exactly_once = true;
+  for ( const unsigned int times : times_seen ) {
+    exactly_once = exactly_once and times == 1;
+  }
+
+  return expect( in_order, "a producer's values stay in order" )
+         and expect( exactly_once, "every value comes out exactly once" )
+         and expect( not queue.pop().initialized(), "the queue ends up empty" );
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    if ( not test_single_thread() or not test_threads( 1, 1 ) or not test_threads( 3, 3 ) ) {
+      return EXIT_FAILURE;
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
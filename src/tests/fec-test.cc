@@ -0,0 +1,194 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks that a frame sent with parity packets comes out byte-identical
+   after any burst of up to parity_count consecutive losses, parity packets
+   included, and whatever order the rest arrive in */
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "exception.hh"
+#include "optional.hh"
+#include "packet.hh"
+
+using namespace std;
+
+/* a frame of the given size, split into pieces of random sizes */
+shared_ptr<SerializedFrame> random_frame( default_random_engine & gen, const size_t size,
+                                          string & contents )
+{
+  uniform_int_distribution<int> bytes( 0, 255 );
+  uniform_int_distribution<size_t> piece_sizes( 1, 3000 );
+
+  contents.resize( size );
+  for ( char & c : contents ) {
+    c = bytes( gen );
+  }
+
+  auto frame = make_shared<SerializedFrame>();
+
+  for ( size_t offset = 0; offset < size; ) {
+    const size_t length = min( size - offset, piece_sizes( gen ) );
+    frame->mutable_pieces().emplace_back( contents.begin() + offset,
+                                          contents.begin() + offset + length );
+    offset += length;
+  }
+
+  return frame;
+}
+
+/* sends every packet of `sent` except [first_lost, first_lost + lost_count),
+   in the given order, and reassembles them on the other side */
+bool check_burst( const FragmentedFrame & sent, const string & contents,
+                  const size_t first_lost, const size_t lost_count,
+                  default_random_engine & gen )
+{
+  const vector<Packet> & packets = sent.packets();
+
+  vector<string> wire;
+  for ( size_t i = 0; i < packets.size(); i++ ) {
+    if ( i < first_lost or i >= first_lost + lost_count ) {
+      wire.push_back( packets[ i ].to_string() );
+    }
+  }
+
+  if ( wire.empty() ) {
+    return true;
+  }
+
+  shuffle( wire.begin(), wire.end(), gen );
+
+  Optional<FragmentedFrame> received;
+
+  for ( const string & datagram : wire ) {
+    const Packet packet { Chunk( datagram ) };
+
+    if ( not received.initialized() ) {
+      received.initialize( sent.connection_id(), packet );
+    } else {
+      received.get().add_packet( packet );
+    }
+  }
+
+  if ( not received.get().complete() ) {
+    cerr << "not recovered" << endl;
+    return false;
+  }
+
+  const Chunk frame = received.get().frame();
+
+  if ( frame.size() != contents.size()
+       or memcmp( frame.buffer(), contents.data(), contents.size() ) != 0 ) {
+    cerr << "recovered frame differs from the one sent" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+/* a parity packet claiming more parity packets than the frame has data
+   fragments (which would have the receiver allocate a buffer for all of
+   them) is refused */
+bool check_forged_parity_count( default_random_engine & gen )
+{
+  string contents;
+  const FragmentedFrame sent { 42, 1, 2, 9, 1234,
+                               random_frame( gen, 3 * Packet::MAXIMUM_PAYLOAD, contents ), 2 };
+
+  for ( const uint16_t parity_count : { 0, 4, 65535 } ) {
+    string datagram = sent.packets().back().to_string();
+    datagram[ Packet::HEADER_SIZE ] = parity_count & 0xff;
+    datagram[ Packet::HEADER_SIZE + 1 ] = parity_count >> 8;
+
+    try {
+      const Packet packet { Chunk( datagram ) };
+      cerr << "accepted a parity count of " << parity_count << endl;
+      return false;
+    } catch ( const runtime_error & ) {}
+  }
+
+  return true;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    random_device rd;
+    default_random_engine gen( rd() );
+
+    /* one fragment, exact multiples of the payload size, and a last
+       fragment shorter than the others */
+    const size_t payload = Packet::MAXIMUM_PAYLOAD;
+    const vector<size_t> sizes { 1, payload - 1, payload, payload + 1,
+                                 3 * payload, 7 * payload + 123, 20 * payload + 5 };
+
+    if ( not check_forged_parity_count( gen ) ) {
+      return EXIT_FAILURE;
+    }
+
+    for ( const size_t size : sizes ) {
+      for ( const uint16_t parity_count : { 1, 2, 3, 5, 8 } ) {
+        string contents;
+        const FragmentedFrame sent { 42, 1, 2, 9, 1234,
+                                     random_frame( gen, size, contents ), parity_count };
+
+        if ( sent.packets().size() != sent.fragments_in_this_frame() + sent.parity_count() ) {
+          cerr << "wrong number of packets" << endl;
+          return EXIT_FAILURE;
+        }
+
+        /* every burst position, every burst length up to the parity count
+           actually used, which is capped at the number of fragments */
+        for ( size_t lost_count = 0; lost_count <= sent.parity_count(); lost_count++ ) {
+          for ( size_t first_lost = 0; first_lost + lost_count <= sent.packets().size(); first_lost++ ) {
+            if ( not check_burst( sent, contents, first_lost, lost_count, gen ) ) {
+              cerr << "size " << size << ", " << parity_count << " parity packets, lost "
+                   << lost_count << " from packet " << first_lost << endl;
+              return EXIT_FAILURE;
+            }
+          }
+        }
+      }
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks FileDescriptor's read buffer: getline() with lines that span
+   several refills and a last line without a newline, and read_exact()
+   handing out what getline() read ahead before reading the fd directly --
+   from a regular file (full-sized refills) and from a pipe (refills of
+   whatever a slow writer has written so far) */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exception.hh"
+#include "expect.hh"
+#include "file_descriptor.hh"
+
+using namespace std;
+
+static string pattern( const size_t length, const unsigned int seed )
+{
+  string ret( length, 0 );
+  for ( size_t i = 0; i < length; i++ ) {
+    ret[ i ] = 'a' + ( i * 7 + seed ) % 26;
+  }
+  return ret;
+}
+
+/* what both tests read: a short line, a line longer than two refills of
+   a file, a block of raw bytes (newlines included), and two more lines,
+   the last without a newline */
+struct Contents
+{
+  string long_line { pattern( 2 * BUFFER_SIZE + 12345, 1 ) };
+  string block { pattern( 3 * BUFFER_SIZE / 2, 2 ) + "\n\n" + pattern( 1000, 3 ) };
+
+  string all() const
+  {
+    return "short\n" + long_line + "\n" + block + "next\n" + "no newline";
+  }
+};
+
+static bool check_reads( FileDescriptor & fd, const Contents & contents )
+{
+  if ( not expect( fd.getline() == "short", "a short line" )
+       or not expect( fd.getline() == contents.long_line, "a line spanning refills" ) ) {
+    return false;
+  }
+
+  /* the block is longer than any refill, so some of it is still to be
+     read from the fd */
+  if ( not expect( fd.buffered_bytes() < contents.block.size(), "only part of the block is buffered" )
+       or not expect( fd.read_exactly( contents.block.size() ) == contents.block,
+                      "read_exact() takes the buffered bytes first" )
+       or not expect( fd.buffered_bytes() == 0, "read_exact() uses up the buffer" ) ) {
+    return false;
+  }
+
+  return expect( fd.getline() == "next", "a line after read_exact()" )
+         and expect( fd.getline() == "no newline" and fd.eof(),
+                     "the last line doesn't need a newline" );
+}
+
+static bool test_file( const Contents & contents )
+{
+  char temp_template[] = "/tmp/file-descriptor-test.XXXXXX";
+  FileDescriptor temp_file { SystemCall( "mkstemp", mkstemp( temp_template ) ) };
+  const string filename { temp_template };
+
+  temp_file.write( contents.all() );
+
+  FileDescriptor fd { SystemCall( filename, open( filename.c_str(), O_RDONLY ) ) };
+  unlink( filename.c_str() );
+
+  return check_reads( fd, contents );
+}
+
+static bool test_pipe( const Contents & contents )
+{
+  int pipe_fds[ 2 ];
+  SystemCall( "pipe", pipe( pipe_fds ) );
+  FileDescriptor read_end { pipe_fds[ 0 ] };
+
+  /* written in uneven pieces, so reads stop in the middle of lines */
+  thread writer( [&contents, pipe_fds]()
+    {
+      FileDescriptor write_end { pipe_fds[ 1 ] };
+      const string all = contents.all();
+
+      size_t offset = 0;
+      for ( size_t piece = 1; offset < all.size(); piece = piece * 3 % 100003 ) {
+        const size_t length = min( all.size() - offset, piece );
+        write_end.write( all.substr( offset, length ) );
+        offset += length;
+      }
+    } );
+
+  const bool ok = check_reads( read_end, contents );
+  writer.join();
+  return ok;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    const Contents contents;
+
+    if ( not test_file( contents ) or not test_pipe( contents ) ) {
+      return EXIT_FAILURE;
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks that an IVF index sidecar describes the same frames as scanning
+   the file does, and that rewriting the file removes the old sidecar */
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "ivf.hh"
+#include "ivf_writer.hh"
+
+using namespace std;
+
+/* frames of random sizes and contents; some look like VP8 key frames */
+vector<string> random_frames( default_random_engine & gen, const unsigned int count )
+{
+  uniform_int_distribution<size_t> sizes( 1, 4096 );
+  uniform_int_distribution<int> bytes( 0, 255 );
+
+  vector<string> frames;
+
+  for ( unsigned int i = 0; i < count; i++ ) {
+    string frame( sizes( gen ), 0 );
+    for ( char & c : frame ) {
+      c = bytes( gen );
+    }
+
+    frames.push_back( move( frame ) );
+  }
+
+  return frames;
+}
+
+void write_ivf( const string & filename, const vector<string> & frames, const uint64_t first_pts )
+{
+  IVFWriter writer { filename, "VP80", 640, 480, 30, 1 };
+
+  for ( size_t i = 0; i < frames.size(); i++ ) {
+    writer.append_frame( Chunk( frames[ i ] ), first_pts + 3 * i );
+  }
+}
+
+void write_index( const string & filename, const string & contents )
+{
+  FileDescriptor index_file { SystemCall( filename,
+                                          open( filename.c_str(),
+                                                O_WRONLY | O_CREAT | O_TRUNC,
+                                                S_IRUSR | S_IWUSR ) ) };
+  index_file.write( contents );
+}
+
+bool same_info( const IVF::FrameInfo & a, const IVF::FrameInfo & b )
+{
+  return a.offset == b.offset and a.length == b.length
+         and a.key_frame == b.key_frame and a.pts == b.pts;
+}
+
+/* compares every frame of `indexed` against the scanned file and the
+   frames that were written */
+bool check_frames( const IVF & indexed, const IVF & scanned, const vector<string> & frames )
+{
+  if ( indexed.frame_count() != frames.size() or scanned.frame_count() != frames.size() ) {
+    cerr << "frame count mismatch" << endl;
+    return false;
+  }
+
+  for ( uint32_t i = 0; i < frames.size(); i++ ) {
+    if ( not same_info( indexed.frame_info( i ), scanned.frame_info( i ) ) ) {
+      cerr << "frame " << i << ": index entry differs from the scanned one" << endl;
+      return false;
+    }
+
+    if ( indexed.frame( i ).to_string() != frames[ i ] ) {
+      cerr << "frame " << i << ": contents differ" << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    random_device rd;
+    default_random_engine gen( rd() );
+
+    char temp_template[] = "/tmp/ivf-index-test.XXXXXX";
+    FileDescriptor temp_file { SystemCall( "mkstemp", mkstemp( temp_template ) ) };
+    const string filename { temp_template };
+    const string index_filename = IVF::index_filename( filename );
+
+    auto cleanup = [&]()
+      {
+        unlink( filename.c_str() );
+        unlink( index_filename.c_str() );
+      };
+
+    const vector<string> frames = random_frames( gen, 100 );
+    write_ivf( filename, frames, 1000 );
+
+    /* build_index() */
+    {
+      const IVF scanned { filename, false };
+      write_index( index_filename, scanned.serialize_index() );
+    }
+
+    /* load_index() against build_index() */
+    {
+      const IVF indexed { filename };
+      const IVF scanned { filename, false };
+
+      if ( not check_frames( indexed, scanned, frames ) ) {
+        cleanup();
+        return EXIT_FAILURE;
+      }
+
+      /* and the sidecar is really what got used: a copy with one timestamp
+         changed shows up in frame_info() */
+      string tampered = scanned.serialize_index();
+      const size_t pts_offset = IVF::index_header_len + 5 * IVF::index_entry_len + 16;
+      tampered[ pts_offset ] ^= 1;
+      write_index( index_filename, tampered );
+
+      const IVF tampered_ivf { filename };
+      if ( tampered_ivf.frame_info( 5 ).pts == scanned.frame_info( 5 ).pts ) {
+        cerr << "the index sidecar was not used" << endl;
+        cleanup();
+        return EXIT_FAILURE;
+      }
+    }
+
+    /* rewriting the file with the same frame count and sizes would pass the
+       sidecar's staleness check, so the writer has to remove it */
+    vector<string> new_frames = frames;
+    for ( string & frame : new_frames ) {
+      frame[ 0 ] ^= 1;
+    }
+
+    write_ivf( filename, new_frames, 5000 );
+
+    if ( access( index_filename.c_str(), F_OK ) == 0 ) {
+      cerr << "IVFWriter left a stale index behind" << endl;
+      cleanup();
+      return EXIT_FAILURE;
+    }
+
+    {
+      const IVF indexed { filename };
+      const IVF scanned { filename, false };
+
+      if ( not check_frames( indexed, scanned, new_frames )
+           or indexed.frame_info( 0 ).pts != 5000 ) {
+        cleanup();
+        return EXIT_FAILURE;
+      }
+    }
+
+    cleanup();
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -48,6 +48,6 @@ int main( int argc, char *argv[] )
                       old_file.time_scale() );
   
   for ( unsigned int i = 0; i < old_file.frame_count(); i++ ) {
-    new_file.append_frame( old_file.frame( i ) );
+    new_file.append_frame( old_file.frame( i ), old_file.frame_info( i ).pts );
   }
 }
@@ -0,0 +1,209 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks that the Pacer lets packets out in order and never before their
+   deadlines, both when spaced by per-packet delays and when paced by the
+   token bucket, and that an idle bucket refills up to (but not past) its
+   size */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+
+#include "exception.hh"
+#include "expect.hh"
+#include "pacer.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+typedef Pacer::Clock Clock;
+
+/* a frame's worth of full-sized packets, in order */
+static vector<Packet> make_packets( const size_t count )
+{
+  auto frame = make_shared<SerializedFrame>();
+  frame->mutable_pieces().emplace_back( count * Packet::MAXIMUM_PAYLOAD, 'x' );
+
+  const FragmentedFrame fragmented { 42, 1, 2, 9, 1234, frame };
+  return fragmented.packets();
+}
+
+/* waits for the pacer's timer, then takes what's due */
+static vector<Packet> next_burst( Pacer & pacer )
+{
+  pollfd timer { pacer.fd().fd_num(), POLLIN, 0 };
+  SystemCall( "poll", ::poll( &timer, 1, 1000 ) );
+
+  vector<Packet> burst;
+  pacer.acknowledge();
+  pacer.pop_due( burst );
+  return burst;
+}
+
+/* the time each packet left, by fragment number; false if any left out of
+   order */
+static bool drain( Pacer & pacer, vector<Clock::time_point> & departures,
+                   vector<size_t> & burst_sizes )
+{
+  uint16_t next_fragment = 0;
+
+  while ( not pacer.empty() ) {
+    const vector<Packet> burst = next_burst( pacer );
+    const Clock::time_point now = Clock::now();
+
+    if ( not burst.empty() ) {
+      burst_sizes.push_back( burst.size() );
+    }
+
+    for ( const Packet & packet : burst ) {
+      if ( not expect( packet.fragment_no() == next_fragment++, "packets leave in order" ) ) {
+        return false;
+      }
+
+      departures.push_back( now );
+    }
+  }
+
+  return true;
+}
+
+static bool test_delays()
+{
+  const microseconds DELAY { 3000 };
+
+  Pacer pacer;
+  const vector<Packet> packets = make_packets( 4 );
+
+  const Clock::time_point start = Clock::now();
+  for ( const Packet & packet : packets ) {
+    pacer.push( packet, DELAY.count() );
+  }
+
+  vector<Clock::time_point> departures;
+  vector<size_t> burst_sizes;
+  if ( not drain( pacer, departures, burst_sizes ) ) {
+    return false;
+  }
+
+  /* the first packet goes right away, and each of the others the delay
+     after the one before it was scheduled */
+  for ( size_t i = 0; i < departures.size(); i++ ) {
+    if ( not expect( departures[ i ] >= start + i * DELAY, "no packet leaves early" ) ) {
+      return false;
+    }
+  }
+
+  return expect( departures.size() == packets.size(), "every packet leaves" );
+}
+
+static bool test_token_bucket()
+{
+  /* a byte per microsecond, and room for two packets at a time */
+  const double RATE = 1e6;
+  const size_t PACKET_BYTES = Packet::HEADER_SIZE + Packet::MAXIMUM_PAYLOAD;
+  const size_t BUCKET = 2 * PACKET_BYTES + 100;
+  const microseconds SLACK { 20 }; /* for rounding in the pacer */
+
+  Pacer pacer;
+  const Clock::time_point start = Clock::now();
+  pacer.set_rate( RATE, BUCKET );
+
+  /* the bucket starts empty, so the packets go one at a time, at the rate;
+     the delays given with them don't count */
+  const vector<Packet> packets = make_packets( 6 );
+  for ( const Packet & packet : packets ) {
+    pacer.push( packet, 1000000 );
+  }
+
+  vector<Clock::time_point> departures;
+  vector<size_t> burst_sizes;
+  if ( not drain( pacer, departures, burst_sizes ) ) {
+    return false;
+  }
+
+  for ( size_t i = 0; i < departures.size(); i++ ) {
+    const microseconds earliest { ( i + 1 ) * PACKET_BYTES };
+    if ( not expect( departures[ i ] + SLACK >= start + earliest,
+                     "packets leave no faster than the rate" ) ) {
+      return false;
+    }
+  }
+
+  if ( not expect( departures.size() == packets.size()
+                   and departures.back() < start + seconds( 1 ),
+                   "every packet leaves, at about the rate" ) ) {
+    return false;
+  }
+
+  /* after a while idle, the bucket is full again: two packets may go at
+     once, but the third has to wait for the bucket to refill */
+  this_thread::sleep_for( milliseconds( 20 ) );
+
+  const vector<Packet> more = make_packets( 3 );
+  for ( const Packet & packet : more ) {
+    pacer.push( packet );
+  }
+
+  const Clock::time_point resumed = Clock::now();
+  departures.clear();
+  burst_sizes.clear();
+  if ( not drain( pacer, departures, burst_sizes ) ) {
+    return false;
+  }
+
+  /* the full bucket leaves 100 bytes after the first two */
+  const microseconds refill { PACKET_BYTES - 100 };
+
+  return expect( burst_sizes.size() == 2 and burst_sizes[ 0 ] == 2 and burst_sizes[ 1 ] == 1,
+                 "a full bucket lets out two packets at once, and no more" )
+         and expect( departures[ 2 ] + SLACK >= resumed + refill,
+                     "the bucket refills at the rate" );
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    if ( not test_delays() or not test_token_bucket() ) {
+      return EXIT_FAILURE;
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,176 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks that a Poller keeps calling back while an fd stays ready, even if
+   each callback only takes part of what's waiting, and that interest
+   changes (told with set_interest() or found by a predicate), Cancel and
+   Exit are honored -- with both backends */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "exception.hh"
+#include "expect.hh"
+#include "poller.hh"
+#include "socketpair.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+static bool test_backend( const Poller::Backend backend, const bool use_set_interest )
+{
+  auto sockets = UnixDomainSocket::make_pair();
+  UnixDomainSocket & sender = sockets.first;
+  UnixDomainSocket & receiver = sockets.second;
+
+  /* each callback takes one datagram, however many are waiting */
+  unsigned int reads = 0;
+  unsigned int writes = 0;
+  bool want_to_write = false;
+  bool exit_on_read = false;
+  bool cancel_on_read = false;
+
+  Poller poller { backend };
+
+  poller.add_action( Poller::Action( receiver, Direction::In,
+    [&]() -> Result
+    {
+      receiver.read();
+      reads++;
+      if ( exit_on_read ) {
+        return Result( ResultType::Exit, 7 );
+      }
+      return cancel_on_read ? ResultType::Cancel : ResultType::Continue;
+    } ) );
+
+  /* a second action on the same fd */
+  auto write_pong = [&]()
+    {
+      receiver.write( "pong" );
+      writes++;
+      return ResultType::Continue;
+    };
+
+  size_t write_action;
+  if ( use_set_interest ) {
+    write_action = poller.add_action( Poller::Action( receiver, Direction::Out, write_pong ) );
+    poller.set_interest( write_action, false );
+  } else {
+    write_action = poller.add_action( Poller::Action( receiver, Direction::Out, write_pong,
+                                                      [&]() { return want_to_write; } ) );
+  }
+
+  auto set_want_to_write = [&]( const bool value )
+    {
+      want_to_write = value;
+      if ( use_set_interest ) {
+        poller.set_interest( write_action, value );
+      }
+    };
+
+  if ( not expect( poller.poll( 0 ).result == Poller::Result::Type::Timeout,
+                   "nothing to read times out" ) ) {
+    return false;
+  }
+
+  for ( unsigned int i = 0; i < 5; i++ ) {
+    sender.write( "ping" );
+  }
+
+  /* one datagram per call, until they are all gone */
+  for ( unsigned int i = 1; i <= 5; i++ ) {
+    if ( not expect( poller.poll( 0 ).result == Poller::Result::Type::Success
+                     and reads == i, "data left behind is reported again" ) ) {
+      return false;
+    }
+  }
+
+  if ( not expect( poller.poll( 0 ).result == Poller::Result::Type::Timeout
+                   and reads == 5 and writes == 0, "a drained fd is quiet" ) ) {
+    return false;
+  }
+
+  /* turning on interest in writing wakes up on the writable fd */
+  set_want_to_write( true );
+  if ( not expect( poller.poll( 0 ).result == Poller::Result::Type::Success
+                   and writes == 1 and reads == 5, "interest in writing is picked up" ) ) {
+    return false;
+  }
+
+  set_want_to_write( false );
+  if ( not expect( poller.poll( 0 ).result == Poller::Result::Type::Timeout
+                   and writes == 1, "lost interest in writing is picked up" ) ) {
+    return false;
+  }
+
+  if ( not expect( sender.read() == "pong", "the write went through" ) ) {
+    return false;
+  }
+
+  exit_on_read = true;
+  sender.write( "ping" );
+  const Poller::Result result = poller.poll( 1000 );
+
+  if ( not expect( result.result == Poller::Result::Type::Exit and result.exit_status == 7,
+                   "a callback's exit status is returned" ) ) {
+    return false;
+  }
+
+  /* once the only interested action cancels, there's nothing to wait for */
+  exit_on_read = false;
+  cancel_on_read = true;
+  sender.write( "ping" );
+  sender.write( "ping" );
+
+  return expect( poller.poll( 1000 ).result == Poller::Result::Type::Success
+                 and poller.poll( 1000 ).result == Poller::Result::Type::Exit
+                 and reads == 7, "a cancelled action is not called again" );
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    for ( const bool use_set_interest : { false, true } ) {
+      if ( not test_backend( Poller::Backend::Poll, use_set_interest )
+           or not test_backend( Poller::Backend::Epoll, use_set_interest ) ) {
+        return EXIT_FAILURE;
+      }
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -64,6 +64,8 @@ Decoder random_decoder(default_random_engine &rng);
 Encoder random_encoder(default_random_engine &rng);
 
 template<typename T> void run_one_test(T (*gen)(default_random_engine &), default_random_engine &rng, string tname);
+void run_all_references_test(default_random_engine &rng, const bool compress = false);
+void run_delta_test(default_random_engine &rng);
 
 int main( int argc, char *argv[] ) {
   unsigned num_tests = 16;
@@ -119,6 +121,27 @@ int main( int argc, char *argv[] ) {
       run_one_test(random_decoder, rng, "Decoder");
     }
 
+    // Decoder with golden and alternative references (checkpoints)
+    cout << "\nDecoder (all refs): " << flush;
+    for (unsigned i = 0; i < num_tests; i++) {
+      progress(i, num_tests);
+      run_all_references_test(rng);
+    }
+
+    // Decoder with compressed references
+    cout << "\nDecoder (compressed): " << flush;
+    for (unsigned i = 0; i < num_tests; i++) {
+      progress(i, num_tests);
+      run_all_references_test(rng, true);
+    }
+
+    // Decoder as a delta against another one
+    cout << "\nDecoder (delta):   " << flush;
+    for (unsigned i = 0; i < num_tests; i++) {
+      progress(i, num_tests);
+      run_delta_test(rng);
+    }
+
     cout << '\n';
   } catch ( const exception & e ) {
     print_exception( argv[ 0 ], e );
@@ -155,6 +178,61 @@ EncoderStateDeserializer deser_from_ser(EncoderStateSerializer &&odata) {
   return EncoderStateDeserializer(f);
 }
 
+void run_all_references_test(default_random_engine &rng, const bool compress) {
+  EncoderStateSerializer odata(compress);
+
+  uint16_t width = hwdist(rng);
+  uint16_t height = hwdist(rng);
+
+  References refs = random_references(rng, width, height);
+  refs.golden = random_mutable_raster_handle(rng, width, height);
+  if (rng() % 2) {
+    refs.alternative = random_mutable_raster_handle(rng, width, height);
+  }
+
+  Decoder _in(random_decoder_state(rng, width, height), refs);
+  _in.serialize(odata, true);
+
+  EncoderStateDeserializer idata = deser_from_ser(move(odata));
+  Decoder _out = Decoder::deserialize(idata);
+
+  if (!(_in == _out)) {
+    throw runtime_error("Decoder (all refs) failed: _in and _out do not match");
+  }
+}
+
+void run_delta_test(default_random_engine &rng) {
+  uint16_t width = hwdist(rng);
+  uint16_t height = hwdist(rng);
+
+  Decoder base(random_decoder_state(rng, width, height), random_references(rng, width, height));
+
+  // change a few pixels of the last reference, and maybe move it to golden
+  MutableRasterHandle changed(width, height);
+  changed.get().copy_from(base.get_references().last.get());
+  for (unsigned i = 0; i < 5; i++) {
+    changed.get().Y().at(rng() % width, rng() % height) ^= 1 + rng() % 255;
+  }
+
+  References refs = base.get_references();
+  refs.last = move(changed);
+  if (rng() % 2) {
+    refs.golden = base.get_references().last;
+  }
+
+  Decoder _in(random_decoder_state(rng, width, height), refs);
+
+  EncoderStateSerializer odata = {};
+  _in.serialize_delta(odata, base);
+
+  EncoderStateDeserializer idata = deser_from_ser(move(odata));
+  Decoder _out = Decoder::deserialize_delta(idata, base);
+
+  if (!(_in == _out)) {
+    throw runtime_error("Decoder (delta) failed: _in and _out do not match");
+  }
+}
+
 ProbabilityTables random_probability_tables(default_random_engine &rng) {
   ProbabilityTables p;
 
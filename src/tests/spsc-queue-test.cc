@@ -0,0 +1,153 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks SPSCQueue at its limits on one thread (full, empty, and many laps
+   around the ring), then with a producer and a consumer on separate
+   threads: everything comes out once and in order, including values that
+   own memory */
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "exception.hh"
+#include "expect.hh"
+#include "spsc_queue.hh"
+
+using namespace std;
+
+static bool test_single_thread()
+{
+  SPSCQueue<unsigned int> queue { 4 };
+
+  if ( not expect( not queue.pop().initialized(), "a new queue is empty" ) ) {
+    return false;
+  }
+
+  unsigned int next_in = 0, next_out = 0;
+
+  /* fill it, take some out, top it up, and drain it, so both ends wrap
+     at every offset of the ring */
+  for ( unsigned int lap = 0; lap < 100; lap++ ) {
+    while ( next_in - next_out < queue.capacity() ) {
+      if ( not expect( queue.push( next_in++ ), "push into a queue with room" ) ) {
+        return false;
+      }
+    }
+
+    unsigned int rejected = next_in;
+    if ( not expect( not queue.push( move( rejected ) ), "push into a full queue fails" ) ) {
+      return false;
+    }
+
+    const unsigned int taken = 1 + lap % queue.capacity();
+    for ( unsigned int i = 0; i < taken; i++ ) {
+      Optional<unsigned int> value = queue.pop();
+      if ( not expect( value.initialized() and value.get() == next_out++,
+                       "values come out in order" ) ) {
+        return false;
+      }
+    }
+
+    if ( lap % 2 == 0 ) {
+      while ( next_out < next_in ) {
+        Optional<unsigned int> value = queue.pop();
+        if ( not expect( value.initialized() and value.get() == next_out++,
+                         "values come out in order" ) ) {
+          return false;
+        }
+      }
+
+      if ( not expect( not queue.pop().initialized(), "a drained queue is empty" ) ) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/* the producer pushes as fast as the small queue lets it, so the queue is
+   full and empty over and over, and each end keeps having to look at the
+   other's index again */
+static bool test_threads()
+{
+  const unsigned int COUNT = 500000;
+
+  SPSCQueue<unique_ptr<unsigned int>> queue { 8 };
+
+  thread producer( [&]()
+    {
+      for ( unsigned int i = 0; i < COUNT; i++ ) {
+        unique_ptr<unsigned int> value { new unsigned int( i ) };
+        while ( not queue.push( move( value ) ) ) {
+          this_thread::yield();
+        }
+      }
+    } );
+
+  bool in_order = true;
+  unsigned int next = 0;
+
+  while ( next < COUNT ) {
+    Optional<unique_ptr<unsigned int>> value = queue.pop();
+    if ( not value.initialized() ) {
+      this_thread::yield();
+      continue;
+    }
+
+    in_order = in_order and *value.get() == next;
+    next++;
+  }
+
+  producer.join();
+
+  return expect( in_order, "values come out once and in order" )
+         and expect( not queue.pop().initialized(), "the queue ends up empty" );
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    if ( not test_single_thread() or not test_threads() ) {
+      return EXIT_FAILURE;
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* checks StateCache's accounting of shared rasters, its eviction order, and
+   that pinned states and the state being inserted are never evicted */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "exception.hh"
+#include "expect.hh"
+#include "state_cache.hh"
+
+using namespace std;
+
+static const size_t RASTER_BYTES = 1000;
+static const size_t STATE_BYTES = 10;
+
+static bool expect_evicted( const vector<uint32_t> & evicted, const vector<uint32_t> & expected,
+                            const string & what )
+{
+  return expect( evicted == expected, what );
+}
+
+/* a raster used as all three references, like a key frame leaves behind */
+static References fresh_references()
+{
+  return References( 16, 16 );
+}
+
+static bool test_accounting()
+{
+  StateCache<int> cache { 100 * RASTER_BYTES, RASTER_BYTES, STATE_BYTES };
+
+  const References first = fresh_references();
+  cache.insert( 1, 1, first );
+  if ( not expect( cache.stats().bytes == RASTER_BYTES + STATE_BYTES,
+                   "a raster used three times is counted once" ) ) {
+    return false;
+  }
+
+  /* a later state that replaced only the last reference */
+  References second = first;
+  second.last = fresh_references().last;
+  cache.insert( 2, 2, second );
+  if ( not expect( cache.stats().bytes == 2 * RASTER_BYTES + 2 * STATE_BYTES,
+                   "shared golden and alternative rasters are counted once" ) ) {
+    return false;
+  }
+
+  /* the same contents in a different allocation take up memory of their own */
+  cache.insert( 3, 3, fresh_references() );
+  if ( not expect( cache.stats().bytes == 3 * RASTER_BYTES + 3 * STATE_BYTES,
+                   "equal but separate rasters are counted separately" ) ) {
+    return false;
+  }
+
+  /* inserting a state that's already here changes nothing */
+  cache.insert( 3, 30, fresh_references() );
+  if ( not expect( cache.stats().bytes == 3 * RASTER_BYTES + 3 * STATE_BYTES
+                   and cache.at( 3 ) == 3, "reinserting a state is a no-op" ) ) {
+    return false;
+  }
+
+  /* the first raster is still used by state 2 */
+  cache.erase( 1 );
+  if ( not expect( cache.stats().bytes == 3 * RASTER_BYTES + 2 * STATE_BYTES,
+                   "a raster stays counted while a state refers to it" ) ) {
+    return false;
+  }
+
+  cache.erase( 2 );
+  cache.erase( 3 );
+  return expect( cache.stats().bytes == 0 and cache.stats().states == 0,
+                 "an empty cache takes up nothing" );
+}
+
+static bool test_eviction()
+{
+  /* room for three states with a raster each */
+  uint32_t pinned = 0;
+  StateCache<int> cache { 3 * ( RASTER_BYTES + STATE_BYTES ), RASTER_BYTES, STATE_BYTES,
+                          [&]( const uint32_t id ) { return id == pinned; } };
+
+  for ( uint32_t id = 1; id <= 3; id++ ) {
+    if ( not expect_evicted( cache.insert( id, id, fresh_references() ), {},
+                             "nothing is evicted within the budget" ) ) {
+      return false;
+    }
+  }
+
+  /* using state 1 makes state 2 the least recently used */
+  if ( not expect( cache.find( 1 ) != nullptr, "state 1 is found" ) ) {
+    return false;
+  }
+
+  if ( not expect_evicted( cache.insert( 4, 4, fresh_references() ), { 2 },
+                           "the least recently used state is evicted" )
+       or not expect( not cache.contains( 2 ) and cache.find( 2 ) == nullptr,
+                      "an evicted state is gone" ) ) {
+    return false;
+  }
+
+  /* now 3 is the oldest, but pinned */
+  pinned = 3;
+  if ( not expect_evicted( cache.insert( 5, 5, fresh_references() ), { 1 },
+                           "pinned states are skipped" )
+       or not expect( cache.contains( 3 ), "the pinned state is kept" ) ) {
+    return false;
+  }
+
+  /* a state bigger than the whole budget evicts everything else, but not
+     itself or the pinned state */
+  StateCache<int> small { RASTER_BYTES + STATE_BYTES, RASTER_BYTES, STATE_BYTES,
+                          [&]( const uint32_t id ) { return id == pinned; } };
+  small.insert( 3, 3, fresh_references() );
+  small.insert( 6, 6, fresh_references() );
+  if ( not expect_evicted( small.insert( 7, 7, fresh_references() ), { 6 },
+                           "only unpinned, older states are evicted" )
+       or not expect( small.contains( 3 ) and small.contains( 7 ),
+                      "the new and pinned states stay" ) ) {
+    return false;
+  }
+
+  return expect( cache.stats().evictions == 2 and cache.stats().states == 3,
+                 "the stats count evictions" );
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+    if ( not test_accounting() or not test_eviction() ) {
+      return EXIT_FAILURE;
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,435 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <cerrno>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <iterator>
+
+#include "mmap_region.hh"
+#include "file_descriptor.hh"
+#endif
+
+#include "async_io.hh"
+#include "exception.hh"
+
+using namespace std;
+
+bool AsyncIO::Request::advance( const size_t transferred )
+{
+  done += transferred;
+
+  if ( offset != CURRENT_POSITION ) {
+    offset += transferred;
+  }
+
+  /* a read that hits the end of the file is complete, too */
+  return done == length or ( not is_write and transferred == 0 );
+}
+
+#ifdef HAVE_IO_URING
+
+/* a submission and a completion queue shared with the kernel */
+class AsyncIO::Ring
+{
+private:
+  FileDescriptor fd_;
+  io_uring_params params_;
+
+  /* other threads wake the I/O thread through an eventfd polled in the ring */
+  FileDescriptor wakeup_;
+
+  MMap_Region sq_ring_, cq_ring_, sqes_region_;
+
+  unsigned int * sq_head_, * sq_tail_, * sq_mask_, * sq_array_;
+  unsigned int * cq_head_, * cq_tail_, * cq_mask_;
+  io_uring_sqe * sqes_;
+  io_uring_cqe * cqes_;
+
+  unsigned int to_submit_ { 0 };
+
+  static int setup( const unsigned int entries, io_uring_params & params )
+  {
+    return SystemCall( "io_uring_setup", syscall( __NR_io_uring_setup, entries, &params ) );
+  }
+
+  template <typename T>
+  static T * field( MMap_Region & region, const uint32_t offset )
+  {
+    return reinterpret_cast<T *>( region.addr() + offset );
+  }
+
+public:
+  static constexpr unsigned int ENTRIES = 64;
+
+  Ring( io_uring_params && params )
+    : fd_( setup( ENTRIES, params ) ),
+      params_( params ),
+      wakeup_( SystemCall( "eventfd", eventfd( 0, EFD_CLOEXEC ) ) ),
+      sq_ring_( params_.sq_off.array + params_.sq_entries * sizeof( unsigned int ),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_.fd_num(), IORING_OFF_SQ_RING ),
+      cq_ring_( params_.cq_off.cqes + params_.cq_entries * sizeof( io_uring_cqe ),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_.fd_num(), IORING_OFF_CQ_RING ),
+      sqes_region_( params_.sq_entries * sizeof( io_uring_sqe ),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_.fd_num(), IORING_OFF_SQES ),
+      sq_head_( field<unsigned int>( sq_ring_, params_.sq_off.head ) ),
+      sq_tail_( field<unsigned int>( sq_ring_, params_.sq_off.tail ) ),
+      sq_mask_( field<unsigned int>( sq_ring_, params_.sq_off.ring_mask ) ),
+      sq_array_( field<unsigned int>( sq_ring_, params_.sq_off.array ) ),
+      cq_head_( field<unsigned int>( cq_ring_, params_.cq_off.head ) ),
+      cq_tail_( field<unsigned int>( cq_ring_, params_.cq_off.tail ) ),
+      cq_mask_( field<unsigned int>( cq_ring_, params_.cq_off.ring_mask ) ),
+      sqes_( field<io_uring_sqe>( sqes_region_, 0 ) ),
+      cqes_( field<io_uring_cqe>( cq_ring_, params_.cq_off.cqes ) )
+  {}
+
+  static constexpr uint64_t WAKEUP = 0;
+
+  void wake()
+  {
+    const uint64_t one = 1;
+    SystemCall( "write", ::write( wakeup_.fd_num(), &one, sizeof( one ) ) );
+  }
+
+  /* asks for a WAKEUP completion the next time wake() is called */
+  bool arm_wakeup()
+  {
+    io_uring_sqe * sqe = get_sqe();
+    if ( not sqe ) {
+      return false;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakeup_.fd_num();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = WAKEUP;
+    return true;
+  }
+
+  void clear_wakeup()
+  {
+    uint64_t count;
+    SystemCall( "read", ::read( wakeup_.fd_num(), &count, sizeof( count ) ) );
+  }
+
+  /* the next free submission entry, or nullptr if the queue is full */
+  io_uring_sqe * get_sqe()
+  {
+    const unsigned int head = __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE );
+    const unsigned int tail = *sq_tail_;
+
+    if ( tail - head >= params_.sq_entries ) {
+      return nullptr;
+    }
+
+    const unsigned int index = tail & *sq_mask_;
+    io_uring_sqe * sqe = &sqes_[ index ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    sq_array_[ index ] = index;
+
+    __atomic_store_n( sq_tail_, tail + 1, __ATOMIC_RELEASE );
+    to_submit_++;
+
+    return sqe;
+  }
+
+  /* submits new entries and waits until at least one completion is there */
+  void submit_and_wait()
+  {
+    while ( true ) {
+      const int ret = syscall( __NR_io_uring_enter, fd_.fd_num(), to_submit_, 1,
+                               IORING_ENTER_GETEVENTS, nullptr, 0 );
+      if ( ret >= 0 ) {
+        to_submit_ -= min<unsigned int>( ret, to_submit_ );
+        return;
+      }
+
+      if ( errno != EINTR ) {
+        throw unix_error( "io_uring_enter" );
+      }
+    }
+  }
+
+  template <class Callback>
+  void for_each_completion( const Callback & callback )
+  {
+    unsigned int head = *cq_head_;
+
+    while ( head != __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE ) ) {
+      const io_uring_cqe cqe = cqes_[ head & *cq_mask_ ];
+      head++;
+      __atomic_store_n( cq_head_, head, __ATOMIC_RELEASE );
+
+      callback( cqe );
+    }
+  }
+
+  /* disallow copying */
+  Ring( const Ring & other ) = delete;
+  Ring & operator=( const Ring & other ) = delete;
+};
+
+unique_ptr<AsyncIO::Ring> AsyncIO::make_ring()
+{
+  try {
+    io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+    return unique_ptr<Ring>( new Ring( move( params ) ) );
+  } catch ( const exception & ) {
+    /* e.g. an old kernel, or io_uring disabled by policy */
+    return nullptr;
+  }
+}
+
+#else
+
+class AsyncIO::Ring {};
+
+unique_ptr<AsyncIO::Ring> AsyncIO::make_ring()
+{
+  return nullptr;
+}
+
+#endif /* HAVE_IO_URING */
+
+AsyncIO::AsyncIO()
+  : ring_( make_ring() )
+{
+  if ( ring_ ) {
+    thread_ = thread( &AsyncIO::ring_loop, this );
+  }
+  else {
+    thread_ = thread( &AsyncIO::blocking_loop, this );
+  }
+}
+
+AsyncIO::~AsyncIO()
+{
+  {
+    unique_lock<mutex> lock( mutex_ );
+    shutting_down_ = true;
+  }
+
+  wake();
+  thread_.join();
+}
+
+AsyncIO & AsyncIO::global()
+{
+  static AsyncIO io;
+  return io;
+}
+
+bool AsyncIO::using_io_uring() const
+{
+  return bool( ring_ );
+}
+
+future<size_t> AsyncIO::write( const int fd, const Chunk & buffer, const int64_t offset )
+{
+  return enqueue( unique_ptr<Request>( new Request( true, fd, const_cast<uint8_t *>( buffer.buffer() ),
+                                                    buffer.size(), offset ) ) );
+}
+
+future<size_t> AsyncIO::read( const int fd, uint8_t * destination, const size_t length,
+                              const int64_t offset )
+{
+  return enqueue( unique_ptr<Request>( new Request( false, fd, destination, length, offset ) ) );
+}
+
+future<size_t> AsyncIO::enqueue( unique_ptr<Request> && request )
+{
+  future<size_t> ret = request->promise.get_future();
+
+  if ( request->length == 0 ) {
+    request->promise.set_value( 0 );
+    return ret;
+  }
+
+  {
+    unique_lock<mutex> lock( mutex_ );
+    queue_.push_back( move( request ) );
+  }
+
+  wake();
+  return ret;
+}
+
+void AsyncIO::wake()
+{
+#ifdef HAVE_IO_URING
+  if ( ring_ ) {
+    ring_->wake();
+    return;
+  }
+#endif
+
+  queue_nonempty_.notify_all();
+}
+
+void AsyncIO::blocking_loop()
+{
+  while ( true ) {
+    unique_ptr<Request> request;
+
+    {
+      unique_lock<mutex> lock( mutex_ );
+      queue_nonempty_.wait( lock, [&] { return shutting_down_ or not queue_.empty(); } );
+
+      if ( queue_.empty() ) {
+        return;
+      }
+
+      request = move( queue_.front() );
+      queue_.pop_front();
+    }
+
+    try {
+      while ( true ) {
+        uint8_t * const position = request->buffer + request->done;
+        const size_t remaining = request->length - request->done;
+
+        ssize_t transferred;
+        if ( request->is_write ) {
+          transferred = request->offset == CURRENT_POSITION
+            ? SystemCall( "write", ::write( request->fd, position, remaining ) )
+            : SystemCall( "pwrite", ::pwrite( request->fd, position, remaining, request->offset ) );
+
+          if ( transferred == 0 ) {
+            throw internal_error( "write", "returned 0" );
+          }
+        }
+        else {
+          transferred = request->offset == CURRENT_POSITION
+            ? SystemCall( "read", ::read( request->fd, position, remaining ) )
+            : SystemCall( "pread", ::pread( request->fd, position, remaining, request->offset ) );
+        }
+
+        if ( request->advance( transferred ) ) {
+          break;
+        }
+      }
+
+      request->promise.set_value( request->done );
+    } catch ( ... ) {
+      request->promise.set_exception( current_exception() );
+    }
+  }
+}
+
+#ifdef HAVE_IO_URING
+
+void AsyncIO::ring_loop()
+{
+  /* requests waiting for room in the submission queue, oldest first */
+  deque<unique_ptr<Request>> backlog;
+  size_t in_flight = 0;
+  bool wakeup_armed = false;
+  bool stopping = false;
+
+  while ( not ( stopping and in_flight == 0 and backlog.empty() ) ) {
+    if ( not wakeup_armed and not stopping ) {
+      wakeup_armed = ring_->arm_wakeup();
+    }
+
+    while ( not backlog.empty() ) {
+      Request * request = backlog.front().get();
+      io_uring_sqe * sqe = ring_->get_sqe();
+      if ( not sqe ) {
+        break;
+      }
+
+      sqe->opcode = request->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = request->fd;
+      sqe->addr = reinterpret_cast<uint64_t>( request->buffer + request->done );
+      sqe->len = request->length - request->done;
+      sqe->off = request->offset;
+      sqe->user_data = reinterpret_cast<uint64_t>( request );
+
+      /* owned by the ring until its completion arrives */
+      backlog.front().release();
+      backlog.pop_front();
+      in_flight++;
+    }
+
+    ring_->submit_and_wait();
+
+    ring_->for_each_completion( [&] ( const io_uring_cqe & cqe ) {
+        if ( cqe.user_data == Ring::WAKEUP ) {
+          wakeup_armed = false;
+          ring_->clear_wakeup();
+
+          unique_lock<mutex> lock( mutex_ );
+          move( queue_.begin(), queue_.end(), back_inserter( backlog ) );
+          queue_.clear();
+          stopping = shutting_down_;
+          return;
+        }
+
+        in_flight--;
+        unique_ptr<Request> request { reinterpret_cast<Request *>( cqe.user_data ) };
+
+        if ( cqe.res == -EINTR or cqe.res == -EAGAIN ) {
+          backlog.push_front( move( request ) );
+        }
+        else if ( cqe.res < 0 ) {
+          errno = -cqe.res;
+          request->promise.set_exception( make_exception_ptr(
+            unix_error( request->is_write ? "io_uring write" : "io_uring read" ) ) );
+        }
+        else if ( request->is_write and cqe.res == 0 ) {
+          request->promise.set_exception( make_exception_ptr(
+            internal_error( "io_uring write", "returned 0" ) ) );
+        }
+        else if ( request->advance( cqe.res ) ) {
+          request->promise.set_value( request->done );
+        }
+        else {
+          /* short transfer: go again for the rest */
+          backlog.push_front( move( request ) );
+        }
+      } );
+  }
+}
+
+#else
+
+void AsyncIO::ring_loop()
+{
+  blocking_loop();
+}
+
+#endif /* HAVE_IO_URING */
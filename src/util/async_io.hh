@@ -0,0 +1,120 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef ASYNC_IO_HH
+#define ASYNC_IO_HH
+
+/* Reads and writes carried out by a dedicated I/O thread, so that the
+   thread asking for them doesn't block on the disk. When built with
+   io_uring (--enable-io-uring), the I/O thread hands requests to the kernel
+   in batches and collects their completions; otherwise, or if the kernel
+   refuses to set up a ring, it makes ordinary blocking system calls. */
+
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "chunk.hh"
+
+class AsyncIO
+{
+public:
+  /* uses (and advances) the file position, for pipes and the like */
+  static constexpr int64_t CURRENT_POSITION = -1;
+
+  AsyncIO();
+  ~AsyncIO();
+
+  static AsyncIO & global();
+
+  /* writes all of the buffer, which must stay alive until the future is
+     ready; the future yields the number of bytes written */
+  std::future<size_t> write( const int fd, const Chunk & buffer, const int64_t offset );
+
+  /* reads until length bytes have arrived or the file ends; the future
+     yields the number of bytes read. Requests at CURRENT_POSITION on the
+     same file descriptor must not overlap. */
+  std::future<size_t> read( const int fd, uint8_t * destination, const size_t length,
+                            const int64_t offset );
+
+  bool using_io_uring() const;
+
+  /* disallow copying */
+  AsyncIO( const AsyncIO & other ) = delete;
+  AsyncIO & operator=( const AsyncIO & other ) = delete;
+
+private:
+  struct Request
+  {
+    bool is_write;
+    int fd;
+    uint8_t * buffer;
+    size_t length;
+    int64_t offset;
+    size_t done { 0 };
+    std::promise<size_t> promise {};
+
+    Request( const bool s_is_write, const int s_fd, uint8_t * s_buffer,
+             const size_t s_length, const int64_t s_offset )
+      : is_write( s_is_write ), fd( s_fd ), buffer( s_buffer ),
+        length( s_length ), offset( s_offset )
+    {}
+
+    /* accounts for a transfer, returns true if the request is complete */
+    bool advance( const size_t transferred );
+
+    /* disallow copying */
+    Request( const Request & other ) = delete;
+    Request & operator=( const Request & other ) = delete;
+  };
+
+  class Ring;
+
+  /* returns nullptr if io_uring is unavailable */
+  static std::unique_ptr<Ring> make_ring();
+
+  std::unique_ptr<Ring> ring_;
+
+  std::deque<std::unique_ptr<Request>> queue_ {};
+  bool shutting_down_ { false };
+  std::mutex mutex_ {};
+  std::condition_variable queue_nonempty_ {};
+  std::thread thread_ {};
+
+  std::future<size_t> enqueue( std::unique_ptr<Request> && request );
+  void wake();
+
+  void blocking_loop();
+  void ring_loop();
+};
+
+#endif /* ASYNC_IO_HH */
@@ -0,0 +1,140 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef BOUNDED_QUEUE_HH
+#define BOUNDED_QUEUE_HH
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+#include "optional.hh"
+
+/* A fixed-size queue that any number of threads can push to and pop from
+   without locks (after Dmitry Vyukov's bounded MPMC queue). Each slot has a
+   sequence number that says whether it is ready to be written or read on a
+   given lap around the ring. */
+template <class T>
+class BoundedQueue
+{
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence { 0 };
+    Optional<T> value {};
+  };
+
+  /* keep the two ends on separate cache lines */
+  static constexpr size_t CACHE_LINE = 64;
+
+  std::unique_ptr<Slot[]> slots_;
+  const size_t mask_;
+
+  alignas( CACHE_LINE ) std::atomic<size_t> head_ { 0 };
+  alignas( CACHE_LINE ) std::atomic<size_t> tail_ { 0 };
+
+  static size_t checked_capacity( const size_t capacity )
+  {
+    if ( capacity < 2 or ( capacity & ( capacity - 1 ) ) != 0 ) {
+      throw std::runtime_error( "BoundedQueue: capacity must be a power of two" );
+    }
+
+    return capacity;
+  }
+
+public:
+  BoundedQueue( const size_t capacity )
+    : slots_( new Slot[ checked_capacity( capacity ) ] ), mask_( capacity - 1 )
+  {
+    for ( size_t i = 0; i < capacity; i++ ) {
+      slots_[ i ].sequence.store( i, std::memory_order_relaxed );
+    }
+  }
+
+  /* returns false if the queue is full */
+  bool push( T && value )
+  {
+    size_t position = tail_.load( std::memory_order_relaxed );
+
+    while ( true ) {
+      Slot & slot = slots_[ position & mask_ ];
+      const size_t sequence = slot.sequence.load( std::memory_order_acquire );
+      const intptr_t lap = static_cast<intptr_t>( sequence ) - static_cast<intptr_t>( position );
+
+      if ( lap == 0 ) {
+        if ( tail_.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ) {
+          slot.value.initialize( std::move( value ) );
+          slot.sequence.store( position + 1, std::memory_order_release );
+          return true;
+        }
+      }
+      else if ( lap < 0 ) {
+        return false;
+      }
+      else {
+        position = tail_.load( std::memory_order_relaxed );
+      }
+    }
+  }
+
+  /* returns nothing if the queue is empty */
+  Optional<T> pop()
+  {
+    size_t position = head_.load( std::memory_order_relaxed );
+
+    while ( true ) {
+      Slot & slot = slots_[ position & mask_ ];
+      const size_t sequence = slot.sequence.load( std::memory_order_acquire );
+      const intptr_t lap = static_cast<intptr_t>( sequence ) - static_cast<intptr_t>( position + 1 );
+
+      if ( lap == 0 ) {
+        if ( head_.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ) {
+          Optional<T> ret { std::move( slot.value.get() ) };
+          slot.value.clear();
+          slot.sequence.store( position + mask_ + 1, std::memory_order_release );
+          return ret;
+        }
+      }
+      else if ( lap < 0 ) {
+        return {};
+      }
+      else {
+        position = head_.load( std::memory_order_relaxed );
+      }
+    }
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  /* disallow copying */
+  BoundedQueue( const BoundedQueue & other ) = delete;
+  BoundedQueue & operator=( const BoundedQueue & other ) = delete;
+};
+
+#endif /* BOUNDED_QUEUE_HH */
@@ -0,0 +1,72 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef EVENTFD_HH
+#define EVENTFD_HH
+
+#include <sys/eventfd.h>
+
+#include "file_descriptor.hh"
+
+/* a counter in the kernel that threads can signal and wait on, and that a
+   Poller can watch (it's readable while the count is nonzero). signal() and
+   wait_any() are safe to use from several threads at once, so they leave the
+   read/write counts alone; wait() counts as a read, as a Poller expects of
+   its callbacks, and is for a single consumer. */
+class EventFD : public FileDescriptor
+{
+public:
+  /* in semaphore mode, each wait() takes one off the count; otherwise it
+     takes all of it */
+  EventFD( const bool semaphore = false )
+    : FileDescriptor( SystemCall( "eventfd",
+                                  eventfd( 0, EFD_CLOEXEC | ( semaphore ? EFD_SEMAPHORE : 0 ) ) ) )
+  {}
+
+  void signal( const uint64_t count = 1 )
+  {
+    SystemCall( "write", ::write( fd_num(), &count, sizeof( count ) ) );
+  }
+
+  /* blocks until the count is nonzero */
+  uint64_t wait_any()
+  {
+    uint64_t count;
+    SystemCall( "read", ::read( fd_num(), &count, sizeof( count ) ) );
+    return count;
+  }
+
+  uint64_t wait()
+  {
+    const uint64_t count = wait_any();
+    register_read();
+    return count;
+  }
+};
+
+#endif /* EVENTFD_HH */
@@ -30,10 +30,14 @@
 #define FILE_DESCRIPTOR_HH
 
 #include <string>
+#include <vector>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <climits>
 #include <cassert>
 
 #include "exception.hh"
@@ -49,6 +53,39 @@ private:
 
   unsigned int read_count_, write_count_;
 
+  /* data read ahead by getline() and read_exact(), handed out before
+     anything is read from the file descriptor again. NOTE that a poller
+     watching this file descriptor can't see data waiting here. */
+  std::string read_buffer_ {};
+  size_t read_buffer_offset_ { 0 };
+
+  size_t buffered( void ) const { return read_buffer_.size() - read_buffer_offset_; }
+
+  /* appends up to BUFFER_SIZE bytes to the read buffer, returns false at EOF */
+  bool fill_read_buffer( void )
+  {
+    if ( read_buffer_offset_ > 0 ) {
+      read_buffer_.erase( 0, read_buffer_offset_ );
+      read_buffer_offset_ = 0;
+    }
+
+    const size_t old_size = read_buffer_.size();
+    read_buffer_.resize( old_size + BUFFER_SIZE );
+
+    ssize_t bytes_read = SystemCall( "read",
+      ::read( fd_, &read_buffer_[ old_size ], BUFFER_SIZE ) );
+
+    read_buffer_.resize( old_size + bytes_read );
+    register_read();
+
+    if ( bytes_read == 0 ) {
+      eof_ = true;
+      return false;
+    }
+
+    return true;
+  }
+
 protected:
   void register_read( void ) { read_count_++; }
   void register_write( void ) { write_count_++; }
@@ -75,7 +112,10 @@ public:
 
   const int & fd_num( void ) const { return fd_; }
 
-  bool eof() { return eof_; }
+  bool eof() { return eof_ and buffered() == 0; }
+
+  /* bytes read ahead from the file descriptor but not handed out yet */
+  size_t buffered_bytes( void ) const { return buffered(); }
 
   unsigned int read_count( void ) const { return read_count_; }
   unsigned int write_count( void ) const { return write_count_; }
@@ -87,7 +127,9 @@ public:
   /* allow moves */
   FileDescriptor( FileDescriptor && other )
     : fd_( other.fd_ ), eof_( other.eof_ ), read_count_( other.read_count_ ),
-      write_count_( other.write_count_ )
+      write_count_( other.write_count_ ),
+      read_buffer_( std::move( other.read_buffer_ ) ),
+      read_buffer_offset_( other.read_buffer_offset_ )
   {
     // Need to make sure the old file descriptor doesn't try to
     // close fd_ when it is destructed
@@ -138,25 +180,96 @@ public:
     register_write();
   }
 
+  /* write the buffers back to back, without copying them together */
+  void write( const std::vector<Chunk> & buffers )
+  {
+    std::vector<iovec> iov;
+    iov.reserve( buffers.size() );
+
+    for ( const Chunk & buffer : buffers ) {
+      if ( buffer.size() > 0 ) {
+        iov.push_back( { const_cast<uint8_t *>( buffer.buffer() ), buffer.size() } );
+      }
+    }
+
+    size_t first = 0;
+
+    while ( first < iov.size() ) {
+      ssize_t bytes_written = SystemCall( "writev",
+        ::writev( fd_, &iov[ first ], std::min<size_t>( iov.size() - first, IOV_MAX ) ) );
+      if ( bytes_written == 0 ) {
+        throw internal_error( "writev", "returned 0" );
+      }
+
+      /* skip what has been written, possibly stopping in the middle of a buffer */
+      while ( bytes_written > 0 ) {
+        const size_t consumed = std::min<size_t>( bytes_written, iov[ first ].iov_len );
+        iov[ first ].iov_base = static_cast<uint8_t *>( iov[ first ].iov_base ) + consumed;
+        iov[ first ].iov_len -= consumed;
+        bytes_written -= consumed;
+
+        if ( iov[ first ].iov_len == 0 ) {
+          first++;
+        }
+      }
+    }
+
+    register_write();
+  }
+
+  /* overwrite bytes at the given offset, leaving the file position alone */
+  void write_at( const Chunk & buffer, const uint64_t offset )
+  {
+    Chunk amount_left_to_write = buffer;
+    uint64_t position = offset;
+    while ( amount_left_to_write.size() > 0 ) {
+      ssize_t bytes_written = SystemCall( "pwrite",
+        ::pwrite( fd_, amount_left_to_write.buffer(), amount_left_to_write.size(), position ) );
+      if ( bytes_written == 0 ) {
+        throw internal_error( "pwrite", "returned 0" );
+      }
+      amount_left_to_write = amount_left_to_write( bytes_written );
+      position += bytes_written;
+    }
+
+    register_write();
+  }
+
+  /* returns the next line without its newline; at EOF, returns whatever
+     is left (possibly nothing) and sets eof() */
   std::string getline()
   {
-    std::string ret;
+    size_t searched = 0;
 
     while ( true ) {
-      std::string char_read = read( 1 );
+      const size_t newline = read_buffer_.find( '\n', read_buffer_offset_ + searched );
 
-      if ( eof() or char_read == "\n" ) {
-        break;
+      if ( newline != std::string::npos ) {
+        std::string ret = read_buffer_.substr( read_buffer_offset_, newline - read_buffer_offset_ );
+        read_buffer_offset_ = newline + 1;
+        return ret;
       }
 
-      ret.append( char_read );
-    }
+      searched = buffered();
 
-    return ret;
+      if ( eof_ or not fill_read_buffer() ) {
+        std::string ret = read_buffer_.substr( read_buffer_offset_ );
+        read_buffer_.clear();
+        read_buffer_offset_ = 0;
+        return ret;
+      }
+    }
   }
 
   std::string read( const size_t limit = BUFFER_SIZE )
   {
+    if ( buffered() > 0 ) {
+      const size_t length = std::min( buffered(), limit );
+      std::string ret = read_buffer_.substr( read_buffer_offset_, length );
+      read_buffer_offset_ += length;
+      return ret;
+    }
+
     char buffer[ BUFFER_SIZE ];
 
     if ( eof() ) {
@@ -175,17 +288,36 @@ public:
     return std::string( buffer, bytes_read );
   }
 
-  std::string read_exactly( const size_t length )
+  /* fills the destination completely, reading the bulk of it directly
+     from the file descriptor rather than through the buffer */
+  void read_exact( uint8_t * destination, const size_t length )
   {
-    std::string ret;
-    while ( ret.size() < length ) {
-      ret.append( read( length - ret.size() ) );
-      if ( eof() ) {
-        throw std::runtime_error( "read_exactly: FileDescriptor reached EOF before reaching target" );
+    const size_t from_buffer = std::min( buffered(), length );
+    std::memcpy( destination, read_buffer_.data() + read_buffer_offset_, from_buffer );
+    read_buffer_offset_ += from_buffer;
+
+    size_t done = from_buffer;
+    while ( done < length ) {
+      if ( eof_ ) {
+        throw std::runtime_error( "read_exact: FileDescriptor reached EOF before reaching target" );
       }
+
+      ssize_t bytes_read = SystemCall( "read",
+        ::read( fd_, destination + done, length - done ) );
+      register_read();
+
+      if ( bytes_read == 0 ) {
+        eof_ = true;
+      }
+
+      done += bytes_read;
     }
+  }
 
-    assert( ret.size() == length );
+  std::string read_exactly( const size_t length )
+  {
+    std::string ret( length, 0 );
+    read_exact( reinterpret_cast<uint8_t *>( &ret[ 0 ] ), length );
     return ret;
   }
 };
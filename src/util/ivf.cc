@@ -27,13 +27,25 @@
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdexcept>
+#include <unistd.h>
 
 #include "ivf.hh"
 #include "file.hh"
 
 using namespace std;
 
-IVF::IVF( const string & filename )
+/* index sidecar layout (all little-endian):
+
+   header:  "XCIX", version (16 bits, = 0), header length (16 bits),
+            entry length (16 bits), reserved (16 bits), frame count (32 bits),
+            size of the indexed IVF file (64 bits), reserved (64 bits)
+
+   entries: payload offset (64 bits), payload length (32 bits),
+            flags (32 bits, bit 0 = key frame), presentation timestamp (64 bits) */
+
+static constexpr uint32_t INDEX_KEY_FRAME = 1;
+
+IVF::IVF( const string & filename, const bool use_index_file )
 try :
   file_( filename ),
     header_( file_( 0, supported_header_len ) ),
@@ -44,6 +56,8 @@ try :
     time_scale_( header_( 20, 4 ).le32() ),
     frame_count_( header_( 24, 4 ).le32() ),
     expected_decoder_minihash_( header_( 28, 4 ).le32() ),
+    index_file_(),
+    index_entries_( nullptr, 0 ),
     frame_index_()
       {
         if ( header_( 0, 4 ).to_string() != "DKIF" ) {
@@ -58,16 +72,8 @@ try :
           throw Unsupported( "unsupported IVF header length" );
         }
 
-        /* build the index */
-        frame_index_.reserve( frame_count_ );
-
-        uint64_t position = supported_header_len;
-        for ( uint32_t i = 0; i < frame_count_; i++ ) {
-          Chunk frame_header = file_( position, frame_header_len );
-          const uint32_t frame_len = frame_header.le32();
-
-          frame_index_.emplace_back( position + frame_header_len, frame_len );
-          position += frame_header_len + frame_len;
+        if ( not ( use_index_file and load_index( index_filename( filename ) ) ) ) {
+          build_index();
         }
       }
 catch ( const out_of_range & e )
@@ -75,8 +81,125 @@ catch ( const out_of_range & e )
     throw Invalid( "IVF file truncated" );
   }
 
+/* maps the sidecar if there is one and it describes this file; a missing
+   or stale index is not an error, the caller falls back to scanning */
+bool IVF::load_index( const string & index_filename )
+{
+  if ( access( index_filename.c_str(), R_OK ) != 0 ) {
+    return false;
+  }
+
+  unique_ptr<File> index_file;
+  try {
+    index_file.reset( new File( index_filename ) );
+  } catch ( const exception & ) {
+    return false;
+  }
+
+  if ( index_file->size() < index_header_len ) {
+    return false;
+  }
+
+  const Chunk index_header = ( *index_file )( 0, index_header_len );
+
+  if ( index_header( 0, 4 ).to_string() != "XCIX"
+       or index_header( 4, 2 ).le16() != 0
+       or index_header( 6, 2 ).le16() != index_header_len
+       or index_header( 8, 2 ).le16() != index_entry_len
+       or index_header( 12, 4 ).le32() != frame_count_
+       or index_header( 16, 8 ).le64() != file_.size()
+       or index_file->size() != index_header_len + uint64_t( frame_count_ ) * index_entry_len ) {
+    return false;
+  }
+
+  index_entries_ = index_file->chunk()( index_header_len );
+  index_file_ = move( index_file );
+  return true;
+}
+
+void IVF::build_index()
+{
+  const bool vp8 = ( fourcc_ == "VP80" );
+
+  frame_index_.reserve( frame_count_ );
+
+  uint64_t position = supported_header_len;
+  for ( uint32_t i = 0; i < frame_count_; i++ ) {
+    Chunk frame_header = file_( position, frame_header_len );
+    const uint32_t frame_len = frame_header.le32();
+    const uint64_t pts = frame_header( 4, 8 ).le64();
+
+    /* in VP8, the lowest bit of the frame tag is clear for key frames */
+    const bool key_frame = vp8 and frame_len > 0
+                           and not ( file_( position + frame_header_len, 1 ).octet() & 1 );
+
+    frame_index_.push_back( { position + frame_header_len, frame_len, key_frame, pts } );
+    position += frame_header_len + frame_len;
+  }
+}
+
+IVF::FrameInfo IVF::frame_info( const uint32_t & index ) const
+{
+  if ( not index_file_ ) {
+    return frame_index_.at( index );
+  }
+
+  if ( index >= frame_count_ ) {
+    throw out_of_range( "IVF frame index out of range" );
+  }
+
+  const Chunk entry = index_entries_( uint64_t( index ) * index_entry_len, index_entry_len );
+  return { entry( 0, 8 ).le64(),
+           uint32_t( entry( 8, 4 ).le32() ),
+           bool( entry( 12, 4 ).le32() & INDEX_KEY_FRAME ),
+           entry( 16, 8 ).le64() };
+}
+
 Chunk IVF::frame( const uint32_t & index ) const
 {
-  const auto & entry = frame_index_.at( index );
-  return file_( entry.first, entry.second );
+  const FrameInfo info = frame_info( index );
+  return file_( info.offset, info.length );
+}
+
+static void append_le16( string & out, const uint16_t val )
+{
+  const uint16_t swizzled = htole16( val );
+  out.append( reinterpret_cast<const char *>( &swizzled ), sizeof( swizzled ) );
+}
+
+static void append_le32( string & out, const uint32_t val )
+{
+  const uint32_t swizzled = htole32( val );
+  out.append( reinterpret_cast<const char *>( &swizzled ), sizeof( swizzled ) );
+}
+
+static void append_le64( string & out, const uint64_t val )
+{
+  const uint64_t swizzled = htole64( val );
+  out.append( reinterpret_cast<const char *>( &swizzled ), sizeof( swizzled ) );
+}
+
+string IVF::serialize_index() const
+{
+  string ret;
+  ret.reserve( index_header_len + uint64_t( frame_count_ ) * index_entry_len );
+
+  ret.append( "XCIX" );
+  append_le16( ret, 0 );
+  append_le16( ret, index_header_len );
+  append_le16( ret, index_entry_len );
+  append_le16( ret, 0 );
+  append_le32( ret, frame_count_ );
+  append_le64( ret, file_.size() );
+  append_le64( ret, 0 );
+
+  for ( uint32_t i = 0; i < frame_count_; i++ ) {
+    const FrameInfo info = frame_info( i );
+    append_le64( ret, info.offset );
+    append_le32( ret, info.length );
+    append_le32( ret, info.key_frame ? INDEX_KEY_FRAME : 0 );
+    append_le64( ret, info.pts );
+  }
+
+  return ret;
 }
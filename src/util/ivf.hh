@@ -32,11 +32,21 @@
 #include <string>
 #include <cstdint>
 #include <vector>
+#include <memory>
 
 #include "file.hh"
 
 class IVF
 {
+public:
+  struct FrameInfo
+  {
+    uint64_t offset;  /* of the frame's payload, past its header */
+    uint32_t length;
+    bool key_frame;
+    uint64_t pts;
+  };
+
 private:
   File file_;
   Chunk header_;
@@ -46,13 +56,23 @@ private:
   uint32_t frame_rate_, time_scale_, frame_count_;
   uint32_t expected_decoder_minihash_;
 
-  std::vector< std::pair<uint64_t, uint32_t> > frame_index_;
+  /* the frame index is either read from an up-to-date sidecar file,
+     or built by walking the frame headers */
+  std::unique_ptr<File> index_file_;
+  Chunk index_entries_;
+  std::vector<FrameInfo> frame_index_;
+
+  bool load_index( const std::string & index_filename );
+  void build_index();
 
 public:
   static constexpr int supported_header_len = 32;
   static constexpr int frame_header_len = 12;
 
-  IVF( const std::string & filename );
+  static constexpr int index_header_len = 32;
+  static constexpr int index_entry_len = 24;
+
+  IVF( const std::string & filename, const bool use_index_file = true );
 
   const std::string & fourcc( void ) const { return fourcc_; }
   uint16_t width( void ) const { return width_; }
@@ -61,11 +81,21 @@ public:
   uint32_t time_scale( void ) const { return time_scale_; }
   uint32_t frame_count( void ) const { return frame_count_; }
 
+  FrameInfo frame_info( const uint32_t & index ) const;
   Chunk frame( const uint32_t & index ) const;
 
   size_t size() const { return file_.size(); }
 
   uint32_t expected_decoder_minihash() const { return expected_decoder_minihash_; }
+
+  /* the index sidecar that goes with an IVF file */
+  static std::string index_filename( const std::string & filename ) { return filename + ".xcidx"; }
+
+  /* the decoder-state checkpoints that go with an IVF file (see Checkpoints) */
+  static std::string checkpoints_filename( const std::string & filename ) { return filename + ".xcckpt"; }
+
+  /* the contents of an index sidecar for this file */
+  std::string serialize_index() const;
 };
 
 #endif /* IVF_HH */
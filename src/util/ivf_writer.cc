@@ -27,14 +27,16 @@
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <cstring>
+#include <cerrno>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/mman.h>
+#include <unistd.h>
 
 #include "ivf_writer.hh"
+#include "ivf.hh"
+#include "async_io.hh"
 #include "safe_array.hh"
-#include "mmap_region.hh"
 
 using namespace std;
 
@@ -52,22 +54,36 @@ static void memcpy_le32( uint8_t * dest, const uint32_t val )
   memcpy( dest, &swizzled, sizeof( swizzled ) );
 }
 
+static void memcpy_le64( uint8_t * dest, const uint64_t val )
+{
+  uint64_t swizzled = htole64( val );
+  memcpy( dest, &swizzled, sizeof( swizzled ) );
+}
+
 IVFWriter::IVFWriter( FileDescriptor && fd,
                       const string & fourcc,
                       const uint16_t width,
                       const uint16_t height,
                       const uint32_t frame_rate,
-                      const uint32_t time_scale )
+                      const uint32_t time_scale,
+                      const size_t buffer_size,
+                      const bool background_flush )
   : fd_( move( fd ) ),
     file_size_( 0 ),
     frame_count_( 0 ),
     width_( width ),
-    height_( height )
+    height_( height ),
+    buffer_size_( buffer_size ),
+    background_flush_( background_flush )
 {
   if ( fourcc.size() != 4 ) {
     throw internal_error( "IVF", "FourCC must be four bytes long" );
   }
 
+  if ( background_flush and buffer_size_ == 0 ) {
+    throw internal_error( "IVF", "background flushing requires a buffer" );
+  }
+
   /* build the header */
   SafeArray<uint8_t, IVF::supported_header_len> new_header;
   zero( new_header );
@@ -85,71 +101,206 @@ IVFWriter::IVFWriter( FileDescriptor && fd,
   fd_.write( Chunk( &new_header.at( 0 ), new_header.size() ) );
   file_size_ += new_header.size();
 
-  /* verify the new file size */
-  assert( fd_.size() == file_size_ );
+  if ( buffer_size_ > 0 ) {
+    pending_.reserve( buffer_size_ );
+  }
+}
+
+IVFWriter::~IVFWriter()
+{
+  try {
+    flush();
+  } catch ( const exception & e ) {
+    print_exception( "IVFWriter", e );
+  }
+
+  /* the I/O thread must be done with the buffers before they go away */
+  for ( InFlight & write : in_flight_ ) {
+    write.written.wait();
+  }
+}
+
+/* the frame count and the decoder hash are adjacent in the header */
+void IVFWriter::write_header_fields( const uint32_t frame_count, const uint32_t minihash )
+{
+  SafeArray<uint8_t, 8> fields;
+  memcpy_le32( &fields.at( 0 ), frame_count );
+  memcpy_le32( &fields.at( 4 ), minihash ); /* ExCamera invention */
+
+  fd_.write_at( Chunk( &fields.at( 0 ), fields.size() ), 24 );
+}
+
+void IVFWriter::write_out( const vector<uint8_t> & data, const uint32_t frame_count,
+                           const uint32_t minihash )
+{
+  fd_.write( Chunk( data ) );
+  write_header_fields( frame_count, minihash );
 }
 
 void IVFWriter::set_expected_decoder_entry_hash( const uint32_t minihash ) /* ExCamera invention */
 {
-  /* map the header into memory */
-  MMap_Region header_in_mem( IVF::supported_header_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.fd_num() );
-  uint8_t * mutable_header_ptr = header_in_mem.addr();
+  expected_decoder_minihash_ = minihash;
 
-  memcpy_le32( mutable_header_ptr + 28, minihash ); /* ExCamera invention */
+  if ( buffer_size_ == 0 ) {
+    write_header_fields( frame_count_, expected_decoder_minihash_ );
+  }
 }
 
 size_t IVFWriter::append_frame( const Chunk & chunk )
 {
-  /* map the header into memory */
-  MMap_Region header_in_mem( IVF::supported_header_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.fd_num() );
-  uint8_t * mutable_header_ptr = header_in_mem.addr();
+  return append_frame( vector<Chunk> { chunk }, frame_count_ );
+}
 
-  Chunk header( mutable_header_ptr, IVF::supported_header_len );
+size_t IVFWriter::append_frame( const Chunk & chunk, const uint64_t pts )
+{
+  return append_frame( vector<Chunk> { chunk }, pts );
+}
 
-  /* verify the existing frame count */
-  assert( frame_count_ == header( 24, 4 ).le32() );
+size_t IVFWriter::append_frame( const SerializedFrame & frame )
+{
+  return append_frame( frame.chunks(), frame_count_ );
+}
 
-  /* verify the existing file size */
-  assert( file_size_ == fd_.size() );
+size_t IVFWriter::append_frame( const SerializedFrame & frame, const uint64_t pts )
+{
+  return append_frame( frame.chunks(), pts );
+}
+
+size_t IVFWriter::append_frame( const vector<Chunk> & pieces, const uint64_t pts )
+{
+  size_t frame_size = 0;
+  for ( const Chunk & piece : pieces ) {
+    frame_size += piece.size();
+  }
 
   /* build the frame header */
   SafeArray<uint8_t, IVF::frame_header_len> new_header;
-  zero( new_header );
-  memcpy_le32( &new_header.at( 0 ), chunk.size() );
+  memcpy_le32( &new_header.at( 0 ), frame_size );
+  memcpy_le64( &new_header.at( 4 ), pts );
 
-  /* XXX does not include presentation timestamp */
+  if ( buffer_size_ == 0 ) {
+    /* append the frame header and the frame to the file */
+    vector<Chunk> buffers { Chunk( &new_header.at( 0 ), new_header.size() ) };
+    buffers.insert( buffers.end(), pieces.begin(), pieces.end() );
+    fd_.write( buffers );
+  }
+  else {
+    /* append the frame header and the frame to the buffer */
+    pending_.insert( pending_.end(), new_header.begin(), new_header.end() );
+    for ( const Chunk & piece : pieces ) {
+      pending_.insert( pending_.end(), piece.buffer(), piece.buffer() + piece.size() );
+    }
+  }
 
-  /* append the frame header to the file */
-  fd_.write( Chunk( &new_header.at( 0 ), new_header.size() ) );
-  file_size_ += new_header .size();
+  file_size_ += new_header.size();
   size_t written_offset = file_size_;
+  file_size_ += frame_size;
 
-  /* append the frame to the file */
-  fd_.write( chunk );
-  file_size_ += chunk.size();
-
-  /* verify the new file size */
-  assert( fd_.size() == file_size_ );
-
-  /* increment the frame count in the file's header */
   frame_count_++;
-  memcpy_le32( mutable_header_ptr + 24, frame_count_ );
 
-  /* verify the new frame count */
-  assert( frame_count_ == header( 24, 4 ).le32() );
+  if ( buffer_size_ == 0 ) {
+    /* keep the file's header current after every frame */
+    write_header_fields( frame_count_, expected_decoder_minihash_ );
+  }
+  else if ( pending_.size() >= buffer_size_ ) {
+    if ( background_flush_ ) {
+      hand_off_pending();
+    }
+    else {
+      write_out( pending_, frame_count_, expected_decoder_minihash_ );
+      pending_.clear();
+    }
+  }
 
   return written_offset;
 }
 
+void IVFWriter::flush()
+{
+  if ( buffer_size_ == 0 ) {
+    return;
+  }
+
+  if ( background_flush_ ) {
+    hand_off_pending();
+
+    while ( not in_flight_.empty() ) {
+      retire_oldest();
+    }
+  }
+  else {
+    write_out( pending_, frame_count_, expected_decoder_minihash_ );
+    pending_.clear();
+  }
+}
+
+/* submits the pending buffer at its place in the file, and starts a new one */
+void IVFWriter::hand_off_pending()
+{
+  if ( pending_.empty() ) {
+    return;
+  }
+
+  if ( in_flight_.size() >= MAX_IN_FLIGHT ) {
+    retire_oldest();
+  }
+
+  const uint64_t offset = file_size_ - pending_.size();
+  future<size_t> written = AsyncIO::global().write( fd_.fd_num(), Chunk( pending_ ), offset );
+
+  in_flight_.push_back( { move( pending_ ), move( written ),
+                          frame_count_, expected_decoder_minihash_ } );
+
+  if ( spare_buffers_.empty() ) {
+    pending_ = vector<uint8_t>();
+    pending_.reserve( buffer_size_ );
+  }
+  else {
+    pending_ = move( spare_buffers_.back() );
+    spare_buffers_.pop_back();
+  }
+}
+
+/* waits for the oldest write, reporting any error it ran into, and updates
+   the header to cover the frames it contained */
+void IVFWriter::retire_oldest()
+{
+  InFlight write = move( in_flight_.front() );
+  in_flight_.pop_front();
+
+  write.written.get();
+  write_header_fields( write.frame_count, write.expected_decoder_minihash );
+
+  write.data.clear();
+  spare_buffers_.push_back( move( write.data ) );
+}
+
+/* truncates the file, after removing the sidecars describing its old
+   contents; a rewrite with the same frame count and size would pass
+   their staleness checks */
+static int open_for_writing( const string & filename )
+{
+  for ( const string & sidecar : { IVF::index_filename( filename ),
+                                   IVF::checkpoints_filename( filename ) } ) {
+    if ( unlink( sidecar.c_str() ) < 0 and errno != ENOENT ) {
+      throw unix_error( "unlink " + sidecar );
+    }
+  }
+
+  return SystemCall( filename,
+                     open( filename.c_str(),
+                           O_RDWR | O_CREAT | O_TRUNC,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH ) );
+}
+
 IVFWriter::IVFWriter( const string & filename,
                       const string & fourcc,
                       const uint16_t width,
                       const uint16_t height,
                       const uint32_t frame_rate,
-                      const uint32_t time_scale )
-  : IVFWriter( SystemCall( filename,
-                           open( filename.c_str(),
-                                 O_RDWR | O_CREAT | O_TRUNC,
-                                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH ) ),
-               fourcc, width, height, frame_rate, time_scale )
+                      const uint32_t time_scale,
+                      const size_t buffer_size,
+                      const bool background_flush )
+  : IVFWriter( open_for_writing( filename ),
+               fourcc, width, height, frame_rate, time_scale, buffer_size, background_flush )
 {}
@@ -29,7 +29,12 @@
 #ifndef IVF_WRITER_HH
 #define IVF_WRITER_HH
 
+#include <vector>
+#include <deque>
+#include <future>
+
 #include "ivf.hh"
+#include "serialized_frame.hh"
 
 class IVFWriter
 {
@@ -37,31 +42,83 @@ private:
   FileDescriptor fd_;
   uint64_t file_size_;
   uint32_t frame_count_;
+  uint32_t expected_decoder_minihash_ { 0 };
 
   uint16_t width_;
   uint16_t height_;
 
+  /* with a nonzero buffer size, frames are collected in memory and written
+     out (and the frame count in the header fixed up) once the buffer fills
+     up, or when flush() is called; otherwise every frame is written through */
+  size_t buffer_size_;
+  std::vector<uint8_t> pending_ {};
+
+  /* in the background mode, full buffers are handed to the I/O thread
+     (see async_io.hh) and the encoder carries on filling the next one */
+  struct InFlight
+  {
+    std::vector<uint8_t> data;
+    std::future<size_t> written;
+    uint32_t frame_count;
+    uint32_t expected_decoder_minihash;
+  };
+
+  static constexpr size_t MAX_IN_FLIGHT = 2;
+
+  bool background_flush_;
+  std::deque<InFlight> in_flight_ {};
+  std::vector<std::vector<uint8_t>> spare_buffers_ {};
+
+  /* appends a frame made of the given pieces */
+  size_t append_frame( const std::vector<Chunk> & pieces, const uint64_t pts );
+
+  void write_header_fields( const uint32_t frame_count, const uint32_t minihash );
+  void write_out( const std::vector<uint8_t> & data, const uint32_t frame_count,
+                  const uint32_t minihash );
+
+  void hand_off_pending();
+  void retire_oldest();
+
 public:
   IVFWriter( const std::string & filename,
              const std::string & fourcc,
              const uint16_t width,
              const uint16_t height,
              const uint32_t frame_rate,
-             const uint32_t time_scale );
+             const uint32_t time_scale,
+             const size_t buffer_size = 0,
+             const bool background_flush = false );
 
   IVFWriter( FileDescriptor && fd,
              const std::string & fourcc,
              const uint16_t width,
              const uint16_t height,
              const uint32_t frame_rate,
-             const uint32_t time_scale );
+             const uint32_t time_scale,
+             const size_t buffer_size = 0,
+             const bool background_flush = false );
+
+  ~IVFWriter();
 
+  /* the presentation timestamp defaults to the frame's index */
   size_t append_frame( const Chunk & chunk );
+  size_t append_frame( const Chunk & chunk, const uint64_t pts );
+  size_t append_frame( const SerializedFrame & frame );
+  size_t append_frame( const SerializedFrame & frame, const uint64_t pts );
+
+  /* writes out any buffered frames and brings the header up to date */
+  void flush();
 
   void set_expected_decoder_entry_hash( const uint32_t minihash ); /* ExCamera invention */
 
+  uint32_t frame_count() const { return frame_count_; }
+
   uint16_t width() const { return width_; }
   uint16_t height() const { return height_; }
+
+  /* disallow copying or moving */
+  IVFWriter( const IVFWriter & other ) = delete;
+  IVFWriter & operator=( const IVFWriter & other ) = delete;
 };
 
 #endif /* IVF_WRITER_HH */
@@ -0,0 +1,208 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cstring>
+
+#include "lz.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* Each sequence is a token byte (literal count in the high nibble, match
+   length minus MIN_MATCH in the low nibble), the rest of the literal count,
+   the literals, a 16-bit little-endian match offset and the rest of the
+   match length. A nibble of 15 means the count continues in bytes that are
+   added up until one isn't 255. The last sequence has literals only. */
+
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t MAX_OFFSET = 65535;
+static constexpr unsigned int HASH_BITS = 14;
+
+static uint32_t load32( const uint8_t * p )
+{
+  uint32_t val;
+  memcpy( &val, p, sizeof( val ) );
+  return val;
+}
+
+static uint32_t hash32( const uint32_t val )
+{
+  return ( val * 2654435761u ) >> ( 32 - HASH_BITS );
+}
+
+static void put_length_continuation( vector<uint8_t> & output, size_t remainder )
+{
+  while ( remainder >= 255 ) {
+    output.push_back( 255 );
+    remainder -= 255;
+  }
+
+  output.push_back( remainder );
+}
+
+static void put_sequence( vector<uint8_t> & output, const uint8_t * literals,
+                          const size_t literal_count, const size_t offset,
+                          const size_t match_length )
+{
+  const size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+
+  output.push_back( ( min<size_t>( literal_count, 15 ) << 4 ) | min<size_t>( match_code, 15 ) );
+
+  if ( literal_count >= 15 ) {
+    put_length_continuation( output, literal_count - 15 );
+  }
+
+  output.insert( output.end(), literals, literals + literal_count );
+
+  if ( match_length ) {
+    output.push_back( offset & 0xff );
+    output.push_back( offset >> 8 );
+
+    if ( match_code >= 15 ) {
+      put_length_continuation( output, match_code - 15 );
+    }
+  }
+}
+
+void lz_compress( const Chunk & input, vector<uint8_t> & output )
+{
+  const uint8_t * const in = input.buffer();
+  const size_t length = input.size();
+
+  /* last position each hashed 4-byte sequence was seen at */
+  vector<uint32_t> table( 1 << HASH_BITS, 0 );
+
+  output.reserve( output.size() + length / 2 );
+
+  size_t anchor = 0;
+  size_t position = 0;
+
+  while ( position + MIN_MATCH <= length ) {
+    const uint32_t sequence = load32( in + position );
+    uint32_t & entry = table[ hash32( sequence ) ];
+    const size_t candidate = entry;
+    entry = position;
+
+    if ( candidate < position and position - candidate <= MAX_OFFSET
+         and load32( in + candidate ) == sequence ) {
+      size_t match_length = MIN_MATCH;
+      while ( position + match_length < length
+              and in[ candidate + match_length ] == in[ position + match_length ] ) {
+        match_length++;
+      }
+
+      put_sequence( output, in + anchor, position - anchor, position - candidate, match_length );
+
+      position += match_length;
+      anchor = position;
+    }
+    else {
+      /* step faster through data that doesn't compress */
+      position += 1 + ( ( position - anchor ) >> 6 );
+    }
+  }
+
+  put_sequence( output, in + anchor, length - anchor, 0, 0 );
+}
+
+size_t lz_decompress( const Chunk & input, uint8_t * output, const size_t length )
+{
+  const uint8_t * in = input.buffer();
+  const uint8_t * const in_end = in + input.size();
+  size_t produced = 0;
+
+  auto need = [&] ( const size_t count )
+    {
+      if ( static_cast<size_t>( in_end - in ) < count ) {
+        throw internal_error( "lz_decompress", "truncated input" );
+      }
+    };
+
+  auto get_length = [&] ( size_t count )
+    {
+      if ( count == 15 ) {
+        uint8_t next;
+        do {
+          need( 1 );
+          next = *in++;
+          count += next;
+        } while ( next == 255 );
+      }
+
+      return count;
+    };
+
+  while ( true ) {
+    need( 1 );
+    const uint8_t token = *in++;
+
+    const size_t literal_count = get_length( token >> 4 );
+    need( literal_count );
+    if ( literal_count > length - produced ) {
+      throw internal_error( "lz_decompress", "output overrun" );
+    }
+
+    memcpy( output + produced, in, literal_count );
+    in += literal_count;
+    produced += literal_count;
+
+    if ( produced == length ) {
+      break;
+    }
+
+    need( 2 );
+    const size_t offset = in[ 0 ] | ( in[ 1 ] << 8 );
+    in += 2;
+
+    if ( offset == 0 or offset > produced ) {
+      throw internal_error( "lz_decompress", "invalid match offset" );
+    }
+
+    const size_t match_length = get_length( token & 0xf ) + MIN_MATCH;
+    if ( match_length > length - produced ) {
+      throw internal_error( "lz_decompress", "output overrun" );
+    }
+
+    uint8_t * const destination = output + produced;
+    const uint8_t * const source = destination - offset;
+
+    if ( offset >= match_length ) {
+      memcpy( destination, source, match_length );
+    }
+    else {
+      /* the match overlaps what it produces, e.g. a run of one value */
+      for ( size_t i = 0; i < match_length; i++ ) {
+        destination[ i ] = source[ i ];
+      }
+    }
+
+    produced += match_length;
+  }
+
+  return in - input.buffer();
+}
@@ -0,0 +1,132 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef SERIALIZED_FRAME_HH
+#define SERIALIZED_FRAME_HH
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "chunk.hh"
+
+/* A frame serialized as a sequence of separately stored pieces (for VP8: the
+   frame header, the first partition, the partition sizes and the DCT
+   partitions), so that it can be written to a file or a socket with one
+   gather operation instead of being copied into a single buffer first. */
+class SerializedFrame
+{
+private:
+  std::vector<std::vector<uint8_t>> pieces_ {};
+
+public:
+  SerializedFrame() {}
+
+  /* serializing into an existing SerializedFrame reuses the storage of its
+     pieces */
+  std::vector<std::vector<uint8_t>> & mutable_pieces() { return pieces_; }
+  const std::vector<std::vector<uint8_t>> & pieces() const { return pieces_; }
+
+  size_t size() const
+  {
+    size_t total = 0;
+
+    for ( const auto & piece : pieces_ ) {
+      total += piece.size();
+    }
+
+    return total;
+  }
+
+  std::vector<Chunk> chunks() const
+  {
+    return chunks( 0, size() );
+  }
+
+  /* calls visit( Chunk ) on each of the pieces covering bytes
+     [offset, offset + length) of the frame, in order */
+  template <typename Visitor>
+  void for_each_chunk( size_t offset, size_t length, Visitor && visit ) const
+  {
+    for ( const auto & piece : pieces_ ) {
+      if ( length == 0 ) {
+        break;
+      }
+
+      if ( offset >= piece.size() ) {
+        offset -= piece.size();
+        continue;
+      }
+
+      const size_t piece_length = std::min( piece.size() - offset, length );
+      visit( Chunk( piece.data() + offset, piece_length ) );
+
+      offset = 0;
+      length -= piece_length;
+    }
+
+    if ( length > 0 ) {
+      throw std::out_of_range( "attempted to read past end of serialized frame" );
+    }
+  }
+
+  /* the pieces covering bytes [offset, offset + length) of the frame */
+  std::vector<Chunk> chunks( size_t offset, size_t length ) const
+  {
+    std::vector<Chunk> ret;
+    for_each_chunk( offset, length, [&ret]( const Chunk & chunk ) { ret.push_back( chunk ); } );
+    return ret;
+  }
+
+  void copy_to( std::vector<uint8_t> & output ) const
+  {
+    output.clear();
+    output.reserve( size() );
+
+    for ( const auto & piece : pieces_ ) {
+      output.insert( output.end(), piece.begin(), piece.end() );
+    }
+  }
+
+  std::vector<uint8_t> to_vector() const
+  {
+    std::vector<uint8_t> ret;
+    copy_to( ret );
+    return ret;
+  }
+
+  /* allow moving, but not copying */
+  SerializedFrame( SerializedFrame && other ) = default;
+  SerializedFrame & operator=( SerializedFrame && other ) = default;
+
+  SerializedFrame( const SerializedFrame & other ) = delete;
+  SerializedFrame & operator=( const SerializedFrame & other ) = delete;
+};
+
+#endif /* SERIALIZED_FRAME_HH */
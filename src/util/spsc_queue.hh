@@ -0,0 +1,121 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef SPSC_QUEUE_HH
+#define SPSC_QUEUE_HH
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+#include "optional.hh"
+
+/* A fixed-size queue between exactly one producer thread and one consumer
+   thread. Each end only ever writes its own index, so unlike BoundedQueue
+   there are no compare-and-swap loops: a push or a pop is one acquire load
+   of the other end's index and one release store of its own. Each end also
+   remembers the last index it saw of the other, and only looks again when
+   the queue seems full (or empty). */
+template <class T>
+class SPSCQueue
+{
+private:
+  /* keep the two ends on separate cache lines */
+  static constexpr size_t CACHE_LINE = 64;
+
+  std::unique_ptr<Optional<T>[]> slots_;
+  const size_t mask_;
+
+  /* written by the consumer */
+  alignas( CACHE_LINE ) std::atomic<size_t> head_ { 0 };
+  size_t cached_tail_ { 0 };
+
+  /* written by the producer */
+  alignas( CACHE_LINE ) std::atomic<size_t> tail_ { 0 };
+  size_t cached_head_ { 0 };
+
+  static size_t checked_capacity( const size_t capacity )
+  {
+    if ( capacity < 2 or ( capacity & ( capacity - 1 ) ) != 0 ) {
+      throw std::runtime_error( "SPSCQueue: capacity must be a power of two" );
+    }
+
+    return capacity;
+  }
+
+public:
+  SPSCQueue( const size_t capacity )
+    : slots_( new Optional<T>[ checked_capacity( capacity ) ] ), mask_( capacity - 1 )
+  {}
+
+  /* producer only; returns false if the queue is full */
+  bool push( T && value )
+  {
+    const size_t tail = tail_.load( std::memory_order_relaxed );
+
+    if ( tail - cached_head_ > mask_ ) {
+      cached_head_ = head_.load( std::memory_order_acquire );
+
+      if ( tail - cached_head_ > mask_ ) {
+        return false;
+      }
+    }
+
+    slots_[ tail & mask_ ].initialize( std::move( value ) );
+    tail_.store( tail + 1, std::memory_order_release );
+    return true;
+  }
+
+  /* consumer only; returns nothing if the queue is empty */
+  Optional<T> pop()
+  {
+    const size_t head = head_.load( std::memory_order_relaxed );
+
+    if ( head == cached_tail_ ) {
+      cached_tail_ = tail_.load( std::memory_order_acquire );
+
+      if ( head == cached_tail_ ) {
+        return {};
+      }
+    }
+
+    Optional<T> & slot = slots_[ head & mask_ ];
+    Optional<T> ret { std::move( slot.get() ) };
+    slot.clear();
+    head_.store( head + 1, std::memory_order_release );
+    return ret;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  /* disallow copying */
+  SPSCQueue( const SPSCQueue & other ) = delete;
+  SPSCQueue & operator=( const SPSCQueue & other ) = delete;
+};
+
+#endif /* SPSC_QUEUE_HH */
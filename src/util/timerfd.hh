@@ -0,0 +1,92 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef TIMERFD_HH
+#define TIMERFD_HH
+
+#include <chrono>
+#include <sys/timerfd.h>
+
+#include "file_descriptor.hh"
+
+/* a one-shot timer on the monotonic clock (the one steady_clock reads),
+   with microsecond deadlines, that a Poller can watch (it's readable once
+   the deadline has passed) */
+class TimerFD : public FileDescriptor
+{
+public:
+  TimerFD()
+    : FileDescriptor( SystemCall( "timerfd_create",
+                                  timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) )
+  {}
+
+  /* go off at the deadline, or right away if it has passed */
+  void arm( const std::chrono::steady_clock::time_point deadline )
+  {
+    using namespace std::chrono;
+
+    const nanoseconds since_epoch = duration_cast<nanoseconds>( deadline.time_since_epoch() );
+
+    itimerspec setting {};
+    setting.it_value.tv_sec = duration_cast<seconds>( since_epoch ).count();
+    setting.it_value.tv_nsec = ( since_epoch % seconds( 1 ) ).count();
+
+    /* all zeros would disarm the timer */
+    if ( setting.it_value.tv_sec == 0 and setting.it_value.tv_nsec == 0 ) {
+      setting.it_value.tv_nsec = 1;
+    }
+
+    SystemCall( "timerfd_settime", timerfd_settime( fd_num(), TFD_TIMER_ABSTIME, &setting, nullptr ) );
+  }
+
+  void disarm()
+  {
+    const itimerspec setting {};
+    SystemCall( "timerfd_settime", timerfd_settime( fd_num(), 0, &setting, nullptr ) );
+  }
+
+  /* how many times the timer went off since the last call (zero if it
+     hasn't, or was re-armed since) */
+  uint64_t acknowledge()
+  {
+    uint64_t expirations = 0;
+
+    if ( ::read( fd_num(), &expirations, sizeof( expirations ) ) < 0 ) {
+      if ( errno != EAGAIN ) {
+        throw unix_error( "read" );
+      }
+
+      expirations = 0;
+    }
+
+    register_read();
+    return expirations;
+  }
+};
+
+#endif /* TIMERFD_HH */
@@ -0,0 +1,191 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef WORKER_POOL_HH
+#define WORKER_POOL_HH
+
+#include <functional>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <pthread.h>
+#include <sched.h>
+
+#include "bounded_queue.hh"
+#include "eventfd.hh"
+#include "exception.hh"
+#include "optional.hh"
+
+/* Long-lived threads that take jobs off a lock-free queue and put what
+   they produce on another. Idle workers sleep on a semaphore eventfd, and
+   completions signal an eventfd that a Poller can watch. */
+template <class Job, class Result>
+class WorkerPool
+{
+public:
+  struct Completion
+  {
+    Optional<Result> result {};
+    std::exception_ptr error {};   /* set if the job threw instead */
+  };
+
+  typedef std::function<Result( Job && )> WorkType;
+
+private:
+  WorkType work_;
+
+  BoundedQueue<Job> jobs_;
+  BoundedQueue<Completion> completions_;
+
+  EventFD jobs_pending_ { true };
+  EventFD completions_ready_ {};
+
+  std::atomic<bool> shutting_down_ { false };
+  std::vector<std::thread> threads_ {};
+
+  void worker_loop()
+  {
+    while ( true ) {
+      jobs_pending_.wait_any();
+
+      if ( shutting_down_ ) {
+        return;
+      }
+
+      Optional<Job> job = jobs_.pop();
+      if ( not job.initialized() ) {
+        continue;
+      }
+
+      Completion completion;
+      try {
+        completion.result.initialize( work_( std::move( job.get() ) ) );
+      } catch ( ... ) {
+        completion.error = std::current_exception();
+      }
+
+      /* the queues are the same size, so this only spins if the owner
+         lets completions pile up */
+      while ( not completions_.push( std::move( completion ) ) ) {
+        std::this_thread::yield();
+      }
+
+      completions_ready_.signal();
+    }
+  }
+
+  void stop()
+  {
+    shutting_down_ = true;
+    jobs_pending_.signal( threads_.size() );
+
+    for ( std::thread & thread : threads_ ) {
+      thread.join();
+    }
+
+    threads_.clear();
+  }
+
+public:
+  /* the CPUs this process is allowed to run on */
+  static std::vector<int> allowed_cpus()
+  {
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    SystemCall( "sched_getaffinity", sched_getaffinity( 0, sizeof( cpus ), &cpus ) );
+
+    std::vector<int> ret;
+    for ( int cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+      if ( CPU_ISSET( cpu, &cpus ) ) {
+        ret.push_back( cpu );
+      }
+    }
+
+    return ret;
+  }
+
+  /* with pin_threads, each worker gets an allowed CPU of its own, the last
+     ones, so that the first stays free for the threads feeding the pool.
+     If there aren't enough CPUs for that, the workers are not pinned. */
+  WorkerPool( const size_t thread_count, const WorkType & work,
+              const bool pin_threads = true, const size_t capacity = 64 )
+    : work_( work ), jobs_( capacity ), completions_( capacity )
+  {
+    std::vector<int> cpus;
+
+    if ( pin_threads ) {
+      cpus = allowed_cpus();
+
+      if ( cpus.size() <= thread_count ) {
+        cpus.clear();
+      }
+    }
+
+    for ( size_t i = 0; i < thread_count; i++ ) {
+      threads_.emplace_back( &WorkerPool::worker_loop, this );
+
+      if ( not cpus.empty() ) {
+        cpu_set_t cpu;
+        CPU_ZERO( &cpu );
+        CPU_SET( cpus.at( cpus.size() - thread_count + i ), &cpu );
+
+        const int error = pthread_setaffinity_np( threads_.back().native_handle(),
+                                                  sizeof( cpu ), &cpu );
+        if ( error ) {
+          stop();
+          throw unix_error( "pthread_setaffinity_np", error );
+        }
+      }
+    }
+  }
+
+  ~WorkerPool() { stop(); }
+
+  void submit( Job && job )
+  {
+    if ( not jobs_.push( std::move( job ) ) ) {
+      throw std::runtime_error( "WorkerPool: job queue is full" );
+    }
+
+    jobs_pending_.signal();
+  }
+
+  /* readable when completions are waiting; call acknowledge() and then
+     pop() until it comes back empty */
+  FileDescriptor & completions_fd() { return completions_ready_; }
+
+  void acknowledge() { completions_ready_.wait(); }
+
+  Optional<Completion> pop() { return completions_.pop(); }
+
+  /* disallow copying */
+  WorkerPool( const WorkerPool & other ) = delete;
+  WorkerPool & operator=( const WorkerPool & other ) = delete;
+};
+
+#endif /* WORKER_POOL_HH */